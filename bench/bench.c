@@ -0,0 +1,663 @@
+/*
+ * Bryce Souers
+ * bench.c - Run the workloads of every program, measure them and compare them
+ *			 against a baseline.
+ * Usage: ./bench [-runs n] [-warmup n] [-filter text] [-json file] [-csv file]
+ *				  [-baseline file] [-tolerance percent] workload_file
+ *
+ *	-runs n				measured runs of each workload (default 5)
+ *	-warmup n			runs before those that are not measured (default 1)
+ *	-filter text		only run the workloads with text in their name
+ *	-json file			write the results as JSON
+ *	-csv file			write the results as CSV, which -baseline reads back
+ *	-baseline file		compare with the results in a CSV file: a workload whose
+ *						median wall time or peak RSS grew by more than the
+ *						tolerance is a regression, and the exit code is then 1
+ *	-tolerance percent	growth allowed before it is a regression (default 10)
+ *
+ * The workload file has a workload per line: a name, the directory to run in
+ * (relative to the workload file's directory) and a shell command, separated by
+ * whitespace. "set name value1 value2 ..." lines define parameters, and a
+ * workload that uses $name in its name or command is run once for each value,
+ * for each combination when it uses several. Lines starting with # are comments.
+ *
+ * Every run is timed from exec to exit. Its user and system time and peak RSS
+ * come from wait4(). perf_event_open() counts cycles, instructions and cache
+ * references and misses, along with task clock, page faults and context
+ * switches, for the command and every thread and process it starts. Counters
+ * the kernel does not offer (hardware counters in most virtual machines) are
+ * left empty, and so are all of them where perf_event_paranoid forbids them.
+ * Medians of the runs are reported.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#define MAX_LINE		4096
+#define MAX_VARIABLES	32
+#define MAX_VALUES		32
+#define NUM_COUNTERS	7
+#define MIN_WALL_DELTA	0.005
+#define MIN_RSS_DELTA	1024
+
+// A parameter of the workload file and its values
+typedef struct variable {
+	char name[64];
+	char *values[MAX_VALUES];
+	int num_values;
+} variable;
+
+// A workload with its parameters filled in
+typedef struct workload {
+	char *name;
+	char *directory;
+	char *command;
+} workload;
+
+// What one run measured; a counter of -1 was not available
+typedef struct measurement {
+	int status;
+	double wall;
+	double user;
+	double sys;
+	long max_rss_kb;
+	long long counters[NUM_COUNTERS];
+} measurement;
+
+// The medians of a workload's runs
+typedef struct result {
+	workload *w;
+	int runs;
+	int status;
+	double wall_median;
+	double wall_min;
+	double wall_max;
+	double user;
+	double sys;
+	long max_rss_kb;
+	long long counters[NUM_COUNTERS];
+} result;
+
+// A workload of the baseline
+typedef struct baseline_entry {
+	char *name;
+	double wall_median;
+	long max_rss_kb;
+} baseline_entry;
+
+// The counters, in the order of the CSV and JSON output
+struct counter_kind {
+	const char *name;
+	unsigned int type;
+	unsigned long long config;
+} counter_kinds[NUM_COUNTERS] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES }
+};
+
+int read_workloads(const char *path, workload **workloads);
+void expand(char *name, char *directory, char *command, variable *variables, int num_variables, workload **workloads,
+			int *num_workloads, int *capacity);
+char *substitute(const char *s, const char *name, const char *value);
+void run_once(workload *w, const char *base, measurement *m);
+void summarize(result *r, measurement *runs, int n);
+int read_baseline(const char *path, baseline_entry **entries);
+int split_csv(char *line, char **fields, int max_fields);
+void write_csv(const char *path, result *results, int n);
+void write_json(const char *path, result *results, int n);
+void put_csv_field(FILE *f, const char *s);
+void put_json_string(FILE *f, const char *s);
+int compare_doubles(const void *a, const void *b);
+int compare_longs(const void *a, const void *b);
+
+int main(int argc, char *argv[]) {
+	int runs = 5;
+	int warmup = 1;
+	const char *filter = NULL;
+	const char *json_path = NULL;
+	const char *csv_path = NULL;
+	const char *baseline_path = NULL;
+	double tolerance = 10;
+	int i = 1;
+	while(i < argc && argv[i][0] == '-') {
+		if(i + 1 >= argc) {
+			fprintf(stderr, "[ERROR] Missing value for %s.\n", argv[i]);
+			exit(1);
+		}
+		if(strcmp(argv[i], "-runs") == 0) runs = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-warmup") == 0) warmup = atoi(argv[i + 1]);
+		else if(strcmp(argv[i], "-filter") == 0) filter = argv[i + 1];
+		else if(strcmp(argv[i], "-json") == 0) json_path = argv[i + 1];
+		else if(strcmp(argv[i], "-csv") == 0) csv_path = argv[i + 1];
+		else if(strcmp(argv[i], "-baseline") == 0) baseline_path = argv[i + 1];
+		else if(strcmp(argv[i], "-tolerance") == 0) tolerance = atof(argv[i + 1]);
+		else {
+			fprintf(stderr, "[ERROR] Unknown option %s.\n", argv[i]);
+			exit(1);
+		}
+		i += 2;
+	}
+	if(runs < 1 || warmup < 0 || tolerance < 0) {
+		fprintf(stderr, "[ERROR] -runs expects a count above 0, -warmup and -tolerance 0 or more.\n");
+		exit(1);
+	}
+	if(argc - i != 1) {
+		fprintf(stderr, "[ERROR] Usage: ./bench [options] workload_file\n");
+		exit(1);
+	}
+	workload *workloads;
+	int num_workloads = read_workloads(argv[i], &workloads);
+	// Directories are relative to the workload file
+	char base[MAX_LINE];
+	snprintf(base, sizeof(base), "%s", argv[i]);
+	char *slash = strrchr(base, '/');
+	if(slash != NULL) *slash = '\0';
+	else strcpy(base, ".");
+	baseline_entry *baseline = NULL;
+	int num_baseline = baseline_path != NULL ? read_baseline(baseline_path, &baseline) : 0;
+	result *results = (result*) calloc(num_workloads > 0 ? num_workloads : 1, sizeof(result));
+	measurement *measurements = (measurement*) malloc(runs * sizeof(measurement));
+	if(results == NULL || measurements == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate results.\n");
+		exit(1);
+	}
+	int num_results = 0;
+	int regressions = 0;
+	int failures = 0;
+	printf("%-28s %10s %10s %10s %12s %14s  %s\n", "workload", "wall ms", "min ms", "RSS MB", "task ms", "cycles",
+		   baseline_path != NULL ? "vs baseline" : "");
+	for(int w = 0; w < num_workloads; w++) {
+		if(filter != NULL && strstr(workloads[w].name, filter) == NULL) continue;
+		for(int r = 0; r < warmup; r++) run_once(&workloads[w], base, &measurements[0]);
+		for(int r = 0; r < runs; r++) run_once(&workloads[w], base, &measurements[r]);
+		result *res = &results[num_results++];
+		res->w = &workloads[w];
+		summarize(res, measurements, runs);
+		if(res->status != 0) failures++;
+		printf("%-28s %10.2f %10.2f %10.1f ", res->w->name, res->wall_median * 1e3, res->wall_min * 1e3,
+			   res->max_rss_kb / 1024.0);
+		if(res->counters[4] >= 0) printf("%12.2f ", res->counters[4] / 1e6);
+		else printf("%12s ", "-");
+		if(res->counters[0] >= 0) printf("%14lld  ", res->counters[0]);
+		else printf("%14s  ", "-");
+		if(res->status != 0) printf("FAILED (exit status %d) ", res->status);
+		// Growth beyond the tolerance and beyond what timer and allocator noise can explain
+		for(int b = 0; b < num_baseline; b++) {
+			if(strcmp(baseline[b].name, res->w->name) != 0) continue;
+			double wall_change = baseline[b].wall_median > 0 ? (res->wall_median / baseline[b].wall_median - 1) * 100 : 0;
+			double rss_change = baseline[b].max_rss_kb > 0 ? ((double) res->max_rss_kb / baseline[b].max_rss_kb - 1) * 100 : 0;
+			printf("%+7.1f%% time %+7.1f%% RSS", wall_change, rss_change);
+			int slower = wall_change > tolerance && res->wall_median - baseline[b].wall_median > MIN_WALL_DELTA;
+			int bigger = rss_change > tolerance && res->max_rss_kb - baseline[b].max_rss_kb > MIN_RSS_DELTA;
+			if(slower || bigger) {
+				printf("  REGRESSION");
+				regressions++;
+			}
+			break;
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	if(results[0].w != NULL && results[0].counters[0] < 0) {
+		printf("Hardware counters are not available here (perf_event_paranoid or a virtual machine).\n");
+	}
+	if(csv_path != NULL) write_csv(csv_path, results, num_results);
+	if(json_path != NULL) write_json(json_path, results, num_results);
+	if(failures > 0) printf("%d workloads failed!\n", failures);
+	if(baseline_path != NULL) {
+		printf("%d of %d workloads regressed by more than %.0f%% against %s.\n", regressions, num_results, tolerance,
+			   baseline_path);
+	}
+	return regressions > 0 || failures > 0 ? 1 : 0;
+}
+
+/*
+ *	This function reads the workload file and expands every workload over the values of the
+ *	parameters it uses.
+ *
+ *	Parameters:
+ *		const char* path -- the workload file
+ *		workload** workloads -- set to the workloads
+ *	Return:
+ *		The number of workloads
+ */
+int read_workloads(const char *path, workload **workloads) {
+	FILE *file = fopen(path, "r");
+	if(file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open workload file %s.\n", path);
+		exit(1);
+	}
+	variable variables[MAX_VARIABLES];
+	int num_variables = 0;
+	int num_workloads = 0;
+	int capacity = 0;
+	*workloads = NULL;
+	char line[MAX_LINE];
+	while(fgets(line, sizeof(line), file) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		char *p = line + strspn(line, " \t");
+		if(*p == '\0' || *p == '#') continue;
+		char *name = strtok(p, " \t");
+		char *directory = strtok(NULL, " \t");
+		char *rest = strtok(NULL, "");
+		if(directory == NULL || rest == NULL) {
+			fprintf(stderr, "[ERROR] Workload line \"%s\" needs a name, a directory and a command.\n", name);
+			exit(1);
+		}
+		rest += strspn(rest, " \t");
+		if(strcmp(name, "set") == 0) {
+			if(num_variables == MAX_VARIABLES) {
+				fprintf(stderr, "[ERROR] More than %d parameters.\n", MAX_VARIABLES);
+				exit(1);
+			}
+			// "set name values": the directory column holds the parameter name
+			variable *v = &variables[num_variables++];
+			snprintf(v->name, sizeof(v->name), "%s", directory);
+			v->num_values = 0;
+			for(char *value = strtok(rest, " \t"); value != NULL && v->num_values < MAX_VALUES; value = strtok(NULL, " \t")) {
+				v->values[v->num_values++] = strdup(value);
+			}
+			continue;
+		}
+		expand(strdup(name), strdup(directory), strdup(rest), variables, num_variables, workloads, &num_workloads,
+			   &capacity);
+	}
+	fclose(file);
+	return num_workloads;
+}
+
+/*
+ *	This function adds a workload, once for every value of the first parameter it uses and
+ *	recursively for the others.
+ *
+ *	Parameters:
+ *		char* name -- workload name, taken over
+ *		char* directory -- its directory, taken over
+ *		char* command -- its command, taken over
+ *		variable* variables -- the parameters
+ *		int num_variables -- number of parameters
+ *		workload** workloads -- the workloads to add to
+ *		int* num_workloads -- number of workloads
+ *		int* capacity -- room in workloads
+ *	Return:
+ *		None
+ */
+void expand(char *name, char *directory, char *command, variable *variables, int num_variables, workload **workloads,
+			int *num_workloads, int *capacity) {
+	for(int v = 0; v < num_variables; v++) {
+		char reference[80];
+		snprintf(reference, sizeof(reference), "$%s", variables[v].name);
+		if(strstr(name, reference) == NULL && strstr(command, reference) == NULL) continue;
+		for(int j = 0; j < variables[v].num_values; j++) {
+			expand(substitute(name, reference, variables[v].values[j]), strdup(directory),
+				   substitute(command, reference, variables[v].values[j]), variables, num_variables, workloads,
+				   num_workloads, capacity);
+		}
+		free(name);
+		free(directory);
+		free(command);
+		return;
+	}
+	if(*num_workloads == *capacity) {
+		*capacity = *capacity > 0 ? 2 * *capacity : 32;
+		*workloads = (workload*) realloc(*workloads, *capacity * sizeof(workload));
+		if(*workloads == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate workloads.\n");
+			exit(1);
+		}
+	}
+	workload *w = &(*workloads)[(*num_workloads)++];
+	w->name = name;
+	w->directory = directory;
+	w->command = command;
+}
+
+// Replaces every occurrence of name in s with value, in a new string
+char *substitute(const char *s, const char *name, const char *value) {
+	size_t length = strlen(name);
+	size_t size = strlen(s) + 1;
+	for(const char *p = strstr(s, name); p != NULL; p = strstr(p + length, name)) size += strlen(value);
+	char *out = (char*) malloc(size);
+	if(out == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate workload.\n");
+		exit(1);
+	}
+	char *o = out;
+	const char *p;
+	while((p = strstr(s, name)) != NULL) {
+		memcpy(o, s, p - s);
+		o += p - s;
+		strcpy(o, value);
+		o += strlen(value);
+		s = p + length;
+	}
+	strcpy(o, s);
+	return out;
+}
+
+/*
+ *	This function runs a workload once. The child waits on a pipe until the counters are
+ *	attached to it, which start counting when it execs the shell, and its output is thrown
+ *	away.
+ *
+ *	Parameters:
+ *		workload* w -- the workload
+ *		const char* base -- directory the workload's directory is relative to
+ *		measurement* m -- set to what was measured
+ *	Return:
+ *		None
+ */
+void run_once(workload *w, const char *base, measurement *m) {
+	int go[2];
+	if(pipe(go) != 0) {
+		fprintf(stderr, "[ERROR] Unable to create pipe.\n");
+		exit(1);
+	}
+	fflush(stdout);
+	pid_t pid = fork();
+	if(pid < 0) {
+		fprintf(stderr, "[ERROR] Unable to create a child process.\n");
+		exit(1);
+	}
+	if(pid == 0) {
+		char directory[MAX_LINE];
+		snprintf(directory, sizeof(directory), "%s/%s", base, w->directory);
+		close(go[1]);
+		int null = open("/dev/null", O_WRONLY);
+		dup2(null, 1);
+		dup2(null, 2);
+		char byte;
+		if(chdir(directory) != 0 || read(go[0], &byte, 1) != 1) _exit(127);
+		execl("/bin/sh", "sh", "-c", w->command, (char*) NULL);
+		_exit(127);
+	}
+	close(go[0]);
+	int fds[NUM_COUNTERS];
+	for(int c = 0; c < NUM_COUNTERS; c++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = counter_kinds[c].type;
+		attr.config = counter_kinds[c].config;
+		attr.disabled = 1;
+		attr.enable_on_exec = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fds[c] = (int) syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if(write(go[1], "x", 1) != 1) {
+		fprintf(stderr, "[ERROR] Unable to start workload %s.\n", w->name);
+		exit(1);
+	}
+	close(go[1]);
+	int status;
+	struct rusage usage;
+	if(wait4(pid, &status, 0, &usage) < 0) {
+		fprintf(stderr, "[ERROR] Unable to wait for workload %s.\n", w->name);
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	m->wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	m->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6;
+	m->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	m->max_rss_kb = usage.ru_maxrss;
+	m->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+	for(int c = 0; c < NUM_COUNTERS; c++) {
+		m->counters[c] = -1;
+		if(fds[c] < 0) continue;
+		long long value;
+		if(read(fds[c], &value, sizeof(value)) == sizeof(value)) m->counters[c] = value;
+		close(fds[c]);
+	}
+}
+
+/*
+ *	This function takes the medians of the runs of a workload; the peak RSS is the largest
+ *	of them, and the status the first that was not 0.
+ *
+ *	Parameters:
+ *		result* r -- set to the summary, apart from its workload
+ *		measurement* runs -- the runs
+ *		int n -- number of runs
+ *	Return:
+ *		None
+ */
+void summarize(result *r, measurement *runs, int n) {
+	double values[n];
+	long long counters[n];
+	r->runs = n;
+	r->status = 0;
+	r->max_rss_kb = 0;
+	for(int j = 0; j < n; j++) {
+		if(r->status == 0) r->status = runs[j].status;
+		if(runs[j].max_rss_kb > r->max_rss_kb) r->max_rss_kb = runs[j].max_rss_kb;
+		values[j] = runs[j].wall;
+	}
+	qsort(values, n, sizeof(double), compare_doubles);
+	r->wall_median = values[n / 2];
+	r->wall_min = values[0];
+	r->wall_max = values[n - 1];
+	for(int j = 0; j < n; j++) values[j] = runs[j].user;
+	qsort(values, n, sizeof(double), compare_doubles);
+	r->user = values[n / 2];
+	for(int j = 0; j < n; j++) values[j] = runs[j].sys;
+	qsort(values, n, sizeof(double), compare_doubles);
+	r->sys = values[n / 2];
+	for(int c = 0; c < NUM_COUNTERS; c++) {
+		for(int j = 0; j < n; j++) counters[j] = runs[j].counters[c];
+		qsort(counters, n, sizeof(long long), compare_longs);
+		// A counter missing from any run is reported as missing
+		r->counters[c] = counters[0] < 0 ? -1 : counters[n / 2];
+	}
+}
+
+/*
+ *	This function reads the name, median wall time and peak RSS of every workload of a CSV
+ *	file written with -csv.
+ *
+ *	Parameters:
+ *		const char* path -- the CSV file
+ *		baseline_entry** entries -- set to the workloads
+ *	Return:
+ *		The number of workloads
+ */
+int read_baseline(const char *path, baseline_entry **entries) {
+	FILE *file = fopen(path, "r");
+	if(file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open baseline %s.\n", path);
+		exit(1);
+	}
+	char line[MAX_LINE];
+	char *fields[32];
+	int name = -1, wall = -1, rss = -1;
+	int n = 0, capacity = 0;
+	*entries = NULL;
+	if(fgets(line, sizeof(line), file) != NULL) {
+		int num_fields = split_csv(line, fields, 32);
+		for(int f = 0; f < num_fields; f++) {
+			if(strcmp(fields[f], "name") == 0) name = f;
+			else if(strcmp(fields[f], "wall_median_s") == 0) wall = f;
+			else if(strcmp(fields[f], "max_rss_kb") == 0) rss = f;
+		}
+	}
+	if(name < 0 || wall < 0 || rss < 0) {
+		fprintf(stderr, "[ERROR] %s is not a CSV file written with -csv.\n", path);
+		exit(1);
+	}
+	while(fgets(line, sizeof(line), file) != NULL) {
+		int num_fields = split_csv(line, fields, 32);
+		if(num_fields <= name || num_fields <= wall || num_fields <= rss) continue;
+		if(n == capacity) {
+			capacity = capacity > 0 ? 2 * capacity : 32;
+			*entries = (baseline_entry*) realloc(*entries, capacity * sizeof(baseline_entry));
+			if(*entries == NULL) {
+				fprintf(stderr, "[ERROR] Unable to allocate baseline.\n");
+				exit(1);
+			}
+		}
+		(*entries)[n].name = strdup(fields[name]);
+		(*entries)[n].wall_median = atof(fields[wall]);
+		(*entries)[n].max_rss_kb = atol(fields[rss]);
+		n++;
+	}
+	fclose(file);
+	return n;
+}
+
+// Splits a CSV line in place into at most max_fields fields, unquoting quoted ones
+int split_csv(char *line, char **fields, int max_fields) {
+	int n = 0;
+	char *p = line;
+	line[strcspn(line, "\r\n")] = '\0';
+	while(n < max_fields) {
+		if(*p == '"') {
+			char *out = ++p;
+			fields[n++] = out;
+			while(*p != '\0' && !(*p == '"' && p[1] != '"')) {
+				if(*p == '"') p++;
+				*out++ = *p++;
+			}
+			if(*p == '"') p++;
+			*out = '\0';
+			if(*p == ',') p++;
+			else break;
+		} else {
+			fields[n++] = p;
+			p += strcspn(p, ",");
+			if(*p == ',') *p++ = '\0';
+			else break;
+		}
+	}
+	return n;
+}
+
+/*
+ *	This function writes the results as CSV, a workload per line; counters that were not
+ *	available are empty.
+ *
+ *	Parameters:
+ *		const char* path -- the file
+ *		result* results -- the results
+ *		int n -- number of results
+ *	Return:
+ *		None
+ */
+void write_csv(const char *path, result *results, int n) {
+	FILE *f = fopen(path, "w");
+	if(f == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open %s.\n", path);
+		exit(1);
+	}
+	fprintf(f, "name,directory,command,runs,status,wall_median_s,wall_min_s,wall_max_s,user_s,sys_s,max_rss_kb");
+	for(int c = 0; c < NUM_COUNTERS; c++) fprintf(f, ",%s", counter_kinds[c].name);
+	fprintf(f, "\n");
+	for(int j = 0; j < n; j++) {
+		result *r = &results[j];
+		put_csv_field(f, r->w->name);
+		fprintf(f, ",");
+		put_csv_field(f, r->w->directory);
+		fprintf(f, ",");
+		put_csv_field(f, r->w->command);
+		fprintf(f, ",%d,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%ld", r->runs, r->status, r->wall_median, r->wall_min, r->wall_max,
+				r->user, r->sys, r->max_rss_kb);
+		for(int c = 0; c < NUM_COUNTERS; c++) {
+			if(r->counters[c] >= 0) fprintf(f, ",%lld", r->counters[c]);
+			else fprintf(f, ",");
+		}
+		fprintf(f, "\n");
+	}
+	fclose(f);
+}
+
+/*
+ *	This function writes the results as a JSON array of objects; counters that were not
+ *	available are null.
+ *
+ *	Parameters:
+ *		const char* path -- the file
+ *		result* results -- the results
+ *		int n -- number of results
+ *	Return:
+ *		None
+ */
+void write_json(const char *path, result *results, int n) {
+	FILE *f = fopen(path, "w");
+	if(f == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open %s.\n", path);
+		exit(1);
+	}
+	fprintf(f, "[\n");
+	for(int j = 0; j < n; j++) {
+		result *r = &results[j];
+		fprintf(f, "  {\"name\": ");
+		put_json_string(f, r->w->name);
+		fprintf(f, ", \"directory\": ");
+		put_json_string(f, r->w->directory);
+		fprintf(f, ", \"command\": ");
+		put_json_string(f, r->w->command);
+		fprintf(f, ",\n   \"runs\": %d, \"status\": %d, \"wall_median_s\": %.6f, \"wall_min_s\": %.6f, \"wall_max_s\": %.6f,\n",
+				r->runs, r->status, r->wall_median, r->wall_min, r->wall_max);
+		fprintf(f, "   \"user_s\": %.6f, \"sys_s\": %.6f, \"max_rss_kb\": %ld", r->user, r->sys, r->max_rss_kb);
+		for(int c = 0; c < NUM_COUNTERS; c++) {
+			fprintf(f, c % 4 == 0 ? ",\n   \"%s\": " : ", \"%s\": ", counter_kinds[c].name);
+			if(r->counters[c] >= 0) fprintf(f, "%lld", r->counters[c]);
+			else fprintf(f, "null");
+		}
+		fprintf(f, "}%s\n", j + 1 < n ? "," : "");
+	}
+	fprintf(f, "]\n");
+	fclose(f);
+}
+
+// Writes a CSV field, quoted when it holds commas or quotes
+void put_csv_field(FILE *f, const char *s) {
+	if(strpbrk(s, ",\"") == NULL) {
+		fputs(s, f);
+		return;
+	}
+	fputc('"', f);
+	for(; *s != '\0'; s++) {
+		if(*s == '"') fputc('"', f);
+		fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+// Writes a JSON string with quotes, backslashes and control characters escaped
+void put_json_string(FILE *f, const char *s) {
+	fputc('"', f);
+	for(; *s != '\0'; s++) {
+		if(*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+		else if((unsigned char) *s < ' ') fprintf(f, "\\u%04x", *s);
+		else fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+int compare_doubles(const void *a, const void *b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+int compare_longs(const void *a, const void *b) {
+	long long x = *(const long long*) a, y = *(const long long*) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
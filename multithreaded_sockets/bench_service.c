@@ -0,0 +1,284 @@
+/*
+ * Bryce Souers
+ * bench_service.c - Measure how the employee service scales with its shards.
+ * Usage: ./bench_service [-shards list] [-threads n] [-batch n] [-seconds s]
+ *                        [-employees n] [-service-time us] [-port n] [-server path]
+ *
+ *  -shards list        comma-separated shard counts to measure (default 1,2,4)
+ *  -threads n          client threads looking up batches, each with a pooled
+ *                      connection to every shard (default 8)
+ *  -batch n            employee IDs per lookup (default 32)
+ *  -seconds s          time each shard count runs for (default 2)
+ *  -employees n        employees in the service (default 100000)
+ *  -service-time us    emulate storage on every shard that serves one lookup at a
+ *                      time for this long (default 0, the plain server)
+ *  -port n             port of shard 0, the others follow it (default 9100)
+ *  -server path        the server to start (default ./server)
+ *
+ * For every shard count the shards are started as separate server processes
+ * on localhost and the client threads look up random batches through the
+ * client library until the time is up. One ID in sixteen is not in the table.
+ * Every answer is checked against the table the servers were built from, and
+ * the exit code is 1 when any was wrong.
+ *
+ * By default the servers answer from memory, so the lookups are bound by CPU
+ * and scale only with the cores the servers and client threads get; on one
+ * core more shards only add overhead. With -service-time the run is labelled
+ * as emulated storage: every shard then holds a lookup for the service time
+ * behind one lock, which is what more shards relieve, so its speedup shows
+ * the fan-out working rather than what the plain server gets.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "employee_client.h"
+
+#define MAX_SHARD_COUNTS 16
+
+// A client thread's share of the run
+typedef struct bench_thread {
+    pthread_t thread;
+    employee_client* client;
+    int batch;
+    unsigned long employees;
+    unsigned long random;
+    unsigned long lookups;
+    unsigned long batches;
+    unsigned long mismatches;
+    unsigned long failures;
+    double latency_sum;
+    double latency_max;
+} bench_thread;
+
+volatile int stop;
+
+void* bench_worker(void* args);
+pid_t start_server(const char* server, int port, int shard, int shards, unsigned long employees, long service_time);
+double now_seconds(void);
+unsigned long next_random(unsigned long* state);
+
+int main(int argc, char* argv[]) {
+    int shard_counts[MAX_SHARD_COUNTS] = { 1, 2, 4 };
+    int num_shard_counts = 3;
+    int threads = 8, batch = 32, port = 9100;
+    double seconds = 2;
+    unsigned long employees = 100000;
+    long service_time = 0;
+    const char* server = "./server";
+    int i, t, s;
+    for(i = 1; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "-shards") == 0) {
+            char* p = argv[i + 1];
+            num_shard_counts = 0;
+            while(*p != '\0' && num_shard_counts < MAX_SHARD_COUNTS) {
+                shard_counts[num_shard_counts++] = (int) strtol(p, &p, 10);
+                if(*p == ',') p++;
+            }
+        } else if(strcmp(argv[i], "-threads") == 0) threads = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "-batch") == 0) batch = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "-seconds") == 0) seconds = atof(argv[i + 1]);
+        else if(strcmp(argv[i], "-employees") == 0) employees = strtoul(argv[i + 1], NULL, 10);
+        else if(strcmp(argv[i], "-service-time") == 0) service_time = atol(argv[i + 1]);
+        else if(strcmp(argv[i], "-port") == 0) port = atoi(argv[i + 1]);
+        else if(strcmp(argv[i], "-server") == 0) server = argv[i + 1];
+        else break;
+    }
+    if(i < argc) {
+        fprintf(stderr, "[ERROR] Usage: ./bench_service [-shards list] [-threads n] [-batch n] [-seconds s] "
+                "[-employees n] [-service-time us] [-port n] [-server path]\n");
+        exit(1);
+    }
+    for(s = 0; s < num_shard_counts; s++) {
+        if(shard_counts[s] < 1) {
+            fprintf(stderr, "[ERROR] Shard counts must be at least 1.\n");
+            exit(1);
+        }
+    }
+    if(threads < 1 || batch < 1 || seconds <= 0 || employees < 1 || employees > MAX_EMPLOYEES) {
+        fprintf(stderr, "[ERROR] Threads, batch, seconds and employees must be above 0, employees at most %d.\n", MAX_EMPLOYEES);
+        exit(1);
+    }
+    bench_thread* workers = (bench_thread*) calloc(threads, sizeof(bench_thread));
+    if(workers == NULL) {
+        fprintf(stderr, "[ERROR] Unable to allocate client threads.\n");
+        exit(1);
+    }
+    printf("%d client threads, batches of %d, %lu employees, ", threads, batch, employees);
+    if(service_time > 0) printf("EMULATED STORAGE: %ld us per lookup, one at a time on a shard\n", service_time);
+    else printf("servers answering from memory\n");
+    printf("Shards   Lookups/s   Speedup  Efficiency  Batch avg ms  Batch max ms  Wrong answers\n");
+    double first_rate = 0;
+    int wrong = 0;
+    for(s = 0; s < num_shard_counts; s++) {
+        int shards = shard_counts[s];
+        pid_t servers[shards];
+        for(i = 0; i < shards; i++) servers[i] = start_server(server, port + i, i, shards, employees, service_time);
+        // Give the shards time to build their tables and listen
+        employee_client* client = NULL;
+        double deadline = now_seconds() + 10;
+        while(client == NULL && now_seconds() < deadline) {
+            client = employee_client_open("localhost", port, shards, threads);
+            if(client == NULL) usleep(10000);
+        }
+        if(client == NULL) {
+            fprintf(stderr, "[ERROR] Unable to connect to %d shards from port %d.\n", shards, port);
+            for(i = 0; i < shards; i++) kill(servers[i], SIGTERM);
+            exit(1);
+        }
+        stop = 0;
+        double start = now_seconds();
+        for(t = 0; t < threads; t++) {
+            bench_thread* w = &workers[t];
+            memset(w, 0, sizeof(bench_thread));
+            w->client = client;
+            w->batch = batch;
+            w->employees = employees;
+            w->random = 0x9E3779B97F4A7C15UL * (t + 1);
+            if(pthread_create(&w->thread, NULL, bench_worker, w)) {
+                fprintf(stderr, "[ERROR] Unable to create client thread.\n");
+                exit(1);
+            }
+        }
+        usleep((useconds_t) (seconds * 1e6));
+        stop = 1;
+        unsigned long lookups = 0, batches = 0, mismatches = 0, failures = 0;
+        double latency_sum = 0, latency_max = 0;
+        for(t = 0; t < threads; t++) {
+            pthread_join(workers[t].thread, NULL);
+            lookups += workers[t].lookups;
+            batches += workers[t].batches;
+            mismatches += workers[t].mismatches;
+            failures += workers[t].failures;
+            latency_sum += workers[t].latency_sum;
+            if(workers[t].latency_max > latency_max) latency_max = workers[t].latency_max;
+        }
+        double elapsed = now_seconds() - start;
+        employee_client_close(client);
+        for(i = 0; i < shards; i++) kill(servers[i], SIGTERM);
+        for(i = 0; i < shards; i++) waitpid(servers[i], NULL, 0);
+        if(failures > 0) {
+            fprintf(stderr, "[ERROR] %lu lookups failed on a lost connection.\n", failures);
+            exit(1);
+        }
+        // Speedup is over the first shard count, efficiency over its throughput per shard
+        double rate = lookups / elapsed;
+        if(s == 0) first_rate = rate;
+        printf("%6d %11.0f %8.2fx %10.1f%% %13.3f %13.3f %14lu\n", shards, rate, rate / first_rate,
+               100.0 * rate * shard_counts[0] / (first_rate * shards), batches ? 1e3 * latency_sum / batches : 0.0,
+               1e3 * latency_max, mismatches);
+        fflush(stdout);
+        if(mismatches > 0) wrong = 1;
+    }
+    free(workers);
+    return wrong;
+}
+
+/*
+ *  This function looks up random batches until the run stops, checking every answer
+ *  against the employee the ID belongs to.
+ *
+ *  Parameters:
+ *      void* args -- the bench_thread of this thread
+ *  Return:
+ *      NULL
+ */
+void* bench_worker(void* args) {
+    bench_thread* w = (bench_thread*) args;
+    char (*names)[EMPLOYEE_ID_SIZE] = malloc(w->batch * sizeof(*names));
+    const char** ids = (const char**) malloc(w->batch * sizeof(char*));
+    unsigned long* picks = (unsigned long*) malloc(w->batch * sizeof(unsigned long));
+    employee_info* results = (employee_info*) malloc(w->batch * sizeof(employee_info));
+    int* found = (int*) malloc(w->batch * sizeof(int));
+    if(names == NULL || ids == NULL || picks == NULL || results == NULL || found == NULL) {
+        fprintf(stderr, "[ERROR] Unable to allocate lookup batch.\n");
+        exit(1);
+    }
+    int i;
+    while(!stop) {
+        for(i = 0; i < w->batch; i++) {
+            unsigned long r = next_random(&w->random);
+            picks[i] = r % w->employees;
+            // One lookup in sixteen asks for someone who is not there
+            if((r >> 40) % 16 == 0) {
+                picks[i] = w->employees;
+                snprintf(names[i], EMPLOYEE_ID_SIZE, "nobody%07lu", (r >> 8) % 10000000);
+            } else {
+                employee_info e;
+                employee_make(picks[i], &e);
+                strcpy(names[i], e.ID);
+            }
+            ids[i] = names[i];
+        }
+        double start = now_seconds();
+        if(employee_client_lookup(w->client, ids, w->batch, results, found) < 0) {
+            w->failures++;
+            break;
+        }
+        double latency = now_seconds() - start;
+        w->latency_sum += latency;
+        if(latency > w->latency_max) w->latency_max = latency;
+        for(i = 0; i < w->batch; i++) {
+            employee_info e;
+            if(picks[i] == w->employees) {
+                w->mismatches += found[i];
+                continue;
+            }
+            employee_make(picks[i], &e);
+            if(!found[i] || strcmp(results[i].ID, e.ID) != 0 || strcmp(results[i].name, e.name) != 0 ||
+               results[i].salary < e.salary - 0.005 || results[i].salary > e.salary + 0.005) w->mismatches++;
+        }
+        w->lookups += w->batch;
+        w->batches++;
+    }
+    free(names);
+    free(ids);
+    free(picks);
+    free(results);
+    free(found);
+    return NULL;
+}
+
+// Start shard i of n as a quiet server process, its greeting thrown away
+pid_t start_server(const char* server, int port, int shard, int shards, unsigned long employees, long service_time) {
+    char port_arg[16], shard_arg[32], employees_arg[32], time_arg[32];
+    snprintf(port_arg, sizeof(port_arg), "%d", port);
+    snprintf(shard_arg, sizeof(shard_arg), "%d/%d", shard, shards);
+    snprintf(employees_arg, sizeof(employees_arg), "%lu", employees);
+    snprintf(time_arg, sizeof(time_arg), "%ld", service_time);
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) {
+        fprintf(stderr, "[ERROR] Unable to start server.\n");
+        exit(1);
+    }
+    if(pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if(null >= 0) dup2(null, STDOUT_FILENO);
+        execl(server, server, port_arg, "-shard", shard_arg, "-employees", employees_arg,
+              "-service-time", time_arg, "-quiet", (char*) NULL);
+        fprintf(stderr, "[ERROR] Unable to run %s.\n", server);
+        _exit(1);
+    }
+    return pid;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64* random numbers
+unsigned long next_random(unsigned long* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DUL;
+}
@@ -1,10 +1,21 @@
+/*
+ * Bryce Souers
+ * client.c - Interactive client of the employee salary service.
+ * Usage: ./client server-name port-number [-shards n]
+ *
+ *  -shards n   the service runs as n shards on port-number and the ports after it
+ *              (default 1)
+ *
+ * Several IDs entered on one line are looked up as one batch, fanned out to
+ * their shards in parallel.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h>
-#include <unistd.h>
+#include "employee_client.h"
+
+#define MAX_BATCH 64
 
 void clear_stdin(FILE* fp) {
     int c;
@@ -12,18 +23,15 @@ void clear_stdin(FILE* fp) {
 }
 
 int main(int argc, char** argv) {
-    // Structures to hold server data
-    struct sockaddr_in sad;
-    int clientSocket;
-    struct hostent *ptrh;
-
-    // Host name and port
+    // Host name, port and shards
     char *host;
     int port;
+    int shards = 1;
 
     // Check for valid argument usage
-    if(argc != 3) {
-        fprintf(stderr, "Usage: %s server-name port-number\n", argv[0]);
+    if(argc == 5 && strcmp(argv[3], "-shards") == 0) shards = atoi(argv[4]);
+    else if(argc != 3) {
+        fprintf(stderr, "Usage: %s server-name port-number [-shards n]\n", argv[0]);
         exit(1);
     }
 
@@ -33,106 +41,67 @@ int main(int argc, char** argv) {
     // Extract and convert port number from arguments
     port = atoi(argv[2]);
 
-    // Create client socket
-    clientSocket = socket(PF_INET, SOCK_STREAM, 0);
-    if(clientSocket < 0) {
-        fprintf(stderr, "socket creation failed\n");
-        exit(1);
-    }
-    printf("CLIENT >> Client socket successfully created.\n");
-
-    // Connect client socket to server socket
-    memset((char *)&sad,0,sizeof(sad));
-    sad.sin_family = AF_INET;
-    sad.sin_port = htons((u_short)port);
-    ptrh = gethostbyname(host);
-    if(((char *) ptrh) == NULL) {
-        fprintf(stderr,"invalid host: %s\n", host);
-        exit(1);
-    }
-    memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
-    if(connect(clientSocket, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
-        fprintf(stderr,"connect failed\n");
+    // Connect to every shard
+    employee_client* client = employee_client_open(host, port, shards, 1);
+    if(client == NULL) {
+        fprintf(stderr,"connect failed: %s ports %d to %d\n", host, port, port + shards - 1);
         exit(1);
     }
-    printf("CLIENT >> Client socket successfully connected to local server socket.\n");
-
-
-    // Initial welcome message
+    printf("CLIENT >> Client successfully connected to %d server shard%s.\n", shards, shards == 1 ? "" : "s");
 
     // Main loop - continually ask and handle menu options
     int option;
-    char em_ID[32];
+    char line[1024];
     for(;;) {
         printf("\nCLIENT >> Choose an option below:\n");
-        printf("       >> [ 1 ] Get salary of an employee.\n");
+        printf("       >> [ 1 ] Get salary of employees.\n");
         printf("       >> [ 2 ] Exit.\n");
         printf("       >> Enter an option: ");
         option = -1;
-        scanf("%d", &option);
+        if(scanf("%d", &option) == EOF) break;
+        clear_stdin(stdin);
         if(option < 1 || option > 2) {
             printf("CLIENT >> [ERROR] Invalid answer. Try again...\n");
-            clear_stdin(stdin);
             continue;
         }
         if(option == 2) break;
         if(option == 1) {
-            printf("\nCLIENT >> Enter an employee ID: ");
-            scanf("%s", em_ID);
-            char request[64] = "GETSALARY ";
-            strcat(request, em_ID);
-            int num_bytes_sent = sizeof(request);
-            if(write(clientSocket, request, num_bytes_sent) != num_bytes_sent) {
-                printf("CLIENT >> [ERROR] Failed to send request to server.\n");
-                continue;
+            printf("\nCLIENT >> Enter employee IDs, separated by spaces: ");
+            if(fgets(line, sizeof(line), stdin) == NULL) break;
+            const char* ids[MAX_BATCH];
+            int count = 0;
+            char *save_token;
+            char *token = strtok_r(line, " \t\r\n", &save_token);
+            while(token != NULL && count < MAX_BATCH) {
+                ids[count++] = token;
+                token = strtok_r(NULL, " \t\r\n", &save_token);
             }
-            printf("CLIENT >> Sent request [%s] to server...\n", request);
+            if(count == 0) continue;
 
-            char response[256];
-            if(read(clientSocket, response, 256) <= 0) {
+            employee_info results[MAX_BATCH];
+            int found[MAX_BATCH];
+            if(employee_client_lookup(client, ids, count, results, found) < 0) {
                 printf("CLIENT >> [ERROR] Failed to receive correct response from server.\n");
-                continue;
-            }
-            if(strcmp(response, "ERROR") == 0) {
-                printf("CLIENT >> [ERROR] Server claims employee ID is invalid.\n");
-                continue;
+                exit(EXIT_FAILURE);
             }
 
             printf("CLIENT >> Response from server:\n");
-            char *save_token;
-            char *token;
-            token = strtok_r(response, "|", &save_token);
-            int token_i = 0;
-            while(token != NULL) {
-                printf("       >> ");
-                switch(token_i) {
-                    case 0:
-                        printf("ID: %s\n", token);
-                        break;
-                    case 1:
-                        printf("Name: %s\n", token);
-                        break;
-                    case 2:
-                        printf("Salary: %s\n", token);
-                        break;
-                    default:
-                        printf("Invalid token: %s\n", token);
-                        break;
+            int i;
+            for(i = 0; i < count; i++) {
+                if(!found[i]) {
+                    printf("       >> [ERROR] Server claims employee ID %s is invalid.\n", ids[i]);
+                    continue;
                 }
-                token = strtok_r(NULL, "|", &save_token);
-                token_i++;
+                printf("       >> ID: %s\n", results[i].ID);
+                printf("       >> Name: %s\n", results[i].name);
+                printf("       >> Salary: %lf\n", results[i].salary);
             }
         }
     }
 
     printf("CLIENT >> Exiting...\n");
-    char exit_request[5] = "STOP";
-    if(write(clientSocket, exit_request, 5) != 5) {
-        printf("CLIENT >> [ERROR] Failed to send exit notification to server.\n");
-        exit(EXIT_FAILURE);
-    }
-    close(clientSocket);
+    employee_client_close(client);
     printf("CLIENT >> Goodbye.\n");
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,248 @@
+/*
+ * Bryce Souers
+ * employee_client.c - Client library of the sharded employee service.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include "employee_client.h"
+
+// A shard's part of a batch: its requests and responses are the frames from first on
+typedef struct shard_batch {
+    int shard;
+    int fd;
+    int first;
+    size_t request_bytes;
+    size_t response_bytes;
+    size_t sent;
+    size_t received;
+} shard_batch;
+
+static int connect_to(const struct sockaddr_in* address, int port);
+static int pool_take(employee_pool* pool);
+static void pool_give(employee_pool* pool, int fd);
+
+employee_client* employee_client_open(const char* host, int base_port, int shards, int pool_size) {
+    struct hostent* ptrh = gethostbyname(host);
+    if(ptrh == NULL || shards < 1 || pool_size < 1) return NULL;
+    employee_client* client = (employee_client*) calloc(1, sizeof(employee_client));
+    if(client == NULL) return NULL;
+    client->shards = shards;
+    client->pool_size = pool_size;
+    client->base_port = base_port;
+    client->address.sin_family = AF_INET;
+    memcpy(&client->address.sin_addr, ptrh->h_addr, ptrh->h_length);
+    client->pools = (employee_pool*) calloc(shards, sizeof(employee_pool));
+    if(client->pools == NULL) {
+        free(client);
+        return NULL;
+    }
+    int s, i;
+    for(s = 0; s < shards; s++) {
+        employee_pool* pool = &client->pools[s];
+        pthread_mutex_init(&pool->lock, NULL);
+        pthread_cond_init(&pool->available, NULL);
+        pool->fds = (int*) malloc(pool_size * sizeof(int));
+        if(pool->fds == NULL) {
+            client->shards = s + 1;
+            employee_client_close(client);
+            return NULL;
+        }
+        for(i = 0; i < pool_size; i++) {
+            int fd = connect_to(&client->address, base_port + s);
+            if(fd < 0) {
+                client->shards = s + 1;
+                employee_client_close(client);
+                return NULL;
+            }
+            pool->fds[pool->free_count++] = fd;
+        }
+    }
+    return client;
+}
+
+/*
+ *  This function looks up a batch of employees across the shards. The IDs are grouped
+ *  by shard, one pooled connection of every shard involved is taken (in shard order, so
+ *  concurrent lookups cannot deadlock on the pools), and all requests go out while the
+ *  answers come back, multiplexed over the connections with poll(). A connection that
+ *  fails partway may still have answers in flight, so it is closed instead of going back
+ *  to the pool, and the next lookup that takes its slot connects again.
+ *
+ *  Parameters:
+ *      employee_client* client -- the client
+ *      const char* const* ids -- the employee IDs
+ *      int count -- number of IDs
+ *      employee_info* results -- filled in for each ID found
+ *      int* found -- set to 1 for each ID found, 0 otherwise
+ *  Return:
+ *      number of IDs found, -1 when a connection failed
+ */
+int employee_client_lookup(employee_client* client, const char* const* ids, int count,
+                           employee_info* results, int* found) {
+    int shards = client->shards;
+    int i, s, j, active = 0, pending, failed = 0, num_found = 0;
+    if(count <= 0) return 0;
+    int* start = (int*) calloc(shards + 1, sizeof(int));
+    int* order = (int*) malloc(count * sizeof(int));
+    int* shard_of = (int*) malloc(count * sizeof(int));
+    char* requests = (char*) malloc((size_t) count * REQUEST_SIZE);
+    char* responses = (char*) malloc((size_t) count * RESPONSE_SIZE);
+    shard_batch* batches = (shard_batch*) malloc(shards * sizeof(shard_batch));
+    struct pollfd* polls = (struct pollfd*) malloc(shards * sizeof(struct pollfd));
+    int* polled = (int*) malloc(shards * sizeof(int));
+    if(start == NULL || order == NULL || shard_of == NULL || requests == NULL || responses == NULL ||
+       batches == NULL || polls == NULL || polled == NULL) {
+        fprintf(stderr, "[ERROR] Unable to allocate lookup batch.\n");
+        exit(1);
+    }
+    // Group the IDs by shard, keeping their order within a shard
+    for(i = 0; i < count; i++) {
+        shard_of[i] = employee_shard(ids[i], shards);
+        start[shard_of[i] + 1]++;
+    }
+    for(s = 0; s < shards; s++) start[s + 1] += start[s];
+    for(i = 0; i < count; i++) order[start[shard_of[i]]++] = i;
+    for(s = shards; s > 0; s--) start[s] = start[s - 1];
+    start[0] = 0;
+    for(j = 0; j < count; j++) request_format(requests + (size_t) j * REQUEST_SIZE, ids[order[j]]);
+    for(s = 0; s < shards; s++) {
+        int n = start[s + 1] - start[s];
+        if(n == 0) continue;
+        shard_batch* b = &batches[active++];
+        b->shard = s;
+        b->fd = pool_take(&client->pools[s]);
+        if(b->fd < 0) b->fd = connect_to(&client->address, client->base_port + s);
+        b->first = start[s];
+        b->request_bytes = (size_t) n * REQUEST_SIZE;
+        b->response_bytes = (size_t) n * RESPONSE_SIZE;
+        b->sent = 0;
+        b->received = 0;
+        if(b->fd < 0 && !failed) {
+            fprintf(stderr, "[ERROR] Unable to reconnect to shard %d.\n", s);
+            failed = 1;
+        }
+    }
+    // Write requests and read answers of every shard as its connection becomes ready
+    pending = active;
+    while(pending > 0 && !failed) {
+        int num_polls = 0;
+        for(i = 0; i < active; i++) {
+            shard_batch* b = &batches[i];
+            if(b->received == b->response_bytes) continue;
+            polls[num_polls].fd = b->fd;
+            polls[num_polls].events = POLLIN | (b->sent < b->request_bytes ? POLLOUT : 0);
+            polls[num_polls].revents = 0;
+            polled[num_polls++] = i;
+        }
+        if(poll(polls, num_polls, -1) < 0) {
+            if(errno == EINTR) continue;
+            failed = 1;
+            break;
+        }
+        for(j = 0; j < num_polls; j++) {
+            shard_batch* b = &batches[polled[j]];
+            ssize_t n;
+            if(polls[j].revents & POLLOUT) {
+                n = send(b->fd, requests + (size_t) b->first * REQUEST_SIZE + b->sent, b->request_bytes - b->sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+                if(n > 0) b->sent += n;
+                else if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) failed = 1;
+            }
+            if(polls[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+                n = recv(b->fd, responses + (size_t) b->first * RESPONSE_SIZE + b->received,
+                         b->response_bytes - b->received, MSG_DONTWAIT);
+                if(n > 0) {
+                    b->received += n;
+                    if(b->received == b->response_bytes) pending--;
+                } else if(n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) failed = 1;
+            }
+            if(failed) {
+                fprintf(stderr, "[ERROR] Lost the connection to shard %d.\n", b->shard);
+                break;
+            }
+        }
+    }
+    for(i = 0; i < active; i++) {
+        shard_batch* b = &batches[i];
+        if(b->fd >= 0 && b->received < b->response_bytes) {
+            close(b->fd);
+            b->fd = -1;
+        }
+        pool_give(&client->pools[b->shard], b->fd);
+    }
+    // Gather the answers in the order of the IDs
+    for(j = 0; j < count && !failed; j++) {
+        i = order[j];
+        found[i] = response_parse(responses + (size_t) j * RESPONSE_SIZE, &results[i]);
+        num_found += found[i];
+    }
+    free(start);
+    free(order);
+    free(shard_of);
+    free(requests);
+    free(responses);
+    free(batches);
+    free(polls);
+    free(polled);
+    return failed ? -1 : num_found;
+}
+
+void employee_client_close(employee_client* client) {
+    char stop_request[REQUEST_SIZE] = "STOP";
+    int s, i;
+    for(s = 0; s < client->shards; s++) {
+        employee_pool* pool = &client->pools[s];
+        for(i = 0; i < pool->free_count; i++) {
+            if(pool->fds[i] < 0) continue;
+            send(pool->fds[i], stop_request, REQUEST_SIZE, MSG_NOSIGNAL);
+            close(pool->fds[i]);
+        }
+        free(pool->fds);
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->available);
+    }
+    free(client->pools);
+    free(client);
+}
+
+// Open a connection to a shard. Small frames go out right away instead of waiting for Nagle.
+static int connect_to(const struct sockaddr_in* address, int port) {
+    struct sockaddr_in sad = *address;
+    int one = 1;
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    sad.sin_port = htons((u_short)port);
+    if(connect(fd, (struct sockaddr *)&sad, sizeof(sad)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+// Take an idle connection of a shard, waiting for one when all are busy. A slot whose
+// connection was closed after a failure comes back as -1.
+static int pool_take(employee_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->free_count == 0) pthread_cond_wait(&pool->available, &pool->lock);
+    int fd = pool->fds[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+    return fd;
+}
+
+static void pool_give(employee_pool* pool, int fd) {
+    pthread_mutex_lock(&pool->lock);
+    pool->fds[pool->free_count++] = fd;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * Bryce Souers
+ * employee_client.h - Client library of the sharded employee service.
+ *
+ * Shard i of n listens on base_port + i. The client keeps pool_size
+ * persistent connections to every shard, so up to pool_size threads can look
+ * up at once. A batch lookup takes one connection of every shard the batch
+ * touches, sends each shard all of its requests back to back and gathers
+ * the answers of all shards at once with poll(), so the shards work on a
+ * batch in parallel.
+ */
+
+#ifndef EMPLOYEE_CLIENT_H
+#define EMPLOYEE_CLIENT_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include "employee_proto.h"
+
+// Idle connections of one shard, -1 for one closed after a failure
+typedef struct employee_pool {
+    int* fds;
+    int free_count;
+    pthread_mutex_t lock;
+    pthread_cond_t available;
+} employee_pool;
+
+typedef struct employee_client {
+    int shards;
+    int pool_size;
+    int base_port;
+    struct sockaddr_in address;
+    employee_pool* pools;
+} employee_client;
+
+// Connect pool_size times to each of the shards, returning NULL when a shard is unreachable
+employee_client* employee_client_open(const char* host, int base_port, int shards, int pool_size);
+
+// Look up count employee IDs; results[i] and found[i] answer ids[i]. Returns the number
+// found, or -1 when a shard connection failed.
+int employee_client_lookup(employee_client* client, const char* const* ids, int count,
+                           employee_info* results, int* found);
+
+// Say STOP on every connection and release the client
+void employee_client_close(employee_client* client);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Bryce Souers
+ * employee_proto.c - Wire format of the employee service and the employee
+ *                    tables its servers hold.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "employee_proto.h"
+
+// Psuedo employee database the service started with
+static const employee_info classic[CLASSIC_EMPLOYEES] = {
+    { "abc000", "name0", 10000.0 },
+    { "abc001", "name1", 10001.1 },
+    { "abc002", "name2", 10002.2 },
+    { "abc003", "name3", 10003.3 },
+    { "abc004", "name4", 10004.4 },
+    { "abc005", "name5", 10005.5 },
+    { "abc006", "name6", 10006.6 },
+    { "abc007", "name7", 10007.7 },
+    { "abc008", "name8", 10008.8 },
+    { "abc009", "name9", 10009.9 },
+};
+
+// FNV-1a over the ID, so clients and servers agree on shards without sharing state
+int employee_shard(const char* ID, int shards) {
+    unsigned long hash = 14695981039346656037UL;
+    for(; *ID != '\0'; ID++) {
+        hash ^= (unsigned char) *ID;
+        hash *= 1099511628211UL;
+    }
+    return (int) (hash % (unsigned long) shards);
+}
+
+// Synthetic employees are numbered after the classic ones and have a salary that follows
+// from their number, so a client can check every answer
+void employee_make(unsigned long i, employee_info* e) {
+    if(i < CLASSIC_EMPLOYEES) {
+        *e = classic[i];
+        return;
+    }
+    i %= MAX_EMPLOYEES;
+    snprintf(e->ID, EMPLOYEE_ID_SIZE, "emp%07lu", i);
+    snprintf(e->name, EMPLOYEE_NAME_SIZE, "name%lu", i);
+    e->salary = 20000.0 + (double) (i * 7919 % 100000) / 10.0;
+}
+
+void request_format(char* request, const char* ID) {
+    memset(request, 0, REQUEST_SIZE);
+    snprintf(request, REQUEST_SIZE, "GETSALARY %s", ID);
+}
+
+void response_format(char* response, const employee_info* e) {
+    memset(response, 0, RESPONSE_SIZE);
+    if(e == NULL) strcpy(response, "ERROR");
+    else snprintf(response, RESPONSE_SIZE, "%s|%s|%lf", e->ID, e->name, e->salary);
+}
+
+int response_parse(const char* response, employee_info* e) {
+    const char* name = memchr(response, '|', RESPONSE_SIZE);
+    if(name == NULL) return 0;
+    const char* salary = memchr(name + 1, '|', RESPONSE_SIZE - (name + 1 - response));
+    if(salary == NULL) return 0;
+    size_t id_length = name - response < EMPLOYEE_ID_SIZE ? (size_t) (name - response) : EMPLOYEE_ID_SIZE - 1;
+    size_t name_length = salary - name - 1 < EMPLOYEE_NAME_SIZE ? (size_t) (salary - name - 1) : EMPLOYEE_NAME_SIZE - 1;
+    memcpy(e->ID, response, id_length);
+    e->ID[id_length] = '\0';
+    memcpy(e->name, name + 1, name_length);
+    e->name[name_length] = '\0';
+    e->salary = strtod(salary + 1, NULL);
+    return 1;
+}
+
+int read_full(int fd, void* buffer, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = read(fd, (char*) buffer + done, size - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
+
+int write_full(int fd, const void* buffer, size_t size) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t n = write(fd, (const char*) buffer + done, size - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * Bryce Souers
+ * employee_proto.h - Wire format of the employee service and the employee
+ *                    tables its servers hold.
+ *
+ * Every message is a fixed size frame: a client sends REQUEST_SIZE bytes
+ * holding "GETSALARY <id>" or "STOP", NUL padded, and the server answers each
+ * GETSALARY with RESPONSE_SIZE bytes holding "<id>|<name>|<salary>" or
+ * "ERROR". Requests on one connection are answered in order, so a client can
+ * send several before reading the answers.
+ *
+ * Employees are spread over shards by a hash of their ID; shard i of n holds
+ * the employees with employee_shard(ID, n) == i.
+ */
+
+#ifndef EMPLOYEE_PROTO_H
+#define EMPLOYEE_PROTO_H
+
+#include <stddef.h>
+
+#define REQUEST_SIZE        64
+#define RESPONSE_SIZE       256
+#define EMPLOYEE_ID_SIZE    16
+#define EMPLOYEE_NAME_SIZE  16
+#define CLASSIC_EMPLOYEES   10
+#define MAX_EMPLOYEES       10000000
+
+// Employee data structure
+typedef struct {
+    char ID[EMPLOYEE_ID_SIZE];
+    char name[EMPLOYEE_NAME_SIZE];
+    double salary;
+} employee_info;
+
+// Shard of an employee ID out of shards
+int employee_shard(const char* ID, int shards);
+
+// Employee i (below MAX_EMPLOYEES) of the table: the ten classic employees first, then
+// synthetic ones
+void employee_make(unsigned long i, employee_info* e);
+
+// Fill a request frame for an employee ID
+void request_format(char* request, const char* ID);
+
+// Fill a response frame for an employee, or with "ERROR" when e is NULL
+void response_format(char* response, const employee_info* e);
+
+// Parse a response frame, returning 1 and filling e for an employee, 0 for "ERROR"
+int response_parse(const char* response, employee_info* e);
+
+// Read or write exactly size bytes on a blocking socket, returning 0 or -1 on failure
+int read_full(int fd, void* buffer, size_t size);
+int write_full(int fd, const void* buffer, size_t size);
+
+#endif
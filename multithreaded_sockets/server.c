@@ -1,88 +1,119 @@
+/*
+ * Bryce Souers
+ * server.c - Employee salary service, one shard of it when sharded.
+ * Usage: ./server port-number [-shard i/n] [-employees n] [-service-time us] [-quiet]
+ *
+ *  -shard i/n          serve shard i of n: only the employees whose ID hashes to i
+ *                      (default 0/1, every employee)
+ *  -employees n        employees in the table, the ten classic ones first and then
+ *                      synthetic ones, up to 10000000 (default 10)
+ *  -service-time us    emulate storage that serves one lookup at a time, like a
+ *                      single disk, by holding a lock for this long on every lookup
+ *                      (default 0, no emulation)
+ *  -quiet              do not print every connection and request
+ *
+ * Every connection gets a detached worker thread that answers its requests in
+ * order, in the fixed size frames of employee_proto.h.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
+#include "employee_proto.h"
+
+// Open addressing table of the shard's employees, keyed by ID
+employee_info* table;
+unsigned long table_capacity;
+unsigned long table_size;
+
+// Emulated storage every lookup holds for service_time, when one is given
+pthread_mutex_t storage_lock = PTHREAD_MUTEX_INITIALIZER;
+struct timespec service_time;
+int quiet;
+
+// FNV-1a over the ID, mixed differently from employee_shard so the shard does not
+// cluster its slots
+unsigned long table_slot(const char* ID) {
+    unsigned long hash = 2166136261UL;
+    for(; *ID != '\0'; ID++) hash = (hash ^ (unsigned char) *ID) * 16777619UL;
+    return (hash ^ (hash >> 29)) & (table_capacity - 1);
+}
 
-// Employee data structure
-typedef struct {
-    char ID[7];
-    char name[10];
-    double salary;
-} employee_info;
-
-// Psuedo employee database
-employee_info ei[10] = {
-    { "abc000", "name0", 10000.0 },
-    { "abc001", "name1", 10001.1 },
-    { "abc002", "name2", 10002.2 },
-    { "abc003", "name3", 10003.3 },
-    { "abc004", "name4", 10004.4 },
-    { "abc005", "name5", 10005.5 },
-    { "abc006", "name6", 10006.6 },
-    { "abc007", "name7", 10007.7 },
-    { "abc008", "name8", 10008.8 },
-    { "abc009", "name9", 10009.9 },
-};
+void table_build(unsigned long employees, int shard, int shards) {
+    unsigned long i;
+    table_capacity = 16;
+    while(table_capacity < 2 * employees) table_capacity *= 2;
+    table = (employee_info*) calloc(table_capacity, sizeof(employee_info));
+    if(table == NULL) {
+        fprintf(stderr, "Failed to allocate employee table.\n");
+        exit(1);
+    }
+    for(i = 0; i < employees; i++) {
+        employee_info e;
+        employee_make(i, &e);
+        if(employee_shard(e.ID, shards) != shard) continue;
+        unsigned long slot = table_slot(e.ID);
+        while(table[slot].ID[0] != '\0') slot = (slot + 1) & (table_capacity - 1);
+        table[slot] = e;
+        table_size++;
+    }
+}
+
+employee_info* table_find(const char* ID) {
+    unsigned long slot = table_slot(ID);
+    while(table[slot].ID[0] != '\0') {
+        if(strcmp(table[slot].ID, ID) == 0) return &table[slot];
+        slot = (slot + 1) & (table_capacity - 1);
+    }
+    return NULL;
+}
 
 // Detached thread routine that handles all interaction with client connections
 void *worker(void* args) {
     pthread_t worker_id = pthread_self();
-    printf("WORKER [%lu] >> Connection handler thread created and detached.\n", worker_id);
+    if(!quiet) printf("WORKER [%lu] >> Connection handler thread created and detached.\n", worker_id);
 
-    int connection_socket = (int) *((int *) args);
-
-    char* buffer = (char *) malloc(256);
-    if(buffer == NULL) {
-        printf("WORKER [%lu] >> Failed to allocate memory for buffer.\n", worker_id);
-        exit(EXIT_FAILURE);
-    }
+    // The socket comes in its own allocation, the accept loop reuses its variable right away
+    int connection_socket = *((int *) args);
+    free(args);
 
-    int i;
+    char buffer[REQUEST_SIZE + 1];
+    char response_buffer[RESPONSE_SIZE];
+    buffer[REQUEST_SIZE] = '\0';
     for(;;) {
-        if(read(connection_socket, buffer, 256) <= 0) {
-            printf("WORKER [%lu] >> Failed to receive data from client.\n", worker_id);
+        if(read_full(connection_socket, buffer, REQUEST_SIZE) < 0) {
+            if(!quiet) printf("WORKER [%lu] >> Failed to receive data from client.\n", worker_id);
+            break;
         }
-        printf("WORKER [%lu] >> [RECEIVED] %s\n", worker_id, buffer);
+        if(!quiet) printf("WORKER [%lu] >> [RECEIVED] %s\n", worker_id, buffer);
         if(strcmp(buffer, "STOP") == 0) break;
-        buffer += 10;
-
-        int found = 0;
-        for(i = 0; i < 10; i++) {
-            employee_info data = ei[i];
-            if(strcmp(buffer, data.ID) == 0) {
-                found = 1;
-                char salary_str[32];
-                sprintf(salary_str, "%lf", data.salary);
-                char response_buffer[256] = "";
-                strcat(response_buffer, data.ID);
-                strcat(response_buffer, "|");
-                strcat(response_buffer, data.name);
-                strcat(response_buffer, "|");
-                strcat(response_buffer, salary_str);
-                int num_bytes_sent = sizeof(response_buffer);
-                if(write(connection_socket, response_buffer, num_bytes_sent) != num_bytes_sent) {
-                    printf("WORKER [%lu] >> Failed to sent error message to client.\n", worker_id);
-                    continue;
-                }
-                printf("WORKER [%lu] >> Sent query response to client.\n", worker_id);
-                break;
+
+        employee_info* data = NULL;
+        if(strncmp(buffer, "GETSALARY ", 10) == 0) {
+            if(service_time.tv_sec > 0 || service_time.tv_nsec > 0) {
+                pthread_mutex_lock(&storage_lock);
+                nanosleep(&service_time, NULL);
+                pthread_mutex_unlock(&storage_lock);
             }
+            data = table_find(buffer + 10);
         }
-        if(!found) {
-            char error_buffer[6] = "ERROR";
-            if(write(connection_socket, error_buffer, 6) != 6) {
-                printf("WORKER [%lu] >> Failed to sent error message to client.\n", worker_id);
-                continue;
-            }
-            printf("WORKER [%lu] >> Sent error message to client.\n", worker_id);
+        response_format(response_buffer, data);
+        if(write_full(connection_socket, response_buffer, RESPONSE_SIZE) < 0) {
+            if(!quiet) printf("WORKER [%lu] >> Failed to send response to client.\n", worker_id);
+            break;
         }
+        if(!quiet) printf("WORKER [%lu] >> Sent %s to client.\n", worker_id, data != NULL ? "query response" : "error message");
     }
 
-    printf("WORKER [%lu] >> Goodbye\n", worker_id);
+    if(!quiet) printf("WORKER [%lu] >> Goodbye\n", worker_id);
     close(connection_socket);
     pthread_exit(NULL);
 }
@@ -99,12 +130,37 @@ int main(int argc, char** argv) {
     // Socket descriptors
     int welcomeSocket, connectionSocket;
 
-    // Convert port argument to int
+    // Convert port argument to int, then the options
+    int shard = 0, shards = 1, i;
+    unsigned long employees = CLASSIC_EMPLOYEES;
     if(argc > 1) port = atoi(argv[1]);
     else {
-        fprintf(stderr,"Usage: %s port-number\n",argv[0]);
+        fprintf(stderr,"Usage: %s port-number [-shard i/n] [-employees n] [-service-time us] [-quiet]\n",argv[0]);
         exit(1);
     }
+    for(i = 2; i < argc; i++) {
+        if(strcmp(argv[i], "-quiet") == 0) quiet = 1;
+        else if(i + 1 < argc && strcmp(argv[i], "-shard") == 0) {
+            if(sscanf(argv[++i], "%d/%d", &shard, &shards) != 2 || shards < 1 || shard < 0 || shard >= shards) {
+                fprintf(stderr, "-shard expects i/n with 0 <= i < n.\n");
+                exit(1);
+            }
+        } else if(i + 1 < argc && strcmp(argv[i], "-employees") == 0) {
+            employees = strtoul(argv[++i], NULL, 10);
+            if(employees > MAX_EMPLOYEES) {
+                fprintf(stderr, "-employees must be at most %d.\n", MAX_EMPLOYEES);
+                exit(1);
+            }
+        } else if(i + 1 < argc && strcmp(argv[i], "-service-time") == 0) {
+            long us = atol(argv[++i]);
+            service_time.tv_sec = us / 1000000;
+            service_time.tv_nsec = us % 1000000 * 1000;
+        } else {
+            fprintf(stderr, "Unknown option %s.\n", argv[i]);
+            exit(1);
+        }
+    }
+    table_build(employees, shard, shards);
 
     // Create socket for server to continually listen on
     welcomeSocket = socket(PF_INET, SOCK_STREAM, 0);
@@ -115,7 +171,9 @@ int main(int argc, char** argv) {
 
     printf("SERVER >> Server socket successfully created.\n");
 
-    // Bind server socket to a local address
+    // Bind server socket to a local address, which a shard restarted on the same port may reuse
+    int one = 1;
+    setsockopt(welcomeSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     memset((char *)&sad,0,sizeof(sad));
     sad.sin_family = AF_INET;
     sad.sin_addr.s_addr = INADDR_ANY;
@@ -126,25 +184,34 @@ int main(int argc, char** argv) {
     }
 
     // Set server socket connection queue limit
-    if(listen(welcomeSocket, 10) < 0) {
+    if(listen(welcomeSocket, 64) < 0) {
         fprintf(stderr,"listen failed\n");
         exit(1);
     }
 
-    printf("SERVER >> Server socket successfully bound to local address.\n");
+    printf("SERVER >> Server socket successfully bound to local address, shard %d/%d with %lu employees.\n",
+           shard, shards, table_size);
+    fflush(stdout);
 
     // Main loop - server continually listens for connections and passes of to a new worker thread
     for(;;) {
-        printf("\nSERVER >> Waiting for connection...\n");
+        if(!quiet) printf("\nSERVER >> Waiting for connection...\n");
         alen = sizeof(cad);
         if ((connectionSocket = accept(welcomeSocket, (struct sockaddr *)&cad, &alen)) < 0) {
             fprintf(stderr, "accept failed\n");
             exit(1);
         }
-        printf("SERVER >> [CONNECTION] Sending to worker thread...\n");
+        setsockopt(connectionSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if(!quiet) printf("SERVER >> [CONNECTION] Sending to worker thread...\n");
 
+        int* worker_socket = (int *) malloc(sizeof(int));
+        if(worker_socket == NULL) {
+            fprintf(stderr, "Failed to allocate worker socket.\n");
+            exit(EXIT_FAILURE);
+        }
+        *worker_socket = connectionSocket;
         pthread_t worker_id;
-        if(pthread_create(&worker_id, NULL, worker, (void *) &connectionSocket)) {
+        if(pthread_create(&worker_id, NULL, worker, (void *) worker_socket)) {
             fprintf(stderr, "Failed to create worker thread.\n");
             exit(EXIT_FAILURE);
         }
@@ -154,4 +221,4 @@ int main(int argc, char** argv) {
             exit(EXIT_FAILURE);
         }
     }
-}
\ No newline at end of file
+}
@@ -2,11 +2,23 @@
  * Bryce Souers
  * process_scheduling.c - Emulate process scheduling algorithms and context switching
  * Usage: ./process_scheduling -alg [FIFO|SJF|PR|RR] -input input_file
+ *                             [-quantum ms] [-replay [-workers n]]
+ *
+ * With -replay the same workload is afterwards run on real threads: every job
+ * spins for CPUburst ms of CPU time on a pool of CPU-pinned workers that are fed
+ * by a user-space priority queue ordered by the chosen algorithm. The measured
+ * waiting and turnaround times are printed next to the simulated ones. There
+ * can be at most one worker per CPU, so no two workers share a core.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
 
 // Basic PCB data structure
 struct PCB_st {
@@ -15,9 +27,21 @@ struct PCB_st {
 	int CPUburst;
 	int myReg[8];
 	int queueEnterClock, waitingTime;
+	int jobIndex;
 	struct PCB_st *next;
 };
 
+// Per job record kept for the replay so simulated and measured numbers can be compared
+struct job_st {
+	int ProcId;
+	int ProcPR;
+	int CPUburst;
+	int simWaiting, simTurnaround;
+	int remaining;
+	long seq;
+	double enqueueMs, waitingMs, finishMs;
+};
+
 // Forward declarations
 void FIFO_Scheduling();
 void SJF_Scheduling();
@@ -32,6 +56,9 @@ struct PCB_st* pop_head();
 int list_is_empty();
 void list_append(struct PCB_st* pcb);
 
+void sim_record(struct PCB_st* pcb);
+void replay_scheduling();
+
 // CPU registers
 int CPUreg[8] = {0};
 
@@ -49,6 +76,14 @@ int Total_job = 0;
 char* alg = NULL;
 char* input_file_name = NULL;
 int quantum_value = -1;
+int replay = 0;
+int replay_workers = 1;
+int Num_cpus = 1;
+
+// Jobs in input order (filled while reading the input file)
+struct job_st* Jobs = NULL;
+int Num_jobs = 0;
+int Jobs_capacity = 0;
 
 int main(int argc, char* argv[]) {
 	// Setup argument variables
@@ -56,6 +91,7 @@ int main(int argc, char* argv[]) {
 	int hit_alg_arg = 0;
 	int hit_input_arg = 0;
 	int hit_quantum_arg = 0;
+	int hit_workers_arg = 0;
 	// Loop through all the arguments from the command line
 	int i;
 	for(i = 0; i < argc; i++) {
@@ -111,6 +147,32 @@ int main(int argc, char* argv[]) {
 		// If previous argument was -quantum, set the quantum_value variable to this argument
 		if(hit_quantum_arg == 1)quantum_value = atoi(temp_s);
 		hit_quantum_arg = 0;
+
+		// -replay takes no value, it only turns on the threaded replay
+		if(strcmp(temp_s, "-replay") == 0) {
+			replay = 1;
+			continue;
+		}
+
+		// Handle errors to the -workers argument
+		if(strcmp(temp_s, "-workers") == 0) {
+			if(hit_workers_arg == 0) {
+				hit_workers_arg = 1;
+				continue;
+			} else {
+				fprintf(stderr, "ERROR >> Multiple -workers arguments found.\n");
+				exit(-1);
+			}
+		}
+		// If previous argument was -workers, set the replay_workers variable to this argument
+		if(hit_workers_arg == 1) {
+			replay_workers = atoi(temp_s);
+			if(replay_workers < 1) {
+				fprintf(stderr, "ERROR >> Invalid -workers argument given.\n");
+				exit(-1);
+			}
+		}
+		hit_workers_arg = 0;
 	}
 	// Check that the -alg argument was eventually set correctly
 	if(alg == NULL) {
@@ -122,6 +184,13 @@ int main(int argc, char* argv[]) {
 		fprintf(stderr, "ERROR >> Input file name never given in argument list.\n");
 		exit(-1);
 	}
+	// Workers stacked on one CPU would preempt each other and distort the measured times
+	Num_cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(Num_cpus < 1) Num_cpus = 1;
+	if(replay && replay_workers > Num_cpus) {
+		fprintf(stderr, "ERROR >> -workers %d exceeds the %d CPU(s) available.\n", replay_workers, Num_cpus);
+		exit(-1);
+	}
 
 	// Open the input file specified from the arguments list
 	FILE* input_file = fopen(input_file_name, "r");
@@ -147,6 +216,20 @@ int main(int argc, char* argv[]) {
 		pcb->queueEnterClock = 0;
 		pcb->waitingTime = 0;
 		pcb->next = NULL;
+		// Keep a copy of the job for the replay
+		if(Num_jobs == Jobs_capacity) {
+			Jobs_capacity = Jobs_capacity == 0 ? 16 : Jobs_capacity * 2;
+			Jobs = (struct job_st*) realloc(Jobs, Jobs_capacity * sizeof(struct job_st));
+			if(Jobs == NULL) {
+				fprintf(stderr, "ERROR >> Could not allocate job table.\n");
+				exit(-1);
+			}
+		}
+		memset(&Jobs[Num_jobs], 0, sizeof(struct job_st));
+		Jobs[Num_jobs].ProcId = process_id;
+		Jobs[Num_jobs].ProcPR = process_priority;
+		Jobs[Num_jobs].CPUburst = cpu_burst_time_ms;
+		pcb->jobIndex = Num_jobs++;
 		// Append the PCB to the linked list
 		list_append(pcb);
 	}
@@ -159,6 +242,10 @@ int main(int argc, char* argv[]) {
 	if(strcmp(alg, "SJF") == 0) SJF_Scheduling();
 	if(strcmp(alg, "PR") == 0) PR_Scheduling();
 	if(strcmp(alg, "RR") == 0) RR_Scheduling();
+	// Run the same workload on real threads and compare
+	if(replay) replay_scheduling();
+	free(Jobs);
+	return 0;
 }
 
 
@@ -180,6 +267,7 @@ void FIFO_Scheduling() {
 		CLOCK = CLOCK + PCB->CPUburst;
 		Total_turnaround_time = Total_turnaround_time + CLOCK;
 		Total_job = Total_job + 1;
+		sim_record(PCB);
 		printf("\nProcess %d completed at %d ms", PCB->ProcId, CLOCK);
 		free(PCB);
 	}
@@ -205,6 +293,7 @@ void SJF_Scheduling() {
 		CLOCK = CLOCK + PCB->CPUburst;
 		Total_turnaround_time = Total_turnaround_time + CLOCK;
 		Total_job = Total_job + 1;
+		sim_record(PCB);
 		printf("\nProcess %d completed at %d ms", PCB->ProcId, CLOCK);
 		free(PCB);
 	}
@@ -230,6 +319,7 @@ void PR_Scheduling() {
 		CLOCK = CLOCK + PCB->CPUburst;
 		Total_turnaround_time = Total_turnaround_time + CLOCK;
 		Total_job = Total_job + 1;
+		sim_record(PCB);
 		printf("\nProcess %d completed at %d ms", PCB->ProcId, CLOCK);
 		free(PCB);
 	}
@@ -261,6 +351,7 @@ void RR_Scheduling() {
 			CLOCK = CLOCK + PCB->CPUburst;
 			Total_turnaround_time = Total_turnaround_time + CLOCK;
 			Total_job = Total_job + 1;
+			sim_record(PCB);
 			printf("\nProcess %d completed at %d ms", PCB->ProcId, CLOCK);
 			free(PCB);
 		} else {
@@ -278,6 +369,184 @@ void RR_Scheduling() {
 }
 
 
+/* REPLAY FUNCTIONS */
+
+// Shared state of the replay scheduler (protected by Replay_lock)
+pthread_mutex_t Replay_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t Replay_cond = PTHREAD_COND_INITIALIZER;
+struct job_st** Ready_heap = NULL;
+int Ready_count = 0;
+int Jobs_done = 0;
+int Replay_started = 0;
+long Next_seq = 0;
+double Replay_t0 = 0.0;
+
+// Milliseconds on the monotonic clock
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Milliseconds of CPU time the calling thread has used
+double thread_cpu_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Burn CPU for the given number of milliseconds of this thread's CPU time, so a slice
+// that gets preempted still runs for its whole burst
+void spin_ms(int ms) {
+	double end = thread_cpu_ms() + ms;
+	while(thread_cpu_ms() < end);
+}
+
+// Return 1 if job a should be dispatched before job b under the chosen algorithm.
+// Ties are broken the same way the list based simulator breaks them.
+int job_before(struct job_st* a, struct job_st* b) {
+	if(strcmp(alg, "SJF") == 0) {
+		if(a->CPUburst != b->CPUburst) return a->CPUburst < b->CPUburst;
+		return a->seq > b->seq;
+	}
+	if(strcmp(alg, "PR") == 0) {
+		if(a->ProcPR != b->ProcPR) return a->ProcPR > b->ProcPR;
+		return a->seq > b->seq;
+	}
+	// FIFO and RR dispatch in queue order
+	return a->seq < b->seq;
+}
+
+// Push a job onto the ready heap (caller holds Replay_lock)
+void ready_push(struct job_st* job) {
+	int i = Ready_count++;
+	while(i > 0) {
+		int parent = (i - 1) / 2;
+		if(!job_before(job, Ready_heap[parent])) break;
+		Ready_heap[i] = Ready_heap[parent];
+		i = parent;
+	}
+	Ready_heap[i] = job;
+}
+
+// Pop the next job to dispatch from the ready heap (caller holds Replay_lock)
+struct job_st* ready_pop() {
+	if(Ready_count == 0) return NULL;
+	struct job_st* top = Ready_heap[0];
+	struct job_st* last = Ready_heap[--Ready_count];
+	int i = 0;
+	for(;;) {
+		int child = 2 * i + 1;
+		if(child >= Ready_count) break;
+		if(child + 1 < Ready_count && job_before(Ready_heap[child + 1], Ready_heap[child])) child++;
+		if(!job_before(Ready_heap[child], last)) break;
+		Ready_heap[i] = Ready_heap[child];
+		i = child;
+	}
+	if(Ready_count > 0) Ready_heap[i] = last;
+	return top;
+}
+
+// Worker thread: pin itself to a CPU, then run jobs from the ready heap until all are done
+void* replay_worker(void* arg) {
+	int worker_index = (int) (long) arg;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(worker_index % Num_cpus, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		fprintf(stderr, "WARNING >> Could not pin worker %d to CPU %d.\n", worker_index, worker_index % Num_cpus);
+	}
+	pthread_mutex_lock(&Replay_lock);
+	while(!Replay_started) pthread_cond_wait(&Replay_cond, &Replay_lock);
+	for(;;) {
+		while(Ready_count == 0 && Jobs_done < Num_jobs) pthread_cond_wait(&Replay_cond, &Replay_lock);
+		if(Jobs_done == Num_jobs) break;
+		struct job_st* job = ready_pop();
+		double dispatch = now_ms() - Replay_t0;
+		job->waitingMs += dispatch - job->enqueueMs;
+		int slice = job->remaining;
+		if(strcmp(alg, "RR") == 0 && slice > quantum_value) slice = quantum_value;
+		pthread_mutex_unlock(&Replay_lock);
+		// Run the job outside of the lock
+		spin_ms(slice);
+		pthread_mutex_lock(&Replay_lock);
+		double end = now_ms() - Replay_t0;
+		job->remaining -= slice;
+		if(job->remaining > 0) {
+			job->enqueueMs = end;
+			job->seq = Next_seq++;
+			ready_push(job);
+			pthread_cond_signal(&Replay_cond);
+		} else {
+			job->finishMs = end;
+			Jobs_done++;
+			if(Jobs_done == Num_jobs) pthread_cond_broadcast(&Replay_cond);
+		}
+	}
+	pthread_mutex_unlock(&Replay_lock);
+	return NULL;
+}
+
+// Store the simulated waiting and turnaround time of a finished PCB
+void sim_record(struct PCB_st* pcb) {
+	Jobs[pcb->jobIndex].simWaiting = pcb->waitingTime;
+	Jobs[pcb->jobIndex].simTurnaround = CLOCK;
+}
+
+// Run the workload on real threads and print measured next to simulated times
+void replay_scheduling() {
+	int i;
+	if(Num_jobs == 0) return;
+	Ready_heap = (struct job_st**) malloc(Num_jobs * sizeof(struct job_st*));
+	pthread_t* workers = (pthread_t*) malloc(replay_workers * sizeof(pthread_t));
+	if(Ready_heap == NULL || workers == NULL) {
+		fprintf(stderr, "ERROR >> Could not allocate replay scheduler.\n");
+		exit(-1);
+	}
+	// Every job arrives at time 0 in input order, just like in the simulation
+	for(i = 0; i < Num_jobs; i++) {
+		Jobs[i].remaining = Jobs[i].CPUburst;
+		Jobs[i].seq = Next_seq++;
+		Jobs[i].enqueueMs = 0.0;
+		Jobs[i].waitingMs = 0.0;
+		ready_push(&Jobs[i]);
+	}
+	for(i = 0; i < replay_workers; i++) {
+		if(pthread_create(&workers[i], NULL, replay_worker, (void*) (long) i)) {
+			fprintf(stderr, "ERROR >> Could not create replay worker thread.\n");
+			exit(-1);
+		}
+	}
+	// Release all workers at once so thread creation does not count as waiting time
+	pthread_mutex_lock(&Replay_lock);
+	Replay_t0 = now_ms();
+	Replay_started = 1;
+	pthread_cond_broadcast(&Replay_cond);
+	pthread_mutex_unlock(&Replay_lock);
+	for(i = 0; i < replay_workers; i++) pthread_join(workers[i], NULL);
+	// Print simulated and measured times side by side
+	double sim_wait = 0.0, sim_turn = 0.0, real_wait = 0.0, real_turn = 0.0, makespan = 0.0;
+	printf("\nReplay on %d worker thread(s) pinned over %d CPU(s)\n", replay_workers, Num_cpus);
+	printf("ProcId   Sim wait   Real wait   Sim turnaround   Real turnaround\n");
+	for(i = 0; i < Num_jobs; i++) {
+		struct job_st* job = &Jobs[i];
+		printf("%6d %8d ms %8.2f ms %11d ms %13.2f ms\n", job->ProcId, job->simWaiting, job->waitingMs,
+			   job->simTurnaround, job->finishMs);
+		sim_wait += job->simWaiting;
+		sim_turn += job->simTurnaround;
+		real_wait += job->waitingMs;
+		real_turn += job->finishMs;
+		if(job->finishMs > makespan) makespan = job->finishMs;
+	}
+	printf("\nAverage Waiting time    : simulated %.2f ms, measured %.2f ms", sim_wait / Num_jobs, real_wait / Num_jobs);
+	printf("\nAverage Turnaround time : simulated %.2f ms, measured %.2f ms", sim_turn / Num_jobs, real_turn / Num_jobs);
+	printf("\nThroughput              : simulated %.2f jobs per ms, measured %.2f jobs per ms\n",
+		   (float)Total_job / CLOCK, Num_jobs / makespan);
+	free(workers);
+	free(Ready_heap);
+}
+
+
 /* LINKED LIST FUNCTIONS */
 
 // Print out entire linked list (mostly for debug)
@@ -349,6 +618,7 @@ struct PCB_st* pop_head() {
 	if(Head == NULL) return NULL;
 	struct PCB_st* temp = Head;
 	Head = Head->next;
+	temp->next = NULL;
 	return temp;
 }
 
@@ -3,60 +3,336 @@
  * address_translation.c - Translate each logical address in the input
  * 						   file to a corresponding physical address
  *						   using a static page table
- * Usage: ./address_translation input_sequence_file output_file
+ * Usage: ./address_translation [-v] [-threads n] [-faults fault_file]
+ *							   input_sequence_file output_file
+ *
+ * The input is mmapped (or read in blocks from a pipe, "-" for stdin) and
+ * translated a block at a time by translate_batch(). Packed traces written by
+ * trace_gen are unpacked on the fly. Addresses outside the page table or on
+ * unmapped pages are not translated: their output is all ones and their bit
+ * is set in a fault bitmap (bit i of 64-bit word i / 64), which -faults
+ * writes out. -threads splits a regular input file across cores, every
+ * thread writing its part of the output with pwrite(), and falls back to one
+ * thread for pipes and packed traces.
+ * -v prints every translation like the original version did.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+#include "trace_io.h"
 
 #define PHYSICAL_MEM_SIZE 1024
 #define VIRTUAL_MEM_SIZE  4096
 #define BYTES_PER_PAGE    128
+#define FAULT_PA          ((unsigned long) -1)
+
+// Page table plus the page size it was built for
+typedef struct translator {
+	const int* PT;
+	unsigned long num_pages;
+	unsigned long page_size;
+	int page_shift;		// -1 when the page size is not a power of two
+	int use_avx2;		// the CPU has AVX2 and the page size is a power of two
+} translator;
+
+// One thread's share of a multithreaded run
+typedef struct translate_job {
+	const translator* t;
+	const unsigned long* in;
+	unsigned long first;
+	unsigned long count;
+	unsigned long* fault_bits;
+	int out_fd;
+	unsigned long faults;
+	int failed;
+} translate_job;
+
+void translator_init(translator* t, const int* PT, unsigned long num_pages, unsigned long page_size);
+unsigned long translate_batch(const translator* t, const unsigned long* in, unsigned long* out,
+							  unsigned long* fault_bits, size_t n);
+void* translate_worker(void* arg);
 
 int main(int argc, char* argv[]) {
+	int verbose = 0;
+	int num_threads = 1;
+	char* fault_file_name = NULL;
+	size_t i;
 	// Check for proper argument usage
-	if(argc < 3) {
-		fprintf(stderr, "[ERROR] Usage: ./part1 infile outfile\n");
+	while(argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0') {
+		if(strcmp(argv[1], "-v") == 0) verbose = 1;
+		else if(strcmp(argv[1], "-threads") == 0 && argc > 2) {
+			num_threads = atoi(argv[2]);
+			argv++;
+			argc--;
+		} else if(strcmp(argv[1], "-faults") == 0 && argc > 2) {
+			fault_file_name = argv[2];
+			argv++;
+			argc--;
+		} else break;
+		argv++;
+		argc--;
+	}
+	if(argc < 3 || num_threads < 1) {
+		fprintf(stderr, "[ERROR] Usage: ./address_translation [-v] [-threads n] [-faults fault_file] infile outfile\n");
 		exit(1);
 	}
 	// Static pagetable
 	int PT[8] = {2, 4, 1, 7, 3, 5, 6, -1};
-	// Open infile for reading in binary mode
-	FILE* infile;
-	infile = fopen(argv[1], "rb");
-	if(infile == NULL) {
+	translator t;
+	translator_init(&t, PT, 8, BYTES_PER_PAGE);
+	// Open infile for reading
+	trace_reader infile;
+	if(trace_open(&infile, argv[1]) != 0) {
 		fprintf(stderr, "[ERROR] Unable to open infile.\n");
 		exit(1);
 	}
-	// Open outfile for writing in binary mode
-	FILE* outfile;
-	outfile = fopen(argv[2], "wb");
-	if(outfile == NULL) {
+	if(infile.tagged > 0) {
+		fprintf(stderr, "[ERROR] The infile holds tagged records, not bare addresses.\n");
+		exit(1);
+	}
+	// Open outfile for writing
+	trace_writer outfile;
+	if(trace_writer_open(&outfile, argv[2]) != 0) {
 		fprintf(stderr, "[ERROR] Unable to open outfile.\n");
 		exit(1);
 	}
-	unsigned long address;
-	// Loop over each address in the infile
-	while(fread(&address, sizeof(unsigned long), 1, infile) == 1) {
-		// Get page number and offset
-		int page_num = address / BYTES_PER_PAGE;
-		int page_offset = address % BYTES_PER_PAGE;
-		// Get frame number according to page table
-		int frame_num = PT[page_num];
-		// Calculate physical address from the virtual address
-		unsigned long PA = frame_num * BYTES_PER_PAGE + page_offset;
-		// Write the calculated physical address to the outfile
-		if(fwrite(&PA, sizeof(PA), 1, outfile) != 1) {
-			fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+	// The fault bitmap grows with the input when it is not mapped
+	size_t bitmap_words = infile.map != NULL ? (infile.count + 63) / 64 : TRACE_BLOCK / 64;
+	unsigned long* fault_bits = (unsigned long*) calloc(bitmap_words, sizeof(unsigned long));
+	if(fault_bits == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate fault bitmap.\n");
+		exit(1);
+	}
+	unsigned long total = 0;
+	unsigned long faults = 0;
+	double start = trace_now();
+	if(num_threads > 1 && infile.map != NULL && !verbose) {
+		// Split the mapped input into ranges that start on a bitmap word
+		translate_job* jobs = (translate_job*) calloc(num_threads, sizeof(translate_job));
+		pthread_t* threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+		if(jobs == NULL || threads == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate threads.\n");
+			exit(1);
+		}
+		unsigned long per_thread = ((infile.count + num_threads - 1) / num_threads + 63) / 64 * 64;
+		unsigned long first = 0;
+		int k;
+		for(k = 0; k < num_threads; k++) {
+			jobs[k].t = &t;
+			jobs[k].in = infile.map;
+			jobs[k].first = first;
+			jobs[k].count = first < infile.count ? infile.count - first : 0;
+			if(jobs[k].count > per_thread) jobs[k].count = per_thread;
+			jobs[k].fault_bits = fault_bits;
+			jobs[k].out_fd = outfile.fd;
+			first += jobs[k].count;
+			if(pthread_create(&threads[k], NULL, translate_worker, &jobs[k])) {
+				fprintf(stderr, "[ERROR] Unable to create translation thread.\n");
+				exit(1);
+			}
+		}
+		for(k = 0; k < num_threads; k++) {
+			pthread_join(threads[k], NULL);
+			if(jobs[k].failed) {
+				fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+				exit(1);
+			}
+			faults += jobs[k].faults;
+			total += jobs[k].count;
+		}
+		// The threads wrote around the writer, so check that the output holds every address
+		struct stat st;
+		if(fstat(outfile.fd, &st) == 0 && S_ISREG(st.st_mode) && (unsigned long) st.st_size != total * sizeof(unsigned long)) {
+			fprintf(stderr, "[ERROR] The outfile holds %lu bytes instead of %lu.\n", (unsigned long) st.st_size,
+					total * sizeof(unsigned long));
+			exit(1);
+		}
+		free(jobs);
+		free(threads);
+	} else {
+		const unsigned long* block;
+		size_t n;
+		// Loop over each block of addresses in the infile
+		while((n = trace_next_block(&infile, &block)) > 0) {
+			unsigned long* out = trace_writer_reserve(&outfile, n);
+			if(out == NULL) {
+				fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+				exit(1);
+			}
+			if(infile.map == NULL && (total + n + 63) / 64 > bitmap_words) {
+				size_t old_words = bitmap_words;
+				while((total + n + 63) / 64 > bitmap_words) bitmap_words *= 2;
+				fault_bits = (unsigned long*) realloc(fault_bits, bitmap_words * sizeof(unsigned long));
+				if(fault_bits == NULL) {
+					fprintf(stderr, "[ERROR] Unable to allocate fault bitmap.\n");
+					exit(1);
+				}
+				memset(fault_bits + old_words, 0, (bitmap_words - old_words) * sizeof(unsigned long));
+			}
+			// Blocks hold a multiple of 64 addresses, so they always start on a bitmap word
+			faults += translate_batch(&t, block, out, fault_bits + total / 64, n);
+			// Print out for debugging
+			if(verbose) {
+				for(i = 0; i < n; i++) {
+					if(out[i] == FAULT_PA) printf("The LA is %-3lx and is not mapped\n", block[i]);
+					else printf("The LA is %-3lx and Translated PA is %lx\n", block[i], out[i]);
+				}
+			}
+			total += n;
+		}
+	}
+	if(trace_writer_close(&outfile) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+		exit(1);
+	}
+	double elapsed = trace_now() - start;
+	// Every address must have been translated, by whichever thread had it
+	if(infile.map != NULL && total != infile.count) {
+		fprintf(stderr, "[ERROR] Translated %lu of %lu addresses.\n", total, infile.count);
+		exit(1);
+	}
+	// Write out the fault bitmap if asked for
+	if(fault_file_name != NULL) {
+		FILE* fault_file = fopen(fault_file_name, "wb");
+		size_t words = (total + 63) / 64;
+		if(fault_file == NULL || fwrite(fault_bits, sizeof(unsigned long), words, fault_file) != words) {
+			fprintf(stderr, "[ERROR] Unable to write fault bitmap.\n");
 			exit(1);
 		}
-		// Print out for debugging
-		printf("The LA is %-3lx and Translated PA is %lx\n", address, PA);
+		fclose(fault_file);
 	}
-	// Print out total pages for debugging
+	// Print out total pages and throughput
 	printf("total number of pages = %d\n", PHYSICAL_MEM_SIZE / BYTES_PER_PAGE);
+	printf("Translated %lu addresses (%lu faults) in %.3f s (%.0f addresses/s)\n", total, faults, elapsed,
+		   elapsed > 0 ? total / elapsed : 0.0);
 	// Clean up :)
-	fclose(infile);
-	fclose(outfile);
+	free(fault_bits);
+	trace_close(&infile);
 	return 0;
 }
+
+/* TRANSLATION FUNCTIONS */
+
+// Set up a translator for a page table of num_pages entries (-1 marks an unmapped page)
+void translator_init(translator* t, const int* PT, unsigned long num_pages, unsigned long page_size) {
+	t->PT = PT;
+	t->num_pages = num_pages;
+	t->page_size = page_size;
+	t->page_shift = -1;
+	if((page_size & (page_size - 1)) == 0) {
+		t->page_shift = 0;
+		while((1UL << t->page_shift) < page_size) t->page_shift++;
+	}
+	// Decided once here, before any thread translates
+	t->use_avx2 = t->page_shift >= 0 && __builtin_cpu_supports("avx2");
+}
+
+// Portable version of the batch kernel, also used for the tail the vector kernel leaves over
+unsigned long translate_scalar(const translator* t, const unsigned long* in, unsigned long* out,
+							   unsigned long* fault_bits, size_t first, size_t n) {
+	size_t i;
+	unsigned long faults = 0;
+	for(i = first; i < n; i++) {
+		unsigned long page_num, page_offset;
+		if(t->page_shift >= 0) {
+			page_num = in[i] >> t->page_shift;
+			page_offset = in[i] & (t->page_size - 1);
+		} else {
+			page_num = in[i] / t->page_size;
+			page_offset = in[i] % t->page_size;
+		}
+		int frame_num = page_num < t->num_pages ? t->PT[page_num] : -1;
+		if(frame_num < 0) {
+			out[i] = FAULT_PA;
+			fault_bits[i / 64] |= 1UL << (i % 64);
+			faults++;
+		} else out[i] = (unsigned long) frame_num * t->page_size + page_offset;
+	}
+	return faults;
+}
+
+// AVX2 kernel: four addresses per step, page table entries fetched with a masked gather
+__attribute__((target("avx2")))
+unsigned long translate_avx2(const translator* t, const unsigned long* in, unsigned long* out,
+							 unsigned long* fault_bits, size_t n) {
+	size_t i;
+	unsigned long faults = 0;
+	const __m256i sign = _mm256_set1_epi64x((long long) 0x8000000000000000ULL);
+	const __m256i limit = _mm256_xor_si256(_mm256_set1_epi64x((long long) t->num_pages), sign);
+	const __m256i offset_mask = _mm256_set1_epi64x((long long) (t->page_size - 1));
+	const __m256i all_ones = _mm256_set1_epi64x(-1);
+	const __m128i shift = _mm_cvtsi32_si128(t->page_shift);
+	for(i = 0; i + 4 <= n; i += 4) {
+		__m256i LA = _mm256_loadu_si256((const __m256i*) (in + i));
+		__m256i page_num = _mm256_srl_epi64(LA, shift);
+		// Unsigned page_num < num_pages, done as a signed compare with the sign bits flipped
+		__m256i in_range = _mm256_cmpgt_epi64(limit, _mm256_xor_si256(page_num, sign));
+		// Only lanes inside the table are loaded, the others read as -1 (unmapped)
+		__m128i frames32 = _mm256_mask_i64gather_epi32(_mm_set1_epi32(-1), t->PT, page_num,
+														 _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(in_range,
+														 _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7))), 4);
+		__m256i frame_num = _mm256_cvtepi32_epi64(frames32);
+		__m256i fault = _mm256_cmpgt_epi64(_mm256_setzero_si256(), frame_num);
+		__m256i PA = _mm256_or_si256(_mm256_sll_epi64(frame_num, shift), _mm256_and_si256(LA, offset_mask));
+		PA = _mm256_blendv_epi8(PA, all_ones, fault);
+		_mm256_storeu_si256((__m256i*) (out + i), PA);
+		unsigned long bits = (unsigned long) _mm256_movemask_pd(_mm256_castsi256_pd(fault));
+		if(bits != 0) {
+			fault_bits[i / 64] |= bits << (i % 64);
+			faults += __builtin_popcountl(bits);
+		}
+	}
+	return faults + translate_scalar(t, in, out, fault_bits, i, n);
+}
+
+// Translate n addresses into out. Faulting addresses get FAULT_PA and their bit set in
+// fault_bits (which must be zeroed by the caller). Returns the number of faults.
+unsigned long translate_batch(const translator* t, const unsigned long* in, unsigned long* out,
+							  unsigned long* fault_bits, size_t n) {
+	if(t->use_avx2) return translate_avx2(t, in, out, fault_bits, n);
+	return translate_scalar(t, in, out, fault_bits, 0, n);
+}
+
+// Thread routine: translate a range of the mapped input block by block and pwrite it in place
+void* translate_worker(void* arg) {
+	translate_job* job = (translate_job*) arg;
+	unsigned long* out = (unsigned long*) malloc(TRACE_BLOCK * sizeof(unsigned long));
+	unsigned long done = 0;
+	if(out == NULL) {
+		job->failed = 1;
+		return NULL;
+	}
+	while(done < job->count) {
+		unsigned long n = job->count - done;
+		unsigned long first = job->first + done;
+		if(n > TRACE_BLOCK) n = TRACE_BLOCK;
+		job->faults += translate_batch(job->t, job->in + first, out, job->fault_bits + first / 64, n);
+		// Write the whole block at its offset in the output file
+		const char* bytes = (const char*) out;
+		size_t left = n * sizeof(unsigned long);
+		off_t offset = (off_t) first * sizeof(unsigned long);
+		while(left > 0) {
+			ssize_t put = pwrite(job->out_fd, bytes, left, offset);
+			if(put < 0 && errno == EINTR) continue;
+			if(put <= 0) {
+				job->failed = 1;
+				free(out);
+				return NULL;
+			}
+			bytes += put;
+			left -= put;
+			offset += put;
+		}
+		done += n;
+	}
+	free(out);
+	return NULL;
+}
@@ -0,0 +1,498 @@
+/*
+ * Bryce Souers
+ * trace_gen.c - Generate large synthetic address traces with locality for
+ *				 address_translation and virtual_memory
+ * Usage: ./trace_gen [options] output_file
+ *
+ * Options:
+ *	-count n			references to write, with a K, M or G suffix (default 1M)
+ *	-page-size bytes	page size, power of two (default 128)
+ *	-va-bits n			virtual address width in bits (default 12)
+ *	-pattern list		comma separated phase patterns, used one phase after the other
+ *						(default zipf):
+ *						zipf[:s]	pages of the working set by a zipfian popularity
+ *									with exponent s (default 1)
+ *						uniform		pages of the working set, all equally likely
+ *						seq			every word of the working set in order
+ *						stride[:k]	every k-th page of the working set (default 4), then
+ *									the pages after those, and so on
+ *						loop[:n]	the first n pages of the working set one after the
+ *									other, over and over (default the whole working set)
+ *	-ws pages			pages in the working set of a phase (default a quarter of the
+ *						address space)
+ *	-phase-length n		references per phase (default 64K)
+ *	-processes n		processes taking turns, each going through its own phases
+ *						(default 1)
+ *	-quantum n			references of a process before the next one's turn (default 1000)
+ *	-fork				every process after the first starts on its first turn as a fork
+ *						of the first one, with a fork record and the parent's phase
+ *	-writes fraction	share of the references that are writes (default 0)
+ *	-packed				write the packed format of trace_io.h instead of bare
+ *						unsigned longs
+ *	-seed n				random seed (default 1)
+ *
+ * Output "-" writes to stdout, so a trace can be compressed on the way out
+ * (./trace_gen -count 1G - | gzip > trace.gz) and streamed back in with
+ * zcat trace.gz | ./virtual_memory - out. The same options and seed always give
+ * the same trace.
+ *
+ * Every phase puts the working set at a random page of the address space, so a
+ * new phase moves the locality of the process somewhere else; zipf keeps the
+ * same order of popularity within the working set in every phase. With more
+ * than one process, or with writes, the trace holds trace_record entries
+ * (run virtual_memory with -tagged, which a packed trace sets by itself).
+ * Addresses are word aligned, at a random word of the page except for seq.
+ *
+ * The simulators must be given the same -page-size and -va-bits, e.g.
+ *	./trace_gen -va-bits 32 -page-size 4K -ws 64K -count 1G -packed big.trace
+ *	./virtual_memory -va-bits 32 -page-size 4K -phys-mem 128M -levels 2 big.trace out
+ * address_translation has a fixed table of 8 pages of 128 bytes, which traces
+ * generated with -va-bits 10 stay in.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "trace_io.h"
+
+#define MAX_PATTERNS 16
+#define MAX_WS       (1UL << 32)
+
+enum pattern_kind { ZIPF, UNIFORM, SEQ, STRIDE, LOOP };
+
+// Walker's alias table: index i is picked with its threshold in 2^32, alias[i] otherwise
+typedef struct alias_table {
+	unsigned int* threshold;
+	unsigned int* alias;
+	unsigned long size;
+} alias_table;
+
+// One phase pattern of -pattern and its parameter
+typedef struct pattern {
+	enum pattern_kind kind;
+	double s;
+	unsigned long k;
+	alias_table zipf;
+} pattern;
+
+// Where a process is in its phases
+typedef struct gen_process {
+	unsigned int pid;
+	int started;
+	int pattern;
+	unsigned long phase_left;
+	unsigned long base;
+	unsigned long cursor;
+} gen_process;
+
+// Options and the state shared by all processes
+typedef struct generator {
+	unsigned long count;
+	unsigned long page_size;
+	unsigned long pages;
+	unsigned long ws;
+	unsigned long phase_length;
+	unsigned long quantum;
+	double writes;
+	int num_processes;
+	int fork;
+	int packed;
+	pattern patterns[MAX_PATTERNS];
+	int num_patterns;
+	unsigned int* rank_page;
+	unsigned long random;
+} generator;
+
+void parse_args(int argc, char* argv[], generator* g, char** outfile_name);
+void parse_patterns(generator* g, char* list);
+void alias_init(alias_table* t, unsigned long n, double s);
+void next_phase(generator* g, gen_process* p);
+unsigned long next_address(generator* g, gen_process* p);
+unsigned long next_random(generator* g);
+unsigned long parse_size(const char* s);
+
+int main(int argc, char* argv[]) {
+	generator g;
+	char* outfile_name = NULL;
+	unsigned long i;
+	int k;
+	parse_args(argc, argv, &g, &outfile_name);
+	int tagged = g.num_processes > 1 || g.writes > 0.0;
+	// Popularity ranks go to pages of the working set in a random order
+	for(k = 0; k < g.num_patterns; k++) {
+		if(g.patterns[k].kind != ZIPF) continue;
+		alias_init(&g.patterns[k].zipf, g.ws, g.patterns[k].s);
+		if(g.rank_page != NULL) continue;
+		g.rank_page = (unsigned int*) malloc(g.ws * sizeof(unsigned int));
+		if(g.rank_page == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate working set.\n");
+			exit(1);
+		}
+		for(i = 0; i < g.ws; i++) g.rank_page[i] = (unsigned int) i;
+		for(i = g.ws - 1; i > 0; i--) {
+			unsigned long j = next_random(&g) % (i + 1);
+			unsigned int swap = g.rank_page[i];
+			g.rank_page[i] = g.rank_page[j];
+			g.rank_page[j] = swap;
+		}
+	}
+	gen_process* procs = (gen_process*) calloc(g.num_processes, sizeof(gen_process));
+	if(procs == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate processes.\n");
+		exit(1);
+	}
+	for(k = 0; k < g.num_processes; k++) {
+		procs[k].pid = k;
+		procs[k].pattern = -1;
+		procs[k].started = !g.fork || k == 0;
+		next_phase(&g, &procs[k]);
+	}
+	trace_writer outfile;
+	int status = g.packed ? trace_writer_open_packed(&outfile, outfile_name, tagged) : trace_writer_open(&outfile, outfile_name);
+	if(status != 0) {
+		fprintf(stderr, "[ERROR] Unable to open outfile.\n");
+		exit(1);
+	}
+	// A write is a reference whose random number falls below this
+	unsigned long write_below = g.writes >= 1.0 ? (unsigned long) -1 : (unsigned long) (g.writes * 18446744073709551616.0);
+	int current = 0;
+	unsigned long turn_left = g.quantum;
+	unsigned long left = g.count;
+	double start = trace_now();
+	while(left > 0) {
+		size_t n = tagged ? TRACE_BLOCK / 2 : TRACE_BLOCK;
+		if(n > left) n = left;
+		unsigned long* out = trace_writer_reserve(&outfile, tagged ? 2 * n : n);
+		if(out == NULL) {
+			fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+			exit(1);
+		}
+		trace_record* records = (trace_record*) out;
+		for(i = 0; i < n; i++) {
+			if(turn_left-- == 0) {
+				current = (current + 1) % g.num_processes;
+				turn_left = g.quantum - 1;
+				// A forked process begins where the first one is, sharing its pages copy-on-write
+				if(!procs[current].started) {
+					unsigned int pid = procs[current].pid;
+					procs[current] = procs[0];
+					procs[current].pid = pid;
+					records[i].addr = pid;
+					records[i].pid = procs[0].pid;
+					records[i].flags = TRACE_FORK;
+					turn_left++;
+					continue;
+				}
+			}
+			gen_process* p = &procs[current];
+			if(p->phase_left == 0) next_phase(&g, p);
+			p->phase_left--;
+			unsigned long LA = next_address(&g, p);
+			if(!tagged) {
+				out[i] = LA;
+				continue;
+			}
+			records[i].addr = LA;
+			records[i].pid = p->pid;
+			records[i].flags = next_random(&g) < write_below ? TRACE_WRITE : 0;
+		}
+		left -= n;
+	}
+	if(trace_writer_close(&outfile) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+		exit(1);
+	}
+	double elapsed = trace_now() - start;
+	// Keep stdout for the trace when that is where it went
+	FILE* report = strcmp(outfile_name, "-") == 0 ? stderr : stdout;
+	fprintf(report, "%lu %s, %.1f MB (%.2f bytes each) in %.3f seconds: %.1f M references/s\n", g.count,
+			tagged ? "records" : "addresses", outfile.written / 1e6, (double) outfile.written / g.count, elapsed,
+			elapsed > 0 ? g.count / elapsed / 1e6 : 0.0);
+	// Clean up :)
+	for(k = 0; k < g.num_patterns; k++) {
+		free(g.patterns[k].zipf.threshold);
+		free(g.patterns[k].zipf.alias);
+	}
+	free(g.rank_page);
+	free(procs);
+	return 0;
+}
+
+/*
+ *	This function reads the options into the generator and checks that the working set
+ *	fits in the address space.
+ *
+ *	Parameters:
+ *		int argc, char* argv[] -- the command line
+ *		generator* g -- the generator to fill in
+ *		char** outfile_name -- set to the output file
+ *	Return:
+ *		None
+ */
+void parse_args(int argc, char* argv[], generator* g, char** outfile_name) {
+	char default_pattern[] = "zipf";
+	char* pattern_list = default_pattern;
+	unsigned long va_bits = 12;
+	int i;
+	memset(g, 0, sizeof(generator));
+	g->count = 1 << 20;
+	g->page_size = 128;
+	g->phase_length = 64 * 1024;
+	g->quantum = 1000;
+	g->num_processes = 1;
+	g->random = 1;
+	for(i = 1; i < argc; i++) {
+		char* arg = argv[i];
+		if(strcmp(arg, "-packed") == 0) {
+			g->packed = 1;
+			continue;
+		}
+		if(strcmp(arg, "-fork") == 0) {
+			g->fork = 1;
+			continue;
+		}
+		if(arg[0] == '-' && arg[1] != '\0') {
+			if(i + 1 >= argc) {
+				fprintf(stderr, "[ERROR] Missing value for %s.\n", arg);
+				exit(1);
+			}
+			char* value = argv[++i];
+			if(strcmp(arg, "-count") == 0) g->count = parse_size(value);
+			else if(strcmp(arg, "-page-size") == 0) g->page_size = parse_size(value);
+			else if(strcmp(arg, "-va-bits") == 0) va_bits = strtoul(value, NULL, 10);
+			else if(strcmp(arg, "-pattern") == 0) pattern_list = value;
+			else if(strcmp(arg, "-ws") == 0) g->ws = parse_size(value);
+			else if(strcmp(arg, "-phase-length") == 0) g->phase_length = parse_size(value);
+			else if(strcmp(arg, "-processes") == 0) g->num_processes = atoi(value);
+			else if(strcmp(arg, "-quantum") == 0) g->quantum = parse_size(value);
+			else if(strcmp(arg, "-writes") == 0) g->writes = atof(value);
+			else if(strcmp(arg, "-seed") == 0) g->random = strtoul(value, NULL, 10);
+			else {
+				fprintf(stderr, "[ERROR] Unknown option %s.\n", arg);
+				exit(1);
+			}
+			continue;
+		}
+		if(*outfile_name != NULL) {
+			fprintf(stderr, "[ERROR] Usage: ./trace_gen [options] outfile\n");
+			exit(1);
+		}
+		*outfile_name = arg;
+	}
+	if(*outfile_name == NULL) {
+		fprintf(stderr, "[ERROR] Usage: ./trace_gen [options] outfile\n");
+		exit(1);
+	}
+	if(g->page_size == 0 || (g->page_size & (g->page_size - 1)) != 0) {
+		fprintf(stderr, "[ERROR] The page size must be a power of two.\n");
+		exit(1);
+	}
+	int page_shift = __builtin_ctzl(g->page_size);
+	if(va_bits > 64 || va_bits < (unsigned long) page_shift || va_bits - page_shift >= 64) {
+		fprintf(stderr, "[ERROR] -va-bits must be at least the page offset and at most 64, with page numbers under 64 bits.\n");
+		exit(1);
+	}
+	g->pages = 1UL << (va_bits - page_shift);
+	if(g->ws == 0) g->ws = g->pages / 4 > 0 ? g->pages / 4 : 1;
+	if(g->ws > g->pages || g->ws > MAX_WS) {
+		fprintf(stderr, "[ERROR] The working set must fit in the address space and be at most 4G pages.\n");
+		exit(1);
+	}
+	if(g->count == 0 || g->phase_length == 0 || g->quantum == 0 || g->num_processes < 1) {
+		fprintf(stderr, "[ERROR] -count, -phase-length, -quantum and -processes must be above 0.\n");
+		exit(1);
+	}
+	if(g->writes < 0.0 || g->writes > 1.0) {
+		fprintf(stderr, "[ERROR] -writes expects a fraction in [0, 1].\n");
+		exit(1);
+	}
+	// A state of 0 would stay 0
+	if(g->random == 0) g->random = 1;
+	parse_patterns(g, pattern_list);
+}
+
+/*
+ *	This function reads the comma separated patterns of -pattern, each a name with an
+ *	optional parameter after a colon.
+ *
+ *	Parameters:
+ *		generator* g -- the generator to add the patterns to
+ *		char* list -- the list, split up in place
+ *	Return:
+ *		None
+ */
+void parse_patterns(generator* g, char* list) {
+	char* save;
+	char* name = strtok_r(list, ",", &save);
+	while(name != NULL) {
+		if(g->num_patterns == MAX_PATTERNS) {
+			fprintf(stderr, "[ERROR] At most %d patterns.\n", MAX_PATTERNS);
+			exit(1);
+		}
+		pattern* pat = &g->patterns[g->num_patterns++];
+		char* param = strchr(name, ':');
+		if(param != NULL) *param++ = '\0';
+		pat->s = 1.0;
+		pat->k = 0;
+		if(strcmp(name, "zipf") == 0) {
+			pat->kind = ZIPF;
+			if(param != NULL) pat->s = atof(param);
+		} else if(strcmp(name, "uniform") == 0) pat->kind = UNIFORM;
+		else if(strcmp(name, "seq") == 0) pat->kind = SEQ;
+		else if(strcmp(name, "stride") == 0) {
+			pat->kind = STRIDE;
+			pat->k = param != NULL ? parse_size(param) : 4;
+		} else if(strcmp(name, "loop") == 0) {
+			pat->kind = LOOP;
+			pat->k = param != NULL ? parse_size(param) : g->ws;
+		} else {
+			fprintf(stderr, "[ERROR] Unknown pattern %s.\n", name);
+			exit(1);
+		}
+		if((pat->kind == STRIDE || pat->kind == LOOP) && (pat->k == 0 || pat->k > g->ws)) {
+			fprintf(stderr, "[ERROR] %s expects 1 to %lu pages.\n", name, g->ws);
+			exit(1);
+		}
+		if(pat->s < 0.0) {
+			fprintf(stderr, "[ERROR] zipf expects an exponent of at least 0.\n");
+			exit(1);
+		}
+		name = strtok_r(NULL, ",", &save);
+	}
+	if(g->num_patterns == 0) {
+		fprintf(stderr, "[ERROR] -pattern expects at least one pattern.\n");
+		exit(1);
+	}
+}
+
+/*
+ *	This function builds an alias table for ranks 0 to n - 1 picked with probability
+ *	proportional to 1 / (rank + 1)^s (Vose's method), so a rank takes one random number
+ *	and one lookup however large n is.
+ *
+ *	Parameters:
+ *		alias_table* t -- the table to build
+ *		unsigned long n -- number of ranks, at most 2^32
+ *		double s -- the zipf exponent
+ *	Return:
+ *		None
+ */
+void alias_init(alias_table* t, unsigned long n, double s) {
+	unsigned long i;
+	double* weight = (double*) malloc(n * sizeof(double));
+	unsigned int* small = (unsigned int*) malloc(n * sizeof(unsigned int));
+	unsigned int* large = (unsigned int*) malloc(n * sizeof(unsigned int));
+	t->threshold = (unsigned int*) malloc(n * sizeof(unsigned int));
+	t->alias = (unsigned int*) malloc(n * sizeof(unsigned int));
+	t->size = n;
+	if(weight == NULL || small == NULL || large == NULL || t->threshold == NULL || t->alias == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate zipf table.\n");
+		exit(1);
+	}
+	double sum = 0;
+	for(i = 0; i < n; i++) {
+		weight[i] = pow((double) (i + 1), -s);
+		sum += weight[i];
+	}
+	// Scale so the average weight is 1, then let each small entry borrow the rest from a large one
+	unsigned long num_small = 0, num_large = 0;
+	for(i = 0; i < n; i++) {
+		weight[i] *= n / sum;
+		if(weight[i] < 1.0) small[num_small++] = (unsigned int) i;
+		else large[num_large++] = (unsigned int) i;
+	}
+	while(num_small > 0 && num_large > 0) {
+		unsigned int less = small[--num_small];
+		unsigned int more = large[--num_large];
+		t->threshold[less] = (unsigned int) (weight[less] * 4294967296.0);
+		t->alias[less] = more;
+		weight[more] -= 1.0 - weight[less];
+		if(weight[more] < 1.0) small[num_small++] = more;
+		else large[num_large++] = more;
+	}
+	// What is left is 1 up to rounding
+	while(num_large > 0) {
+		t->threshold[large[--num_large]] = 0xffffffff;
+		t->alias[large[num_large]] = large[num_large];
+	}
+	while(num_small > 0) {
+		t->threshold[small[--num_small]] = 0xffffffff;
+		t->alias[small[num_small]] = small[num_small];
+	}
+	free(weight);
+	free(small);
+	free(large);
+}
+
+// Starts the next phase of a process: the next pattern on a working set somewhere else
+void next_phase(generator* g, gen_process* p) {
+	p->pattern = (p->pattern + 1) % g->num_patterns;
+	p->phase_left = g->phase_length;
+	p->base = next_random(g) % (g->pages - g->ws + 1);
+	p->cursor = 0;
+}
+
+/*
+ *	This function generates the next address a process references, following the
+ *	pattern of its phase.
+ *
+ *	Parameters:
+ *		generator* g -- the generator
+ *		gen_process* p -- the process
+ *	Return:
+ *		unsigned long -- the logical address
+ */
+unsigned long next_address(generator* g, gen_process* p) {
+	const pattern* pat = &g->patterns[p->pattern];
+	unsigned long word = g->page_size < sizeof(unsigned long) ? g->page_size : sizeof(unsigned long);
+	unsigned long r = next_random(g);
+	unsigned long page;
+	switch(pat->kind) {
+		case ZIPF: {
+			// The top bits pick an entry and the bottom ones decide between it and its alias
+			unsigned long entry = ((r >> 32) * pat->zipf.size) >> 32;
+			unsigned long rank = (unsigned int) r < pat->zipf.threshold[entry] ? entry : pat->zipf.alias[entry];
+			page = g->rank_page[rank];
+			r = next_random(g);
+			break;
+		}
+		case UNIFORM:
+			page = ((r >> 32) * g->ws) >> 32;
+			break;
+		case SEQ: {
+			unsigned long offset = p->cursor;
+			p->cursor += word;
+			if(p->cursor == g->ws * g->page_size) p->cursor = 0;
+			return p->base * g->page_size + offset;
+		}
+		case STRIDE:
+			page = p->cursor;
+			p->cursor += pat->k;
+			if(p->cursor >= g->ws) p->cursor = (p->cursor % pat->k + 1) % pat->k;
+			break;
+		default:
+			page = p->cursor;
+			p->cursor = (p->cursor + 1) % pat->k;
+			break;
+	}
+	return (p->base + page) * g->page_size + (r & (g->page_size - 1) & ~(word - 1));
+}
+
+// xorshift64* random numbers
+unsigned long next_random(generator* g) {
+	g->random ^= g->random >> 12;
+	g->random ^= g->random << 25;
+	g->random ^= g->random >> 27;
+	return g->random * 0x2545F4914F6CDD1DUL;
+}
+
+// Parse a count with trace_parse_size, a malformed one is an error
+unsigned long parse_size(const char* s) {
+	unsigned long size;
+	if(trace_parse_size(s, &size) != 0) {
+		fprintf(stderr, "[ERROR] Invalid count %s.\n", s);
+		exit(1);
+	}
+	return size;
+}
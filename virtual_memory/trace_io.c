@@ -0,0 +1,316 @@
+/*
+ * Bryce Souers
+ * trace_io.c - Block oriented reading and writing of binary address traces
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace_io.h"
+
+// Read up to n bytes, stopping early only at the end of the input or on an error
+static size_t trace_read(int fd, void* data, size_t n) {
+	size_t have = 0;
+	while(have < n) {
+		ssize_t got = read(fd, (char*) data + have, n - have);
+		if(got < 0 && errno == EINTR) continue;
+		if(got <= 0) break;
+		have += got;
+	}
+	return have;
+}
+
+// Write all n bytes, returns -1 if they could not be
+static int trace_write(int fd, const void* data, size_t n) {
+	const char* bytes = (const char*) data;
+	while(n > 0) {
+		ssize_t put = write(fd, bytes, n);
+		if(put < 0 && errno == EINTR) continue;
+		if(put <= 0) return -1;
+		bytes += put;
+		n -= put;
+	}
+	return 0;
+}
+
+// LEB128: seven bits per byte, low bits first, the top bit set on all but the last byte
+static inline unsigned char* pack_varint(unsigned char* p, unsigned long value) {
+	while(value >= 0x80) {
+		*p++ = (unsigned char) (value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char) value;
+	return p;
+}
+
+// Returns 0 if the varint runs past end or is longer than 64 bits
+static inline int unpack_varint(const unsigned char** p, const unsigned char* end, unsigned long* value) {
+	const unsigned char* q = *p;
+	unsigned long v = 0;
+	for(int shift = 0; q < end && shift < 64; shift += 7) {
+		unsigned char b = *q++;
+		v |= (unsigned long) (b & 0x7f) << shift;
+		if(b < 0x80) {
+			*value = v;
+			*p = q;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Open a trace for reading, returns 0 on success and -1 on failure
+int trace_open(trace_reader* r, const char* path) {
+	struct stat st;
+	memset(r, 0, sizeof(trace_reader));
+	r->tagged = -1;
+	r->fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if(r->fd < 0) return -1;
+	r->buffer = (unsigned long*) malloc(TRACE_BLOCK * sizeof(unsigned long));
+	if(r->buffer == NULL) {
+		if(r->fd != STDIN_FILENO) close(r->fd);
+		return -1;
+	}
+	// Map regular files and read them sequentially straight from the page cache
+	if(fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= (off_t) sizeof(unsigned long)) {
+		void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, r->fd, 0);
+		if(map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			madvise(map, st.st_size, MADV_WILLNEED);
+			const unsigned long* header = (const unsigned long*) map;
+			if(st.st_size >= (off_t) TRACE_PACKED_HEADER && memcmp(map, TRACE_PACKED_MAGIC, sizeof(unsigned long)) == 0) {
+				r->tagged = (header[1] & TRACE_PACKED_TAGGED) != 0;
+				r->packed = (const unsigned char*) map;
+				r->packed_bytes = st.st_size;
+				r->packed_pos = TRACE_PACKED_HEADER;
+				r->packed_mapped = 1;
+				r->packed_end = 1;
+				return 0;
+			}
+			free(r->buffer);
+			r->buffer = NULL;
+			r->map = header;
+			r->map_bytes = st.st_size;
+			r->count = st.st_size / sizeof(unsigned long);
+			return 0;
+		}
+	}
+	// Look for the header of a packed trace, keeping what was read for the first block if there is none
+	size_t have = trace_read(r->fd, r->tail, TRACE_PACKED_HEADER);
+	if(have == TRACE_PACKED_HEADER && memcmp(r->tail, TRACE_PACKED_MAGIC, sizeof(unsigned long)) == 0) {
+		unsigned long flags;
+		memcpy(&flags, r->tail + sizeof(unsigned long), sizeof(unsigned long));
+		r->tagged = (flags & TRACE_PACKED_TAGGED) != 0;
+		r->packed = (const unsigned char*) malloc(TRACE_PACKED_INPUT);
+		if(r->packed == NULL) {
+			trace_close(r);
+			return -1;
+		}
+	} else r->leftover = have;
+	return 0;
+}
+
+// Move what is left of the streamed input to the front of its buffer and read in more
+static void trace_refill(trace_reader* r) {
+	unsigned char* input = (unsigned char*) r->packed;
+	size_t left = r->packed_bytes - r->packed_pos;
+	memmove(input, input + r->packed_pos, left);
+	size_t got = trace_read(r->fd, input + left, TRACE_PACKED_INPUT - left);
+	if(got < TRACE_PACKED_INPUT - left) r->packed_end = 1;
+	r->packed_bytes = left + got;
+	r->packed_pos = 0;
+}
+
+// Unpack the next block of a packed trace into the buffer, returns how many unsigned longs it holds
+static size_t trace_unpack(trace_reader* r) {
+	trace_record* records = (trace_record*) r->buffer;
+	size_t limit = r->tagged ? TRACE_BLOCK / 2 : TRACE_BLOCK;
+	size_t n = 0;
+	while(n < limit) {
+		if(!r->packed_end && r->packed_bytes - r->packed_pos < TRACE_PACKED_RECORD) trace_refill(r);
+		const unsigned char* p = r->packed + r->packed_pos;
+		const unsigned char* end = r->packed + r->packed_bytes;
+		if(p == end) break;
+		// Unpack while a whole record is buffered or no more input is coming
+		while(n < limit && p < end && (r->packed_end || (size_t) (end - p) >= TRACE_PACKED_RECORD)) {
+			unsigned long delta, pid = 0, flags = 0;
+			if(!unpack_varint(&p, end, &delta) ||
+			   (r->tagged && (!unpack_varint(&p, end, &pid) || !unpack_varint(&p, end, &flags)))) {
+				// A truncated or corrupt record ends the trace
+				r->packed_pos = r->packed_bytes;
+				r->packed_end = 1;
+				return r->tagged ? 2 * n : n;
+			}
+			r->prev += (delta >> 1) ^ (0UL - (delta & 1));
+			if(r->tagged) {
+				records[n].addr = r->prev;
+				records[n].pid = (unsigned int) pid;
+				records[n].flags = (unsigned int) flags;
+			} else r->buffer[n] = r->prev;
+			n++;
+		}
+		r->packed_pos = p - r->packed;
+	}
+	return r->tagged ? 2 * n : n;
+}
+
+// Point block at the next run of addresses and return how many there are (0 at the end)
+size_t trace_next_block(trace_reader* r, const unsigned long** block) {
+	if(r->map != NULL) {
+		size_t n = r->count - r->pos;
+		if(n > TRACE_BLOCK) n = TRACE_BLOCK;
+		*block = r->map + r->pos;
+		r->pos += n;
+		return n;
+	}
+	if(r->packed != NULL) {
+		size_t n = trace_unpack(r);
+		*block = r->buffer;
+		r->pos += n;
+		return n;
+	}
+	// Fill the buffer with whole addresses, carrying a partial one over to the next call
+	char* bytes = (char*) r->buffer;
+	size_t have = r->leftover;
+	memcpy(bytes, r->tail, have);
+	have += trace_read(r->fd, bytes + have, TRACE_BLOCK * sizeof(unsigned long) - have);
+	size_t n = have / sizeof(unsigned long);
+	r->leftover = have % sizeof(unsigned long);
+	memcpy(r->tail, bytes + n * sizeof(unsigned long), r->leftover);
+	*block = r->buffer;
+	r->pos += n;
+	return n;
+}
+
+// Start over at the first address, returns -1 if the trace is a pipe
+int trace_rewind(trace_reader* r) {
+	r->prev = 0;
+	if(r->map != NULL || r->packed_mapped) {
+		r->pos = 0;
+		r->packed_pos = TRACE_PACKED_HEADER;
+		return 0;
+	}
+	if(lseek(r->fd, r->packed != NULL ? TRACE_PACKED_HEADER : 0, SEEK_SET) < 0) return -1;
+	r->pos = 0;
+	r->leftover = 0;
+	r->packed_bytes = 0;
+	r->packed_pos = 0;
+	r->packed_end = 0;
+	return 0;
+}
+
+// Whether trace_rewind() can start the trace over, i.e. it is not read from a pipe
+int trace_seekable(const trace_reader* r) {
+	return r->map != NULL || r->packed_mapped || lseek(r->fd, 0, SEEK_CUR) >= 0;
+}
+
+void trace_close(trace_reader* r) {
+	if(r->map != NULL) munmap((void*) r->map, r->map_bytes);
+	if(r->packed_mapped) munmap((void*) r->packed, r->packed_bytes);
+	else free((void*) r->packed);
+	free(r->buffer);
+	if(r->fd >= 0 && r->fd != STDIN_FILENO) close(r->fd);
+	r->fd = -1;
+}
+
+// Open a trace for writing ("-" for stdout), returns 0 on success and -1 on failure
+int trace_writer_open(trace_writer* w, const char* path) {
+	memset(w, 0, sizeof(trace_writer));
+	w->fd = strcmp(path, "-") == 0 ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(w->fd < 0) return -1;
+	w->buffer = (unsigned long*) malloc(TRACE_BLOCK * sizeof(unsigned long));
+	if(w->buffer == NULL) return -1;
+	return 0;
+}
+
+// Open a packed trace for writing and write its header, returns 0 on success and -1 on failure
+int trace_writer_open_packed(trace_writer* w, const char* path, int tagged) {
+	unsigned long header[2];
+	if(trace_writer_open(w, path) != 0) return -1;
+	w->packed = 1;
+	w->tagged = tagged;
+	// A tagged record is two unsigned longs of at most 10 bytes each once packed
+	w->bytes = (unsigned char*) malloc(TRACE_BLOCK * 10);
+	if(w->bytes == NULL) return -1;
+	memcpy(&header[0], TRACE_PACKED_MAGIC, sizeof(unsigned long));
+	header[1] = tagged ? TRACE_PACKED_TAGGED : 0;
+	w->written = sizeof(header);
+	return trace_write(w->fd, header, sizeof(header));
+}
+
+// Write out everything buffered so far
+static int trace_writer_flush(trace_writer* w) {
+	const void* data = w->buffer;
+	size_t bytes = w->len * sizeof(unsigned long);
+	if(w->packed) {
+		unsigned char* p = w->bytes;
+		size_t step = w->tagged ? 2 : 1;
+		for(size_t i = 0; i + step <= w->len; i += step) {
+			// Zigzag the difference so small steps back pack as small as steps forward
+			unsigned long delta = w->buffer[i] - w->prev;
+			p = pack_varint(p, (delta << 1) ^ (0UL - (delta >> 63)));
+			w->prev = w->buffer[i];
+			if(w->tagged) {
+				const trace_record* record = (const trace_record*) &w->buffer[i];
+				p = pack_varint(p, record->pid);
+				p = pack_varint(p, record->flags);
+			}
+		}
+		data = w->bytes;
+		bytes = p - w->bytes;
+	}
+	if(trace_write(w->fd, data, bytes) != 0) return -1;
+	w->written += bytes;
+	w->len = 0;
+	return 0;
+}
+
+// Hand out room for n (at most TRACE_BLOCK) addresses, flushing first if needed.
+// Returns NULL if the flush failed.
+unsigned long* trace_writer_reserve(trace_writer* w, size_t n) {
+	if(w->len + n > TRACE_BLOCK && trace_writer_flush(w) != 0) return NULL;
+	unsigned long* slot = w->buffer + w->len;
+	w->len += n;
+	return slot;
+}
+
+// Flush and close, returns -1 if any data could not be written
+int trace_writer_close(trace_writer* w) {
+	int status = trace_writer_flush(w);
+	if(close(w->fd) != 0) status = -1;
+	free(w->buffer);
+	free(w->bytes);
+	return status;
+}
+
+// Seconds on the monotonic clock, for throughput numbers
+double trace_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int trace_parse_size(const char* s, unsigned long* size) {
+	char* end;
+	unsigned long value = strtoul(s, &end, 10);
+	if(end == s) return -1;
+	switch(*end) {
+		case 'T': case 't': value <<= 10;
+			/* fall through */
+		case 'G': case 'g': value <<= 10;
+			/* fall through */
+		case 'M': case 'm': value <<= 10;
+			/* fall through */
+		case 'K': case 'k': value <<= 10;
+			end++;
+	}
+	if(*end != '\0') return -1;
+	*size = value;
+	return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Bryce Souers
+ * trace_io.h - Block oriented reading and writing of binary address traces
+ *				(one unsigned long per address) shared by address_translation
+ *				and virtual_memory
+ */
+
+#ifndef TRACE_IO_H
+#define TRACE_IO_H
+
+#include <stddef.h>
+
+// Number of addresses handed out or buffered per block (512 KB)
+#define TRACE_BLOCK (64 * 1024)
+
+// Record of a tagged trace: an address, the process that issued it and access flags.
+// A fork record has TRACE_FORK set and carries the child's pid in addr.
+typedef struct trace_record {
+	unsigned long addr;
+	unsigned int pid;
+	unsigned int flags;
+} trace_record;
+
+#define TRACE_WRITE 0x1
+#define TRACE_FORK  0x2
+
+// A packed trace starts with TRACE_PACKED_MAGIC and a flags word, then holds
+// every address as the LEB128 varint of the zigzagged difference to the one
+// before it (records add their pid and flags as two more varints). Readers
+// tell it from a raw trace by the magic and unpack it block by block.
+#define TRACE_PACKED_MAGIC  "VMTRACE1"
+#define TRACE_PACKED_TAGGED 0x1
+#define TRACE_PACKED_HEADER (2 * sizeof(unsigned long))
+#define TRACE_PACKED_INPUT  (256 * 1024)
+#define TRACE_PACKED_RECORD 30		// longest packed record: three 10 byte varints
+
+// Reader over a trace file. Regular files are mmapped and handed out in place,
+// anything else (pipes, "-" for stdin) is read into a block buffer. Packed
+// traces are unpacked into the block buffer and leave map NULL, so only raw
+// traces can be addressed in place.
+typedef struct trace_reader {
+	int fd;
+	const unsigned long* map;
+	size_t map_bytes;
+	size_t count;
+	size_t pos;
+	unsigned long* buffer;
+	char tail[TRACE_PACKED_HEADER];
+	size_t leftover;
+	int tagged;						// from the header of a packed trace, -1 for a raw one
+	const unsigned char* packed;	// mapped packed trace, or its input buffer when streamed
+	size_t packed_bytes;
+	size_t packed_pos;
+	int packed_mapped;
+	int packed_end;					// no more input to read into the buffer
+	unsigned long prev;
+} trace_reader;
+
+// Buffered writer that lets callers translate straight into its buffer.
+// A packed writer encodes the buffer on every flush, tagged ones two
+// unsigned longs (one trace_record) at a time.
+typedef struct trace_writer {
+	int fd;
+	unsigned long* buffer;
+	size_t len;
+	int packed;
+	int tagged;
+	unsigned long prev;
+	unsigned char* bytes;
+	unsigned long written;
+} trace_writer;
+
+int trace_open(trace_reader* r, const char* path);
+size_t trace_next_block(trace_reader* r, const unsigned long** block);
+int trace_rewind(trace_reader* r);
+int trace_seekable(const trace_reader* r);
+void trace_close(trace_reader* r);
+
+int trace_writer_open(trace_writer* w, const char* path);
+int trace_writer_open_packed(trace_writer* w, const char* path, int tagged);
+unsigned long* trace_writer_reserve(trace_writer* w, size_t n);
+int trace_writer_close(trace_writer* w);
+
+double trace_now();
+
+// Parse a count with an optional K, M, G or T suffix (powers of 1024) into size.
+// Returns 0, or -1 when s is not a number or anything but one suffix follows it.
+int trace_parse_size(const char* s, unsigned long* size);
+
+#endif
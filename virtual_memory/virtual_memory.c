@@ -3,150 +3,2642 @@
  * virtual_memory.c - Dynamically manage a page table and perform logical
  * 					  to physical memory translations along with a page
  *					  replacement algorithm
- * Usage: ./virtual_memory input_sequence_file output_file
+ * Usage: ./virtual_memory [options] input_sequence_file output_file
+ *
+ * Options:
+ *	-page-size bytes	page size, power of two (default 128)
+ *	-va-bits n			virtual address width in bits, up to 64 (default 12)
+ *	-phys-mem bytes		physical memory size (default 1024)
+ *	-levels n			page table levels, 1 to 4 (default 1)
+ *	-tlb sets:ways		set-associative TLB in front of the walk (default none)
+ *	-reserved n			frames reserved for the OS at the bottom of memory (default 1)
+ *	-policy list		comma separated replacement policies out of LRU, FIFO,
+ *						CLOCK, LFU, ARC and OPT, or "all" (default LRU). OPT reads
+ *						the trace twice, so it cannot take it from a pipe
+ *	-tagged				the trace holds trace_record entries (address, pid, flags)
+ *						instead of bare addresses
+ *	-replacement mode	"global" (default) or "local" replacement between processes
+ *	-ws-window n		working set window in references of a process of a tagged
+ *						trace (default 4096, 0 for none)
+ *	-mem-time ns		time of one memory reference, page table walks included (default 100)
+ *	-page-in-time us	time to read a page from the backing store (default 100)
+ *	-write-back-time us	time to start a write to the backing store (default 100)
+ *	-transfer-time us	time per further page of a clustered write (default 10)
+ *	-write-back-batch n	dirty pages collected before they are written back (default 32)
+ *	-prefetch list		comma separated prefetchers out of next, stride and markov, or
+ *						"all", each simulated next to a run without prefetching
+ *	-prefetch-depth n	pages a prefetcher brings in per trigger (default 4)
+ *	-mrc				instead of simulating, compute the LRU miss ratio curve for
+ *						every memory size in one pass and write it to the output file
+ *	-sample rate		with -mrc, only follow this fraction of the pages (default 1)
+ *	-huge-size bytes	also map huge pages of this size, a power of two above the page
+ *						size (e.g. 2M with 4K pages); needs at least 2 levels
+ *	-promote n			resident pages a region of a huge page needs, the faulting one
+ *						included, for a fault to map it as a huge page (default 1)
+ *	-split mode			what happens to a huge page replacement picks: "underused"
+ *						(default) splits one with untouched pages, "never" evicts it whole
+ *	-huge-tlb sets:ways	separate TLB for huge pages (default: they share the TLB)
+ *
+ * Sizes accept a K, M, G or T suffix. The defaults reproduce the original
+ * 32 page, 8 frame setup with frame 0 reserved. Several policies or prefetchers
+ * are simulated side by side over one pass of the trace; the output file holds
+ * the translations of the first policy without prefetching, one physical
+ * address per record and all ones for fork records and addresses outside the
+ * address space. A trace of "-" is read from stdin, and packed traces from
+ * trace_gen are recognized by their header.
  */
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "trace_io.h"
 
 #define PHYSICAL_MEM_SIZE 1024
 #define VIRTUAL_MEM_SIZE  4096
 #define BYTES_PER_PAGE    128
+#define MAX_LEVELS        4
+#define MAX_POLICIES      8
+#define MAX_PREFETCHERS   4
+#define STRIDE_STREAMS    16
+#define MARKOV_WAYS       2
+#define MAX_PID           (1 << 24)
+#define PID_BITS          24
+#define NEVER             ((unsigned long) -1)
 
 // Structure for each page table entry
 typedef struct PTE {
-	int valid;
+	unsigned char valid;
+	unsigned char cow;
+	unsigned char dirty;
+	unsigned char referenced;
 	int frame_number;
+	unsigned long last_ref;
 } PTE;
 
-// Establish global variables to use
-PTE page_table[32];
-int clock = 0;
-int free_frames[8] = {0,1,1,1,1,1,1,1};
-int lru_count[8] =   {0,0,0,0,0,0,0,0};
-int reverse_map[8] = {-1,-1,-1,-1,-1,-1,-1,-1};
-unsigned long LA;
+// Last level of a page table: the PTEs of its pages, and the entry of the level above
+// that maps its whole range as one huge page when valid (only with huge pages)
+typedef struct pt_leaf {
+	PTE huge;
+	PTE ptes[];
+} pt_leaf;
+
+// One (pid, page) pair mapped onto a frame
+typedef struct mapping {
+	PTE* pte;
+	unsigned int pid;
+	unsigned long vpn;
+	struct mapping* next;
+} mapping;
+
+// Structure for each physical frame (the inverted page table entry): the first mapping,
+// any further ones from copy-on-write sharing, and the process whose policy domain holds it.
+// The first frame of a huge page stands for all of them.
+typedef struct frame {
+	mapping map;
+	mapping* shared;
+	int refs;
+	int huge;
+	unsigned int owner;
+	unsigned long lru_count;
+	unsigned long count;
+	int heap_index;
+	int arc_list;
+	int prefetched;
+	unsigned long ready;
+} frame;
+
+// Intrusive doubly linked list links, indexed like the frames they belong to
+typedef struct list_link {
+	int prev;
+	int next;
+} list_link;
+
+typedef struct index_list {
+	int head;
+	int tail;
+	int size;
+} index_list;
+
+// Structure for each TLB entry
+typedef struct tlb_entry {
+	int valid;
+	int huge;
+	int writable;
+	int frame_number;
+	unsigned int pid;
+	unsigned long vpn;
+	unsigned long lru_count;
+} tlb_entry;
+
+// Open addressing hash map from a nonzero unsigned long key to an unsigned long value
+typedef struct ul_map {
+	unsigned long* keys;
+	unsigned long* values;
+	unsigned long capacity;
+	unsigned long size;
+} ul_map;
+
+// Replacement state over a set of frames: all of memory under global replacement,
+// one process's frames under local replacement. Frame lists (LRU/FIFO use the first,
+// CLOCK uses it as its ring, ARC uses T1 and T2), the CLOCK hand, a frame heap for
+// LFU/OPT and ARC's target size and ghost lists. Prefetched pages nobody referenced yet
+// wait outside the policy in their own list, oldest at the tail.
+typedef struct policy_domain {
+	index_list lists[2];
+	int clock_hand;
+	int* heap;
+	int heap_size;
+	int heap_capacity;
+	double arc_p;
+	index_list ghosts[2];
+	list_link* ghost_links;
+	PTE** ghost_pte;
+	int* ghost_list;
+	int ghost_free;
+	ul_map ghost_map;
+	index_list prefetched;
+	int resident;
+} policy_domain;
+
+// Per process state: radix page table (interior levels hold child pointers, the last
+// level holds PTEs), policy domain for local replacement, statistics and the working
+// set over the last ws_window references of the process
+typedef struct process {
+	int exists;
+	void* root;
+	policy_domain domain;
+	unsigned long accesses;
+	unsigned long page_faults;
+	unsigned long cow_faults;
+	PTE** ws_ring;
+	unsigned long ws_size;
+	unsigned long ws_sum;
+	unsigned long ws_max;
+} process;
+
+struct vm_sim;
+
+// Replacement policy interface. victim() picks a resident frame of the domain and drops
+// it from the domain's bookkeeping, insert() takes over a frame that was just loaded and
+// remove() drops a frame that leaves without being replaced (NULL if the policy cannot).
+typedef struct policy {
+	const char* name;
+	void (*init)(struct vm_sim* sim, policy_domain* d);
+	void (*release)(struct vm_sim* sim, policy_domain* d);
+	void (*insert)(struct vm_sim* sim, policy_domain* d, int frame_number);
+	void (*access)(struct vm_sim* sim, policy_domain* d, int frame_number);
+	int (*victim)(struct vm_sim* sim, policy_domain* d, PTE* incoming);
+	void (*remove)(struct vm_sim* sim, policy_domain* d, int frame_number);
+} policy;
+
+// A stride stream: the last page a process touched in it, the stride between the last
+// two and how many times in a row that stride repeated
+typedef struct stride_stream {
+	unsigned int pid;
+	unsigned long last;
+	long stride;
+	int confidence;
+	unsigned long lru_count;
+} stride_stream;
+
+// Prefetcher state: stride streams, and for markov the pages that followed each page
+// in the fault stream (MARKOV_WAYS per page, most recent first) and the last fault of
+// every process
+typedef struct prefetch_state {
+	stride_stream streams[STRIDE_STREAMS];
+	ul_map successor_index;
+	unsigned long* successors;
+	unsigned long successor_count;
+	unsigned long successor_capacity;
+	ul_map last_fault;
+} prefetch_state;
+
+// Prefetcher interface. predict() learns from a fault or a first reference to a
+// prefetched page and fills pages with up to depth pages to read ahead.
+typedef struct prefetcher {
+	const char* name;
+	void (*init)(struct vm_sim* sim, prefetch_state* p);
+	void (*release)(struct vm_sim* sim, prefetch_state* p);
+	int (*predict)(struct vm_sim* sim, prefetch_state* p, unsigned int pid, unsigned long vpn,
+				   unsigned long* pages, int depth);
+} prefetcher;
+
+// Simulator parameters
+typedef struct vm_config {
+	unsigned long page_size;
+	int va_bits;
+	unsigned long phys_mem;
+	int levels;
+	int tlb_sets;
+	int tlb_ways;
+	int reserved;
+	int tagged;
+	int local;
+	unsigned long ws_window;
+	int mrc;
+	double sample_rate;
+	unsigned long mem_time;
+	unsigned long page_in_time;
+	unsigned long write_back_time;
+	unsigned long transfer_time;
+	int write_back_batch;
+	int prefetch_depth;
+	unsigned long huge_size;
+	unsigned long promote;
+	int split;
+	int huge_tlb_sets;
+	int huge_tlb_ways;
+} vm_config;
+
+// A page waiting to be written back
+typedef struct swap_page {
+	unsigned int pid;
+	unsigned long vpn;
+} swap_page;
+
+// Stack distance state: a Fenwick tree and plain marks over reference times (1 based,
+// renumbered when the tree fills up), the last reference time of every page and the
+// histogram of stack distances
+typedef struct mrc_state {
+	unsigned int* tree;
+	unsigned char* marks;
+	unsigned long capacity;
+	unsigned long now;
+	ul_map last;
+	unsigned long* hist;
+	unsigned long hist_size;
+	unsigned long references;
+	unsigned long sampled;
+	unsigned long cold;
+	unsigned long threshold;
+} mrc_state;
+
+// Full simulator state
+typedef struct vm_sim {
+	vm_config cfg;
+	const policy* pol;
+	const prefetcher* pf;
+	prefetch_state prefetch;
+	// Derived address layout
+	int page_shift;
+	unsigned long offset_mask;
+	unsigned long va_limit;
+	int level_bits[MAX_LEVELS];
+	int level_shift[MAX_LEVELS];
+	// Processes indexed by pid
+	process* procs;
+	unsigned int num_procs;
+	unsigned int live_procs;
+	// Physical frames and the stack of free ones
+	frame* frames;
+	int num_frames;
+	int* free_frames;
+	int free_count;
+	// Huge pages: pages per huge page (1 << huge_order), and instead of the stack a bitmap
+	// of free frames, the free frames of every block and the blocks with some (list 0) and
+	// all (list 1) of their frames free. touched marks pages of huge pages referenced since
+	// the huge page was mapped.
+	int huge_order;
+	unsigned long huge_pages;
+	unsigned long* free_bits;
+	unsigned long* touched;
+	int* block_free;
+	list_link* block_links;
+	index_list free_blocks[2];
+	// Policy state: frame links shared by all domains, the domain used under global
+	// replacement and OPT's next-use index
+	list_link* links;
+	policy_domain global;
+	unsigned long* next_use;
+	// TLB, and the one for huge pages if they have their own
+	tlb_entry* tlb;
+	tlb_entry* huge_tlb;
+	// Backing store: simulated time in ns, when the device finishes its queued I/O, the
+	// page a read-ahead could continue with in the same I/O (plus one, 0 when any other
+	// I/O came in between) and the dirty pages waiting for write-back
+	unsigned long now;
+	unsigned long device_free;
+	swap_page stream;
+	swap_page* write_back;
+	int write_back_count;
+	// Statistics
+	unsigned long clock;
+	unsigned long pos;
+	unsigned long accesses;
+	unsigned long invalid;
+	unsigned long forks;
+	unsigned long page_faults;
+	unsigned long cow_faults;
+	unsigned long evictions;
+	unsigned long tlb_hits;
+	unsigned long huge_tlb_hits;
+	unsigned long tlb_misses;
+	unsigned long page_walks;
+	unsigned long walk_refs;
+	unsigned long table_pages;
+	unsigned long table_bytes;
+	unsigned long page_ins;
+	unsigned long write_back_pages;
+	unsigned long write_back_ios;
+	unsigned long stall_time;
+	unsigned long device_busy;
+	unsigned long prefetches;
+	unsigned long prefetch_hits;
+	unsigned long prefetch_unused;
+	unsigned long promotions;
+	unsigned long collapsed;
+	unsigned long huge_fallbacks;
+	unsigned long splits;
+	unsigned long huge_evictions;
+	unsigned long bloat;
+	unsigned long bloat_peak;
+	unsigned long bloat_sum;
+} vm_sim;
 
 // Function forward declarations
-int find_empty_frame();
-int find_lru();
+void parse_args(int argc, char* argv[], vm_config* cfg, const policy** pols, int* num_pols,
+				const prefetcher** pfs, int* num_pfs, char** infile_name, char** outfile_name);
+unsigned long parse_size(const char* s);
+const policy* find_policy(const char* name);
+const prefetcher* find_prefetcher(const char* name);
+void sim_init(vm_sim* sim, vm_config* cfg, const policy* pol, const prefetcher* pf);
+void sim_free(vm_sim* sim);
+int sim_access(vm_sim* sim, unsigned int pid, unsigned long LA, unsigned int flags, unsigned long* PA);
+void sim_fork(vm_sim* sim, unsigned int parent, unsigned int child);
+void sim_report(vm_sim* sim);
+static inline process* get_process(vm_sim* sim, unsigned int pid);
+process* new_process(vm_sim* sim, unsigned int pid);
+void ws_reference(vm_sim* sim, process* proc, PTE* pte);
+PTE* pt_walk(vm_sim* sim, process* proc, unsigned long vpn);
+void pt_free(vm_sim* sim, void* node, int level);
+int tlb_lookup(vm_sim* sim, unsigned int pid, unsigned long vpn, int* writable, int* huge);
+void tlb_insert(vm_sim* sim, unsigned int pid, unsigned long vpn, int frame_number, int writable, int huge);
+void tlb_invalidate(vm_sim* sim, unsigned int pid, unsigned long vpn);
+void tlb_flush_pid(vm_sim* sim, unsigned int pid);
+int find_empty_frame(vm_sim* sim);
+void frame_take(vm_sim* sim, int f);
+void frame_free(vm_sim* sim, int f);
+int block_alloc(vm_sim* sim);
+int pick_victim(vm_sim* sim, process* proc, PTE* incoming, int prefetch, policy_domain** from);
+int get_frame(vm_sim* sim, process* proc, PTE* incoming, int prefetch);
+int get_huge_frame(vm_sim* sim, process* proc, PTE* incoming);
+int huge_promote(vm_sim* sim, process* proc, unsigned int pid, PTE** pte, unsigned long vpn);
+void huge_split(vm_sim* sim, policy_domain* d, int f);
+unsigned long huge_untouched(vm_sim* sim, int f);
+void frame_add_mapping(vm_sim* sim, int f, unsigned int pid, PTE* pte, unsigned long vpn);
+void frame_drop_mapping(vm_sim* sim, int f, PTE* pte);
+PTE* frame_find_pte(vm_sim* sim, int f, unsigned int pid, unsigned long vpn);
+int pte_evict(PTE* pte);
+void evict_frame(vm_sim* sim, int f);
+int frame_referenced(vm_sim* sim, int f);
+void swap_page_in(vm_sim* sim, unsigned long pages);
+void swap_write(vm_sim* sim, unsigned long pages);
+void swap_flush(vm_sim* sim);
+void list_push_front(list_link* links, index_list* list, int i);
+void list_unlink(list_link* links, index_list* list, int i);
+void list_clear(index_list* list);
+void prefetch_run(vm_sim* sim, process* proc, unsigned int pid, unsigned long vpn);
+void opt_build_index(vm_sim* sim, trace_reader* infile);
+void mrc_run(vm_config* cfg, trace_reader* infile, const char* outfile_name);
+
+unsigned long map_hash(unsigned long key);
+void map_init(ul_map* map, unsigned long capacity);
+void map_free(ul_map* map);
+unsigned long* map_get(ul_map* map, unsigned long key);
+void map_put(ul_map* map, unsigned long key, unsigned long value);
+void map_remove(ul_map* map, unsigned long key);
+
+extern const policy policies[];
+extern const prefetcher prefetchers[];
 
 int main(int argc, char* argv[]) {
+	vm_config cfg;
+	const policy* pols[MAX_POLICIES];
+	const prefetcher* pfs[MAX_PREFETCHERS];
+	int num_pols = 0;
+	int num_pfs = 0;
+	char* infile_name = NULL;
+	char* outfile_name = NULL;
 	int i;
-	// Initialize each PTE's valid bit to 0
-	for(i = 0; i < 32; i++) {
-		page_table[i].valid = 0;
-	}
-	// Open infile for reading in binary mode
-	FILE* infile;
-	infile = fopen(argv[1], "rb");
-	if(infile == NULL) {
+	size_t j;
+	parse_args(argc, argv, &cfg, pols, &num_pols, pfs, &num_pfs, &infile_name, &outfile_name);
+	// Open infile for reading
+	trace_reader infile;
+	if(trace_open(&infile, infile_name) != 0) {
 		fprintf(stderr, "[ERROR] Unable to open infile.\n");
 		exit(1);
 	}
-	// Open outfile for writing in binary mode
-	FILE* outfile;
-	outfile = fopen(argv[2], "wb");
-	if(outfile == NULL) {
+	// A packed trace says itself whether it holds records
+	if(infile.tagged >= 0) cfg.tagged = infile.tagged;
+	if(cfg.mrc) {
+		mrc_run(&cfg, &infile, outfile_name);
+		trace_close(&infile);
+		return 0;
+	}
+	// OPT reads the trace once more up front, which a pipe cannot give it
+	for(i = 0; i < num_pols; i++) {
+		if(strcmp(pols[i]->name, "OPT") == 0 && !trace_seekable(&infile)) {
+			fprintf(stderr, "[ERROR] OPT needs to read the trace twice and cannot take it from a pipe.\n");
+			exit(1);
+		}
+	}
+	// Open outfile for writing
+	trace_writer outfile;
+	if(trace_writer_open(&outfile, outfile_name) != 0) {
 		fprintf(stderr, "[ERROR] Unable to open outfile.\n");
 		exit(1);
 	}
-	// Track number of page faults
-	int page_faults = 0;
-	// Loop over each address in the infile
-	while(fread(&LA, sizeof(unsigned long), 1, infile) == 1) {
-		// Get page number and offset from the virtual address
-		int page_num = LA / BYTES_PER_PAGE;
-		int page_offset = LA % BYTES_PER_PAGE;
-		int frame_number;
-		unsigned long PA;
-		// Case for when there is a valid entry for the page number
-		if(page_table[page_num].valid == 1) {
-			frame_number = page_table[page_num].frame_number;
-			PA = frame_number * BYTES_PER_PAGE + page_offset;
-			if(fwrite(&PA, sizeof(PA), 1, outfile) != 1) {
-				fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+	// One simulator per policy and prefetcher, all fed from the same pass over the trace
+	int num_sims = num_pols * num_pfs;
+	vm_sim* sims = (vm_sim*) malloc(num_sims * sizeof(vm_sim));
+	if(sims == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate simulators.\n");
+		exit(1);
+	}
+	for(i = 0; i < num_sims; i++) {
+		sim_init(&sims[i], &cfg, pols[i / num_pfs], pfs[i % num_pfs]);
+		if(sims[i].next_use != NULL) opt_build_index(&sims[i], &infile);
+	}
+	const unsigned long* block;
+	size_t n;
+	unsigned long other_PA;
+	double start = trace_now();
+	// Loop over each block of addresses (or records) in the infile
+	while((n = trace_next_block(&infile, &block)) > 0) {
+		const trace_record* records = (const trace_record*) block;
+		if(cfg.tagged) n = n * sizeof(unsigned long) / sizeof(trace_record);
+		unsigned long* PA = trace_writer_reserve(&outfile, n);
+		if(PA == NULL) {
+			fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+			exit(1);
+		}
+		for(i = 0; i < num_sims; i++) {
+			vm_sim* sim = &sims[i];
+			if(!cfg.tagged) {
+				for(j = 0; j < n; j++) sim_access(sim, 0, block[j], 0, i == 0 ? &PA[j] : &other_PA);
+				continue;
+			}
+			for(j = 0; j < n; j++) {
+				unsigned long* out = i == 0 ? &PA[j] : &other_PA;
+				if(records[j].flags & TRACE_FORK) {
+					sim_fork(sim, records[j].pid, (unsigned int) records[j].addr);
+					*out = (unsigned long) -1;
+				} else sim_access(sim, records[j].pid, records[j].addr, records[j].flags, out);
+			}
+		}
+	}
+	if(trace_writer_close(&outfile) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+		exit(1);
+	}
+	double elapsed = trace_now() - start;
+	// Clean up :)
+	trace_close(&infile);
+	for(i = 0; i < num_sims; i++) swap_flush(&sims[i]);
+	sim_report(&sims[0]);
+	if(num_pfs > 1) {
+		// Prefetchers against the run of the same policy without one. Accuracy is the share of
+		// prefetched pages referenced before eviction, coverage the share of would-be faults
+		// a prefetch took care of.
+		printf("\nPrefetch depth %d\n", cfg.prefetch_depth);
+		printf("Policy Prefetch  Page faults   Change   Prefetched   Accuracy   Coverage  Evicted unused     EAT (ns)\n");
+		for(i = 0; i < num_sims; i++) {
+			vm_sim* sim = &sims[i];
+			vm_sim* base = &sims[i - i % num_pfs];
+			unsigned long translated = sim->accesses - sim->invalid;
+			printf("%-6s %-8s %12lu %+7.2f%% %12lu %9.2f%% %9.2f%% %15lu %12.1f\n", sim->pol->name, sim->pf->name,
+				   sim->page_faults, base->page_faults ? 100.0 * ((double) sim->page_faults - base->page_faults) / base->page_faults : 0.0,
+				   sim->prefetches, sim->prefetches ? 100.0 * sim->prefetch_hits / sim->prefetches : 0.0,
+				   sim->page_faults + sim->prefetch_hits ? 100.0 * sim->prefetch_hits / (sim->page_faults + sim->prefetch_hits) : 0.0,
+				   sim->prefetch_unused, translated ? (double) sim->now / translated : 0.0);
+		}
+	} else if(num_pols > 1 && cfg.huge_size > 0) {
+		// Huge pages change replacement too, so every policy gets their statistics
+		printf("\nPolicy   Page faults   Fault rate   Write-backs     EAT (ns)   Promoted      Split   TLB misses   Avg bloat\n");
+		for(i = 0; i < num_pols; i++) {
+			unsigned long translated = sims[i].accesses - sims[i].invalid;
+			printf("%-6s %13lu %11.4f%% %13lu %12.1f %10lu %10lu %11.4f%% %11.1f\n", sims[i].pol->name, sims[i].page_faults,
+				   translated ? 100.0 * sims[i].page_faults / translated : 0.0, sims[i].write_back_pages,
+				   translated ? (double) sims[i].now / translated : 0.0, sims[i].promotions, sims[i].splits,
+				   translated ? 100.0 * sims[i].tlb_misses / translated : 0.0,
+				   translated ? (double) sims[i].bloat_sum / translated : 0.0);
+		}
+	} else if(num_pols > 1) {
+		printf("\nPolicy   Page faults   Fault rate   Write-backs     EAT (ns)\n");
+		for(i = 0; i < num_pols; i++) {
+			unsigned long translated = sims[i].accesses - sims[i].invalid;
+			printf("%-6s %13lu %11.4f%% %13lu %12.1f\n", sims[i].pol->name, sims[i].page_faults,
+				   translated ? 100.0 * sims[i].page_faults / translated : 0.0, sims[i].write_back_pages,
+				   translated ? (double) sims[i].now / translated : 0.0);
+		}
+	}
+	printf("Simulated %lu addresses x %d runs in %.3f s (%.0f addresses/s)\n", sims[0].accesses, num_sims,
+		   elapsed, elapsed > 0 ? sims[0].accesses * num_sims / elapsed : 0.0);
+	for(i = 0; i < num_sims; i++) sim_free(&sims[i]);
+	free(sims);
+	return 0;
+}
+
+/* ARGUMENT FUNCTIONS */
+
+// Fill in the simulator configuration, policies and file names from the command line
+void parse_args(int argc, char* argv[], vm_config* cfg, const policy** pols, int* num_pols,
+				const prefetcher** pfs, int* num_pfs, char** infile_name, char** outfile_name) {
+	int i;
+	int positional = 0;
+	cfg->page_size = BYTES_PER_PAGE;
+	cfg->va_bits = 12;
+	cfg->phys_mem = PHYSICAL_MEM_SIZE;
+	cfg->levels = 1;
+	cfg->tlb_sets = 0;
+	cfg->tlb_ways = 0;
+	cfg->reserved = 1;
+	cfg->tagged = 0;
+	cfg->local = 0;
+	cfg->ws_window = 4096;
+	cfg->mrc = 0;
+	cfg->sample_rate = 1.0;
+	cfg->mem_time = 100;
+	cfg->page_in_time = 100 * 1000;
+	cfg->write_back_time = 100 * 1000;
+	cfg->transfer_time = 10 * 1000;
+	cfg->write_back_batch = 32;
+	cfg->prefetch_depth = 4;
+	cfg->huge_size = 0;
+	cfg->promote = 1;
+	cfg->split = 1;
+	cfg->huge_tlb_sets = 0;
+	cfg->huge_tlb_ways = 0;
+	*num_pols = 0;
+	// The run without prefetching always comes first, as the baseline
+	pfs[0] = find_prefetcher("none");
+	*num_pfs = 1;
+	for(i = 1; i < argc; i++) {
+		char* arg = argv[i];
+		if(strcmp(arg, "-tagged") == 0) {
+			cfg->tagged = 1;
+			continue;
+		}
+		if(strcmp(arg, "-mrc") == 0) {
+			cfg->mrc = 1;
+			continue;
+		}
+		if(arg[0] == '-' && arg[1] != '\0') {
+			if(i + 1 >= argc) {
+				fprintf(stderr, "[ERROR] Missing value for %s.\n", arg);
 				exit(1);
 			}
-			lru_count[frame_number] = clock;
-			free_frames[frame_number] = 0;
-		// Case for when there is not a valid entry for the page number
-		} else {
-			// Find an available frame
-			int x = find_empty_frame();
-			page_faults++;
-			// Case for when there is a frame available
-			if(x > 0) {
-				// Set PTE entry values
-				page_table[page_num].frame_number = x;
-				page_table[page_num].valid = 1;
-				frame_number = x;
-				// Calculate physical address
-				PA = frame_number * BYTES_PER_PAGE + page_offset;
-				// Write to outfile
-				if(fwrite(&PA, sizeof(PA), 1, outfile) != 1) {
-					fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+			char* value = argv[++i];
+			if(strcmp(arg, "-page-size") == 0) cfg->page_size = parse_size(value);
+			else if(strcmp(arg, "-va-bits") == 0) cfg->va_bits = atoi(value);
+			else if(strcmp(arg, "-phys-mem") == 0) cfg->phys_mem = parse_size(value);
+			else if(strcmp(arg, "-levels") == 0) cfg->levels = atoi(value);
+			else if(strcmp(arg, "-reserved") == 0) cfg->reserved = atoi(value);
+			else if(strcmp(arg, "-ws-window") == 0) cfg->ws_window = parse_size(value);
+			else if(strcmp(arg, "-mem-time") == 0) cfg->mem_time = strtoul(value, NULL, 10);
+			else if(strcmp(arg, "-page-in-time") == 0) cfg->page_in_time = (unsigned long) (atof(value) * 1000);
+			else if(strcmp(arg, "-write-back-time") == 0) cfg->write_back_time = (unsigned long) (atof(value) * 1000);
+			else if(strcmp(arg, "-transfer-time") == 0) cfg->transfer_time = (unsigned long) (atof(value) * 1000);
+			else if(strcmp(arg, "-write-back-batch") == 0) cfg->write_back_batch = atoi(value);
+			else if(strcmp(arg, "-prefetch-depth") == 0) cfg->prefetch_depth = atoi(value);
+			else if(strcmp(arg, "-huge-size") == 0) cfg->huge_size = parse_size(value);
+			else if(strcmp(arg, "-promote") == 0) cfg->promote = parse_size(value);
+			else if(strcmp(arg, "-prefetch") == 0) {
+				char* save;
+				char* name = strtok_r(value, ",", &save);
+				while(name != NULL) {
+					const prefetcher* p;
+					for(p = prefetchers + 1; p->name != NULL && *num_pfs < MAX_PREFETCHERS; p++) {
+						if(strcmp(name, "all") == 0 || strcmp(name, p->name) == 0) pfs[(*num_pfs)++] = p;
+					}
+					if(strcmp(name, "all") != 0 && find_prefetcher(name) == NULL) {
+						fprintf(stderr, "[ERROR] Unknown prefetcher %s.\n", name);
+						exit(1);
+					}
+					name = strtok_r(NULL, ",", &save);
+				}
+			}
+			else if(strcmp(arg, "-sample") == 0) {
+				cfg->sample_rate = atof(value);
+				if(cfg->sample_rate <= 0.0 || cfg->sample_rate > 1.0) {
+					fprintf(stderr, "[ERROR] -sample expects a rate in (0, 1].\n");
 					exit(1);
 				}
-				// Update reverse map
-				reverse_map[x] = page_num;
-				// Update LRU count array
-				lru_count[frame_number] = clock;
-				// Update free frames to show not available
-				free_frames[frame_number] = 0;
-			// Case for when there is not a frame available
-			} else {
-				// Get the LRU frame
-				int y = find_lru();
-				// Release the old one using reverse map
-				page_table[reverse_map[y]].valid = 0;
-				// Set PTE entry values
-				page_table[page_num].frame_number = y;
-				page_table[page_num].valid = 1;
-				frame_number = page_table[page_num].frame_number;
-				// Calculate physical address
-				PA = frame_number * BYTES_PER_PAGE + page_offset;
-				// Write to outfile
-				if(fwrite(&PA, sizeof(PA), 1, outfile) != 1) {
-					fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+			}
+			else if(strcmp(arg, "-tlb") == 0) {
+				if(sscanf(value, "%d:%d", &cfg->tlb_sets, &cfg->tlb_ways) != 2) {
+					fprintf(stderr, "[ERROR] -tlb expects sets:ways.\n");
 					exit(1);
 				}
-				// Update LRU count array
-				lru_count[frame_number] = clock;
-				// Update reverse map
-				reverse_map[frame_number] = page_num;
-				// Update free frames to show not available
-				free_frames[frame_number] = 0;
+			} else if(strcmp(arg, "-huge-tlb") == 0) {
+				if(sscanf(value, "%d:%d", &cfg->huge_tlb_sets, &cfg->huge_tlb_ways) != 2) {
+					fprintf(stderr, "[ERROR] -huge-tlb expects sets:ways.\n");
+					exit(1);
+				}
+			} else if(strcmp(arg, "-split") == 0) {
+				if(strcmp(value, "underused") == 0) cfg->split = 1;
+				else if(strcmp(value, "never") == 0) cfg->split = 0;
+				else {
+					fprintf(stderr, "[ERROR] -split expects underused or never.\n");
+					exit(1);
+				}
+			} else if(strcmp(arg, "-replacement") == 0) {
+				if(strcmp(value, "local") == 0) cfg->local = 1;
+				else if(strcmp(value, "global") == 0) cfg->local = 0;
+				else {
+					fprintf(stderr, "[ERROR] -replacement expects global or local.\n");
+					exit(1);
+				}
+			} else if(strcmp(arg, "-policy") == 0) {
+				char* save;
+				char* name = strtok_r(value, ",", &save);
+				while(name != NULL) {
+					if(strcmp(name, "all") == 0) {
+						const policy* p;
+						for(p = policies; p->name != NULL && *num_pols < MAX_POLICIES; p++) pols[(*num_pols)++] = p;
+					} else if(*num_pols < MAX_POLICIES) {
+						const policy* p = find_policy(name);
+						if(p == NULL) {
+							fprintf(stderr, "[ERROR] Unknown replacement policy %s.\n", name);
+							exit(1);
+						}
+						pols[(*num_pols)++] = p;
+					}
+					name = strtok_r(NULL, ",", &save);
+				}
+			} else {
+				fprintf(stderr, "[ERROR] Unknown option %s.\n", arg);
+				exit(1);
 			}
+			continue;
 		}
-		// Increment clock
-		clock++;
+		if(positional == 0) *infile_name = arg;
+		else if(positional == 1) *outfile_name = arg;
+		positional++;
+	}
+	if(positional != 2) {
+		fprintf(stderr, "[ERROR] Usage: ./virtual_memory [options] infile outfile\n");
+		exit(1);
+	}
+	if(*num_pols == 0) pols[(*num_pols)++] = find_policy("LRU");
+	if(cfg->mrc && cfg->huge_size > 0) {
+		fprintf(stderr, "[ERROR] -mrc counts in base pages and does not take -huge-size.\n");
+		exit(1);
 	}
-	// Clean up :)
-	fclose(infile);
-	fclose(outfile);
-	// Print out for debugging
-	printf("Part 2 page faults: %d\n", page_faults);
-	return 0;
 }
 
-// Finds the LRU frame
-int find_lru() {
+// Parse a size with trace_parse_size, a malformed one is an error
+unsigned long parse_size(const char* s) {
+	unsigned long size;
+	if(trace_parse_size(s, &size) != 0) {
+		fprintf(stderr, "[ERROR] Invalid size %s.\n", s);
+		exit(1);
+	}
+	return size;
+}
+
+/* SIMULATOR FUNCTIONS */
+
+// Validate the configuration and set up the address layout, frames, TLB and policy
+void sim_init(vm_sim* sim, vm_config* cfg, const policy* pol, const prefetcher* pf) {
 	int i;
-	int min = -1;
-	int min_i = -1;
-	for(i = 1; i < 8; i++) {
-		if(min == -1 || lru_count[i] < min) {
-			min = lru_count[i];
-			min_i = i;
+	memset(sim, 0, sizeof(vm_sim));
+	sim->cfg = *cfg;
+	sim->pol = pol;
+	sim->pf = pf;
+	if(cfg->page_size == 0 || (cfg->page_size & (cfg->page_size - 1)) != 0) {
+		fprintf(stderr, "[ERROR] Page size must be a power of two.\n");
+		exit(1);
+	}
+	while((1UL << sim->page_shift) < cfg->page_size) sim->page_shift++;
+	if(cfg->va_bits <= sim->page_shift || cfg->va_bits > 64) {
+		fprintf(stderr, "[ERROR] Virtual address width must be between the page offset width and 64 bits.\n");
+		exit(1);
+	}
+	if(cfg->levels < 1 || cfg->levels > MAX_LEVELS) {
+		fprintf(stderr, "[ERROR] Page table levels must be between 1 and %d.\n", MAX_LEVELS);
+		exit(1);
+	}
+	if(cfg->local && strcmp(pol->name, "ARC") == 0) {
+		fprintf(stderr, "[ERROR] ARC sizes its lists by the whole memory and only supports global replacement.\n");
+		exit(1);
+	}
+	sim->offset_mask = cfg->page_size - 1;
+	sim->va_limit = cfg->va_bits == 64 ? 0 : 1UL << cfg->va_bits;
+	int vpn_bits = cfg->va_bits - sim->page_shift;
+	int top_levels = cfg->levels;
+	int shift = 0;
+	if(cfg->huge_size > 0) {
+		if((cfg->huge_size & (cfg->huge_size - 1)) != 0 || cfg->huge_size <= cfg->page_size) {
+			fprintf(stderr, "[ERROR] Huge page size must be a power of two above the page size.\n");
+			exit(1);
+		}
+		while((cfg->page_size << sim->huge_order) < cfg->huge_size) sim->huge_order++;
+		sim->huge_pages = 1UL << sim->huge_order;
+		if(cfg->levels < 2 || vpn_bits <= sim->huge_order) {
+			fprintf(stderr, "[ERROR] Huge pages need at least 2 page table levels and virtual addresses wider than a huge page.\n");
+			exit(1);
+		}
+		if(cfg->promote < 1 || cfg->promote > sim->huge_pages) {
+			fprintf(stderr, "[ERROR] -promote must be between 1 and the %lu pages of a huge page.\n", sim->huge_pages);
+			exit(1);
 		}
+		if(pol->remove == NULL) {
+			fprintf(stderr, "[ERROR] %s cannot take pages out of memory outside replacement, as huge pages need.\n", pol->name);
+			exit(1);
+		}
+		// The last level covers exactly one huge page, which is a leaf of the level above
+		top_levels--;
+		vpn_bits -= sim->huge_order;
+		sim->level_bits[top_levels] = sim->huge_order;
+		sim->level_shift[top_levels] = 0;
+		shift = sim->huge_order;
+	} else if(cfg->huge_tlb_sets > 0 || cfg->huge_tlb_ways > 0) {
+		fprintf(stderr, "[ERROR] -huge-tlb needs -huge-size.\n");
+		exit(1);
+	}
+	// Split the page number bits over the levels, the top levels take any remainder
+	for(i = top_levels - 1; i >= 0; i--) {
+		sim->level_bits[i] = vpn_bits / top_levels + (i < vpn_bits % top_levels ? 1 : 0);
+		sim->level_shift[i] = shift;
+		shift += sim->level_bits[i];
+	}
+	for(i = 0; i < cfg->levels; i++) {
+		if(sim->level_bits[i] > 30) {
+			fprintf(stderr, "[ERROR] Page table level of 2^%d entries is too large, use more levels.\n", sim->level_bits[i]);
+			exit(1);
+		}
+	}
+	// Physical frames, handed out from the bottom up
+	unsigned long num_frames = cfg->phys_mem / cfg->page_size;
+	if(cfg->reserved < 0) {
+		fprintf(stderr, "[ERROR] Reserved frames cannot be negative.\n");
+		exit(1);
 	}
-	return min_i;
+	if(num_frames > 0x7fffffffUL || (long) num_frames <= cfg->reserved) {
+		fprintf(stderr, "[ERROR] Physical memory must hold more than the reserved frames.\n");
+		exit(1);
+	}
+	sim->num_frames = (int) num_frames;
+	sim->frames = (frame*) calloc(num_frames, sizeof(frame));
+	sim->free_frames = (int*) malloc(num_frames * sizeof(int));
+	sim->links = (list_link*) malloc(num_frames * sizeof(list_link));
+	if(sim->frames == NULL || sim->free_frames == NULL || sim->links == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate frame table.\n");
+		exit(1);
+	}
+	if(sim->huge_order > 0) {
+		// Free frames are tracked per block, so base pages can fill partly used blocks first
+		unsigned long num_blocks = (num_frames + sim->huge_pages - 1) >> sim->huge_order;
+		sim->free_bits = (unsigned long*) calloc((num_frames + 63) / 64, sizeof(unsigned long));
+		sim->touched = (unsigned long*) calloc((num_frames + 63) / 64, sizeof(unsigned long));
+		sim->block_free = (int*) calloc(num_blocks, sizeof(int));
+		sim->block_links = (list_link*) malloc(num_blocks * sizeof(list_link));
+		if(sim->free_bits == NULL || sim->touched == NULL || sim->block_free == NULL || sim->block_links == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate frame blocks.\n");
+			exit(1);
+		}
+		list_clear(&sim->free_blocks[0]);
+		list_clear(&sim->free_blocks[1]);
+		for(i = cfg->reserved; i < sim->num_frames; i++) frame_free(sim, i);
+	} else for(i = sim->num_frames - 1; i >= cfg->reserved; i--) sim->free_frames[sim->free_count++] = i;
+	// TLBs
+	if(cfg->tlb_sets > 0 || cfg->tlb_ways > 0) {
+		if(cfg->tlb_sets < 1 || cfg->tlb_ways < 1 || (cfg->tlb_sets & (cfg->tlb_sets - 1)) != 0) {
+			fprintf(stderr, "[ERROR] TLB sets must be a power of two and ways at least 1.\n");
+			exit(1);
+		}
+		sim->tlb = (tlb_entry*) calloc((size_t) cfg->tlb_sets * cfg->tlb_ways, sizeof(tlb_entry));
+		if(sim->tlb == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate TLB.\n");
+			exit(1);
+		}
+	}
+	if(cfg->huge_tlb_sets > 0 || cfg->huge_tlb_ways > 0) {
+		if(cfg->huge_tlb_sets < 1 || cfg->huge_tlb_ways < 1 || (cfg->huge_tlb_sets & (cfg->huge_tlb_sets - 1)) != 0) {
+			fprintf(stderr, "[ERROR] Huge TLB sets must be a power of two and ways at least 1.\n");
+			exit(1);
+		}
+		sim->huge_tlb = (tlb_entry*) calloc((size_t) cfg->huge_tlb_sets * cfg->huge_tlb_ways, sizeof(tlb_entry));
+		if(sim->huge_tlb == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate huge TLB.\n");
+			exit(1);
+		}
+	}
+	if(cfg->prefetch_depth < 1 || cfg->prefetch_depth > 64) {
+		fprintf(stderr, "[ERROR] Prefetch depth must be between 1 and 64.\n");
+		exit(1);
+	}
+	sim->pf->init(sim, &sim->prefetch);
+	if(cfg->write_back_batch < 1) {
+		fprintf(stderr, "[ERROR] Write-back batch must be at least 1.\n");
+		exit(1);
+	}
+	sim->write_back = (swap_page*) malloc(cfg->write_back_batch * sizeof(swap_page));
+	if(sim->write_back == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate write-back queue.\n");
+		exit(1);
+	}
+	// Working sets are only reported per process of a tagged trace
+	if(!cfg->tagged) sim->cfg.ws_window = 0;
+	// Under local replacement the global domain stays empty and every process gets its
+	// own domain when it first shows up
+	sim->pol->init(sim, &sim->global);
+	list_clear(&sim->global.prefetched);
+}
+
+// Release the page tables, frames, TLB and policy state
+void sim_free(vm_sim* sim) {
+	unsigned int pid;
+	int f;
+	sim->pol->release(sim, &sim->global);
+	sim->pf->release(sim, &sim->prefetch);
+	for(pid = 0; pid < sim->num_procs; pid++) {
+		process* proc = &sim->procs[pid];
+		if(!proc->exists) continue;
+		if(sim->cfg.local) sim->pol->release(sim, &proc->domain);
+		if(proc->root != NULL) pt_free(sim, proc->root, 0);
+		free(proc->ws_ring);
+	}
+	for(f = 0; f < sim->num_frames; f++) {
+		while(sim->frames[f].shared != NULL) {
+			mapping* next = sim->frames[f].shared->next;
+			free(sim->frames[f].shared);
+			sim->frames[f].shared = next;
+		}
+	}
+	free(sim->procs);
+	free(sim->frames);
+	free(sim->free_frames);
+	free(sim->links);
+	free(sim->next_use);
+	free(sim->tlb);
+	free(sim->huge_tlb);
+	free(sim->free_bits);
+	free(sim->touched);
+	free(sim->block_free);
+	free(sim->block_links);
+	free(sim->write_back);
 }
 
-// Finds an empty frame or return -1
-int find_empty_frame() {
+// Translate one logical address of a process, handling TLB misses, page faults and
+// copy-on-write faults. Every page table lookup sets the referenced bit and writes set
+// the dirty bit; the TLB only lets a write through once the page is dirty and private.
+// Returns 0 and sets PA on success, -1 when the address is outside the virtual address
+// space.
+int sim_access(vm_sim* sim, unsigned int pid, unsigned long LA, unsigned int flags, unsigned long* PA) {
+	sim->pos++;
+	sim->accesses++;
+	if(sim->va_limit != 0 && LA >= sim->va_limit) {
+		sim->invalid++;
+		*PA = (unsigned long) -1;
+		return -1;
+	}
+	process* proc = get_process(sim, pid);
+	proc->accesses++;
+	// Get page number and offset from the virtual address
+	unsigned long vpn = LA >> sim->page_shift;
+	unsigned long page_offset = LA & sim->offset_mask;
+	int write = (flags & TRACE_WRITE) != 0;
+	int writable = 0;
+	int huge = 0;
+	int frame_number = tlb_lookup(sim, pid, vpn, &writable, &huge);
+	int loaded = 0;
+	int copied = 0;
+	int prefetch_hit = 0;
+	PTE* pte = NULL;
+	sim->now += sim->cfg.mem_time;
+	// A write through a TLB entry of a clean or copy-on-write page still takes the slow path
+	if(frame_number < 0 || (write && !writable)) {
+		pte = pt_walk(sim, proc, vpn);
+		huge = pte->valid && sim->frames[pte->frame_number].huge;
+		sim->now += (sim->cfg.levels - huge) * sim->cfg.mem_time;
+		// First reference to a prefetched page: the policy takes it over like a loaded page,
+		// after waiting for the read if it is still going
+		if(pte->valid && sim->frames[pte->frame_number].prefetched) {
+			frame* fr = &sim->frames[pte->frame_number];
+			policy_domain* d = sim->cfg.local ? &sim->procs[fr->owner].domain : &sim->global;
+			list_unlink(sim->links, &d->prefetched, pte->frame_number);
+			fr->prefetched = 0;
+			fr->lru_count = sim->clock;
+			sim->pol->insert(sim, d, pte->frame_number);
+			sim->prefetch_hits++;
+			if(fr->ready > sim->now) {
+				sim->stall_time += fr->ready - sim->now;
+				sim->now = fr->ready;
+			}
+			prefetch_hit = 1;
+		}
+		// Write to a copy-on-write page: copy it unless no one else maps it any more
+		if(pte->valid && pte->cow && write) {
+			tlb_invalidate(sim, pid, vpn);
+			if(sim->frames[pte->frame_number].refs > 1) {
+				sim->cow_faults++;
+				proc->cow_faults++;
+				frame_drop_mapping(sim, pte->frame_number, pte);
+				pte->valid = 0;
+				copied = 1;
+			}
+			pte->cow = 0;
+		}
+		// Case for when there is not a valid entry for the page number
+		if(!pte->valid) {
+			if(!copied) {
+				sim->page_faults++;
+				proc->page_faults++;
+			}
+			// The fault may map the whole region as a huge page instead
+			huge = sim->huge_order > 0 && !copied && huge_promote(sim, proc, pid, &pte, vpn);
+			if(!huge) {
+				frame_number = get_frame(sim, proc, pte, 0);
+				if(!copied) swap_page_in(sim, 1);
+				pte->frame_number = frame_number;
+				pte->valid = 1;
+				pte->cow = 0;
+				sim->frames[frame_number].owner = pid;
+				frame_add_mapping(sim, frame_number, pid, pte, vpn);
+			}
+			loaded = 1;
+		}
+		if(write) pte->dirty = 1;
+		pte->referenced = 1;
+		frame_number = pte->frame_number;
+		tlb_insert(sim, pid, vpn, frame_number, pte->dirty && !pte->cow, huge);
+	}
+	// A huge page is mapped by its first page and frame
+	unsigned long first = huge ? vpn & ~(sim->huge_pages - 1) : vpn;
+	if(sim->cfg.ws_window > 0) {
+		if(pte == NULL) pte = frame_find_pte(sim, frame_number, pid, first);
+		// Working sets count base pages, so a page of a huge page counts by its own PTE
+		ws_reference(sim, proc, huge ? &((pt_leaf*) pte)->ptes[vpn - first] : pte);
+	}
+	// Let the policy of the domain holding the frame see the reference and calculate the physical address
+	frame* fr = &sim->frames[frame_number];
+	policy_domain* d = sim->cfg.local ? &sim->procs[fr->owner].domain : &sim->global;
+	fr->lru_count = sim->clock;
+	if(loaded) {
+		d->resident += huge ? sim->huge_pages : 1;
+		sim->pol->insert(sim, d, frame_number);
+	} else if(!prefetch_hit) sim->pol->access(sim, d, frame_number);
+	sim->clock++;
+	if(sim->huge_order > 0) {
+		if(huge) {
+			// The first reference to a page of a huge page takes it out of the bloat
+			frame_number += vpn - first;
+			unsigned long bit = 1UL << (frame_number % 64);
+			if(!(sim->touched[frame_number / 64] & bit)) {
+				sim->touched[frame_number / 64] |= bit;
+				sim->bloat--;
+			}
+		}
+		if(sim->bloat > sim->bloat_peak) sim->bloat_peak = sim->bloat;
+		sim->bloat_sum += sim->bloat;
+	}
+	*PA = ((unsigned long) frame_number << sim->page_shift) | page_offset;
+	if(sim->pf->predict != NULL && ((loaded && !copied) || prefetch_hit)) prefetch_run(sim, proc, pid, vpn);
+	return 0;
+}
+
+// Fork a child from a parent: the child maps every resident page of the parent and
+// both sides lose write access until they take a private copy. Pages the parent has no
+// frame for are not inherited, and huge pages of the parent are split first, as a
+// copy-on-write fault on one would.
+void sim_fork(vm_sim* sim, unsigned int parent, unsigned int child) {
+	int f;
+	sim->pos++;
+	sim->forks++;
+	get_process(sim, parent);
+	if(child == parent) return;
+	process* child_proc = get_process(sim, child);
+	// Huge pages of the parent are split first, as a copy-on-write fault on one would split it
+	for(f = sim->cfg.reserved; sim->huge_order > 0 && f < sim->num_frames; f++) {
+		frame* fr = &sim->frames[f];
+		if(!fr->huge || fr->map.pid != parent) continue;
+		policy_domain* d = sim->cfg.local ? &sim->procs[fr->owner].domain : &sim->global;
+		sim->pol->remove(sim, d, f);
+		d->resident -= sim->huge_pages;
+		huge_split(sim, d, f);
+	}
+	// The frame table finds the resident pages of the parent without walking its page table
+	for(f = sim->cfg.reserved; f < sim->num_frames; f++) {
+		frame* fr = &sim->frames[f];
+		mapping* m;
+		if(fr->refs == 0) continue;
+		for(m = &fr->map; m != NULL; m = m == &fr->map ? fr->shared : m->next) {
+			if(m->pid != parent) continue;
+			PTE* pte = pt_walk(sim, child_proc, m->vpn);
+			if(!pte->valid) {
+				m->pte->cow = 1;
+				pte->valid = 1;
+				pte->cow = 1;
+				pte->frame_number = f;
+				frame_add_mapping(sim, f, child, pte, m->vpn);
+			}
+			break;
+		}
+	}
+	// The parent's cached translations still allow writes
+	tlb_flush_pid(sim, parent);
+}
+
+// Print out the statistics of the run
+void sim_report(vm_sim* sim) {
+	vm_config* cfg = &sim->cfg;
 	int i;
-	for(i = 1; i < 8; i++) if(free_frames[i] == 1) return i;
+	unsigned int pid;
+	unsigned long translated = sim->accesses - sim->invalid;
+	printf("Page size %lu bytes, %d-bit virtual addresses, %d frames (%d reserved), %d-level page table (",
+		   cfg->page_size, cfg->va_bits, sim->num_frames, cfg->reserved, cfg->levels);
+	for(i = 0; i < cfg->levels; i++) printf(i == 0 ? "%d" : "+%d", sim->level_bits[i]);
+	printf(" bits), %s replacement\n", sim->pol->name);
+	printf("Accesses: %lu", sim->accesses);
+	if(sim->invalid > 0) printf(" (%lu outside the address space)", sim->invalid);
+	printf("\n");
+	printf("Page faults: %lu (%.4f%%), evictions: %lu\n", sim->page_faults,
+		   translated ? 100.0 * sim->page_faults / translated : 0.0, sim->evictions);
+	if(sim->huge_order > 0) {
+		unsigned long used = sim->num_frames - cfg->reserved - sim->free_count;
+		printf("Huge pages of %lu bytes (%lu pages), promoted at %lu resident pages, %s split: %lu promoted "
+			   "(%lu resident pages collapsed), %lu fallbacks to base pages, %lu split, %lu evicted whole\n",
+			   cfg->huge_size, sim->huge_pages, cfg->promote, cfg->split ? "underused" : "never", sim->promotions,
+			   sim->collapsed, sim->huge_fallbacks, sim->splits, sim->huge_evictions);
+		printf("Memory bloat: %lu untouched pages in huge pages (%.2f%% of used memory), %.1f on average, %lu at peak\n",
+			   sim->bloat, used ? 100.0 * sim->bloat / used : 0.0, translated ? (double) sim->bloat_sum / translated : 0.0,
+			   sim->bloat_peak);
+	}
+	if(sim->huge_order > 0 && (sim->tlb != NULL || sim->huge_tlb != NULL)) {
+		// Reach is the memory the TLB entries cover
+		printf("TLB");
+		unsigned long entries = (unsigned long) cfg->tlb_sets * cfg->tlb_ways;
+		if(sim->tlb != NULL && sim->huge_tlb != NULL) printf(" %dx%d (reach %lu KB)", cfg->tlb_sets, cfg->tlb_ways, entries * cfg->page_size / 1024);
+		else if(sim->tlb != NULL) {
+			printf(" %dx%d shared by both page sizes (reach %lu KB to %lu KB)", cfg->tlb_sets, cfg->tlb_ways,
+				   entries * cfg->page_size / 1024, entries * cfg->huge_size / 1024);
+		}
+		if(sim->huge_tlb != NULL) {
+			printf("%s huge %dx%d (reach %lu KB)", sim->tlb != NULL ? " +" : "", cfg->huge_tlb_sets, cfg->huge_tlb_ways,
+				   (unsigned long) cfg->huge_tlb_sets * cfg->huge_tlb_ways * cfg->huge_size / 1024);
+		}
+		printf(": %lu base page hits, %lu huge page hits, %lu misses, miss rate %.4f%%\n", sim->tlb_hits,
+			   sim->huge_tlb_hits, sim->tlb_misses, translated ? 100.0 * sim->tlb_misses / translated : 0.0);
+	} else if(sim->tlb != NULL) {
+		printf("TLB %dx%d: %lu hits, %lu misses, hit rate %.4f%%\n", cfg->tlb_sets, cfg->tlb_ways,
+			   sim->tlb_hits, sim->tlb_misses, translated ? 100.0 * sim->tlb_hits / translated : 0.0);
+	}
+	printf("Page walks: %lu (%lu table references)\n", sim->page_walks, sim->walk_refs);
+	printf("Page table pages: %lu (%lu bytes)\n", sim->table_pages, sim->table_bytes);
+	printf("Backing store: %lu page-ins, %lu pages written back in %lu I/Os, device busy %.3f ms\n",
+		   sim->page_ins, sim->write_back_pages, sim->write_back_ios, sim->device_busy / 1e6);
+	printf("Simulated time: %.3f ms (%.3f ms stalled on faults), effective access time %.1f ns\n",
+		   sim->now / 1e6, sim->stall_time / 1e6, translated ? (double) sim->now / translated : 0.0);
+	if(!cfg->tagged) return;
+	// Per process breakdown: everyone when there are few processes, the ten with the most faults otherwise
+	printf("Processes: %u (%s replacement), forks: %lu, copy-on-write faults: %lu\n", sim->live_procs,
+		   cfg->local ? "local" : "global", sim->forks, sim->cow_faults);
+	unsigned int* order = (unsigned int*) malloc(sim->live_procs * sizeof(unsigned int));
+	unsigned long* resident = (unsigned long*) calloc(sim->num_procs, sizeof(unsigned long));
+	if(order == NULL || resident == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate report.\n");
+		exit(1);
+	}
+	unsigned int k = 0, shown, m;
+	unsigned long ws_sum = 0, accesses = 0;
+	for(pid = 0; pid < sim->num_procs; pid++) {
+		if(!sim->procs[pid].exists) continue;
+		order[k++] = pid;
+		ws_sum += sim->procs[pid].ws_sum;
+		accesses += sim->procs[pid].accesses;
+	}
+	for(i = cfg->reserved; i < sim->num_frames; i++) {
+		mapping* map;
+		if(sim->frames[i].refs == 0) continue;
+		for(map = &sim->frames[i].map; map != NULL; map = map == &sim->frames[i].map ? sim->frames[i].shared : map->next) {
+			resident[map->pid] += sim->frames[i].huge ? sim->huge_pages : 1;
+		}
+	}
+	shown = k;
+	if(k > 32) {
+		shown = 10;
+		printf("Average working set: %.1f pages over a %lu reference window\n",
+			   accesses ? (double) ws_sum / accesses : 0.0, cfg->ws_window);
+		for(i = 0; i < (int) shown; i++) {
+			unsigned int best = i;
+			for(m = i + 1; m < k; m++) if(sim->procs[order[m]].page_faults > sim->procs[order[best]].page_faults) best = m;
+			unsigned int tmp = order[i];
+			order[i] = order[best];
+			order[best] = tmp;
+		}
+		printf("Top %u processes by page faults:\n", shown);
+	} else if(cfg->ws_window > 0) printf("Working set window: %lu references\n", cfg->ws_window);
+	printf("    PID     Accesses  Page faults   COW faults   Resident    Avg WSS    Max WSS\n");
+	for(m = 0; m < shown; m++) {
+		process* proc = &sim->procs[order[m]];
+		printf("%7u %12lu %12lu %12lu %10lu %10.1f %10lu\n", order[m], proc->accesses, proc->page_faults,
+			   proc->cow_faults, resident[order[m]], proc->accesses ? (double) proc->ws_sum / proc->accesses : 0.0,
+			   proc->ws_max);
+	}
+	free(order);
+	free(resident);
+}
+
+// Look up a process, creating it (and growing the process table) on first use
+static inline process* get_process(vm_sim* sim, unsigned int pid) {
+	if(pid < sim->num_procs && sim->procs[pid].exists) return &sim->procs[pid];
+	return new_process(sim, pid);
+}
+
+process* new_process(vm_sim* sim, unsigned int pid) {
+	if(pid >= MAX_PID) {
+		fprintf(stderr, "[ERROR] pid %u is above the supported maximum of %d.\n", pid, MAX_PID - 1);
+		exit(1);
+	}
+	if(pid >= sim->num_procs) {
+		unsigned int n = sim->num_procs == 0 ? 16 : sim->num_procs;
+		while(n <= pid) n *= 2;
+		sim->procs = (process*) realloc(sim->procs, n * sizeof(process));
+		if(sim->procs == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate process table.\n");
+			exit(1);
+		}
+		memset(&sim->procs[sim->num_procs], 0, (n - sim->num_procs) * sizeof(process));
+		sim->num_procs = n;
+	}
+	process* proc = &sim->procs[pid];
+	if(!proc->exists) {
+		proc->exists = 1;
+		sim->live_procs++;
+		if(sim->cfg.ws_window > 0) {
+			proc->ws_ring = (PTE**) calloc(sim->cfg.ws_window, sizeof(PTE*));
+			if(proc->ws_ring == NULL) {
+				fprintf(stderr, "[ERROR] Unable to allocate working set window.\n");
+				exit(1);
+			}
+		}
+		if(sim->cfg.local) sim->pol->init(sim, &proc->domain);
+		list_clear(&proc->domain.prefetched);
+	}
+	return proc;
+}
+
+// Slide the working set window of a process over one more reference. The ring holds the
+// pages of the last ws_window references; the page dropping out of the window leaves the
+// working set unless it was referenced again since, which its last_ref time tells.
+void ws_reference(vm_sim* sim, process* proc, PTE* pte) {
+	unsigned long window = sim->cfg.ws_window;
+	unsigned long t = proc->accesses;
+	PTE** slot = &proc->ws_ring[t % window];
+	if(*slot != NULL && (*slot)->last_ref == t - window) proc->ws_size--;
+	if(pte->last_ref == 0 || pte->last_ref + window <= t) proc->ws_size++;
+	pte->last_ref = t;
+	*slot = pte;
+	proc->ws_sum += proc->ws_size;
+	if(proc->ws_size > proc->ws_max) proc->ws_max = proc->ws_size;
+}
+
+/* PAGE TABLE FUNCTIONS */
+
+// Walk a process's radix page table for a page number, allocating missing table pages on the way.
+// Returns the PTE of the page, or of the huge page holding it, which ends the walk a level early.
+PTE* pt_walk(vm_sim* sim, process* proc, unsigned long vpn) {
+	int level;
+	int last = sim->cfg.levels - 1;
+	void** slot = &proc->root;
+	sim->page_walks++;
+	for(level = 0; level <= last; level++) {
+		size_t entries = (size_t) 1 << sim->level_bits[level];
+		if(*slot == NULL) {
+			size_t entry_size = level == last ? sizeof(PTE) : sizeof(void*);
+			*slot = calloc(1, (level == last ? sizeof(pt_leaf) : 0) + entries * entry_size);
+			if(*slot == NULL) {
+				fprintf(stderr, "[ERROR] Unable to allocate page table page.\n");
+				exit(1);
+			}
+			sim->table_pages++;
+			sim->table_bytes += entries * entry_size;
+		}
+		size_t index = (vpn >> sim->level_shift[level]) & (entries - 1);
+		if(level == last) {
+			pt_leaf* leaf = (pt_leaf*) *slot;
+			if(leaf->huge.valid) return &leaf->huge;
+			sim->walk_refs++;
+			return &leaf->ptes[index];
+		}
+		sim->walk_refs++;
+		slot = &((void**) *slot)[index];
+	}
+	return NULL;
+}
+
+// Recursively free a page table node
+void pt_free(vm_sim* sim, void* node, int level) {
+	if(level < sim->cfg.levels - 1) {
+		size_t i, entries = (size_t) 1 << sim->level_bits[level];
+		for(i = 0; i < entries; i++) {
+			void* child = ((void**) node)[i];
+			if(child != NULL) pt_free(sim, child, level + 1);
+		}
+	}
+	free(node);
+}
+
+/* TLB FUNCTIONS */
+
+// The set of the TLB holding translations of one page size for a page (huge pages are
+// keyed by their first page >> huge_order), or NULL when there is no TLB for them
+static inline tlb_entry* tlb_set(vm_sim* sim, int huge, unsigned long vpn, unsigned long* key, int* ways) {
+	tlb_entry* tlb = huge && sim->huge_tlb != NULL ? sim->huge_tlb : sim->tlb;
+	int sets = tlb == sim->huge_tlb ? sim->cfg.huge_tlb_sets : sim->cfg.tlb_sets;
+	if(tlb == NULL) return NULL;
+	*key = huge ? vpn >> sim->huge_order : vpn;
+	*ways = tlb == sim->huge_tlb ? sim->cfg.huge_tlb_ways : sim->cfg.tlb_ways;
+	return &tlb[(*key & (sets - 1)) * *ways];
+}
+
+// Look up a page of a process in the TLB, returning its frame or -1 on a miss. With huge
+// pages both sizes are looked up, and a hit on a huge page returns its first frame.
+int tlb_lookup(vm_sim* sim, unsigned int pid, unsigned long vpn, int* writable, int* huge) {
+	if(sim->tlb == NULL && sim->huge_tlb == NULL) return -1;
+	int i, ways, size;
+	unsigned long key;
+	for(size = sim->huge_order > 0; size >= 0; size--) {
+		tlb_entry* set = tlb_set(sim, size, vpn, &key, &ways);
+		if(set == NULL) continue;
+		for(i = 0; i < ways; i++) {
+			if(set[i].valid && set[i].vpn == key && set[i].pid == pid && set[i].huge == size) {
+				set[i].lru_count = sim->clock;
+				if(size) sim->huge_tlb_hits++;
+				else sim->tlb_hits++;
+				*writable = set[i].writable;
+				*huge = size;
+				return set[i].frame_number;
+			}
+		}
+	}
+	sim->tlb_misses++;
 	return -1;
 }
+
+// Insert a translation, replacing an invalid or the LRU way of the set
+void tlb_insert(vm_sim* sim, unsigned int pid, unsigned long vpn, int frame_number, int writable, int huge) {
+	int i, ways;
+	unsigned long key;
+	tlb_entry* set = tlb_set(sim, huge, vpn, &key, &ways);
+	if(set == NULL) return;
+	tlb_entry* victim = &set[0];
+	for(i = 0; i < ways; i++) {
+		if(!set[i].valid) {
+			victim = &set[i];
+			break;
+		}
+		if(set[i].lru_count < victim->lru_count) victim = &set[i];
+	}
+	victim->valid = 1;
+	victim->huge = huge;
+	victim->writable = writable;
+	victim->pid = pid;
+	victim->vpn = key;
+	victim->frame_number = frame_number;
+	victim->lru_count = sim->clock;
+}
+
+// Drop the translation of an evicted page, and of the huge page holding it if there is one
+void tlb_invalidate(vm_sim* sim, unsigned int pid, unsigned long vpn) {
+	int i, ways, size;
+	unsigned long key;
+	for(size = sim->huge_order > 0; size >= 0; size--) {
+		tlb_entry* set = tlb_set(sim, size, vpn, &key, &ways);
+		if(set == NULL) continue;
+		for(i = 0; i < ways; i++) {
+			if(set[i].valid && set[i].vpn == key && set[i].pid == pid && set[i].huge == size) set[i].valid = 0;
+		}
+	}
+}
+
+// Drop every translation of a process
+void tlb_flush_pid(vm_sim* sim, unsigned int pid) {
+	int i;
+	for(i = 0; sim->tlb != NULL && i < sim->cfg.tlb_sets * sim->cfg.tlb_ways; i++) {
+		if(sim->tlb[i].pid == pid) sim->tlb[i].valid = 0;
+	}
+	for(i = 0; sim->huge_tlb != NULL && i < sim->cfg.huge_tlb_sets * sim->cfg.huge_tlb_ways; i++) {
+		if(sim->huge_tlb[i].pid == pid) sim->huge_tlb[i].valid = 0;
+	}
+}
+
+/* FRAME FUNCTIONS */
+
+// All processes share one pool of frames, and the frame table doubles as the inverted
+// page table. With local replacement a process at or above its fair share of frames
+// replaces one of its own pages, otherwise the process holding the most frames gives one
+// up. With huge pages, frames are grouped into aligned blocks of one huge page each.
+
+// Pops a free frame or return -1. With huge pages the frame comes from a partly used
+// block when there is one, so fully free blocks stay whole.
+int find_empty_frame(vm_sim* sim) {
+	if(sim->huge_order == 0) {
+		if(sim->free_count > 0) return sim->free_frames[--sim->free_count];
+		return -1;
+	}
+	int block = sim->free_blocks[0].head >= 0 ? sim->free_blocks[0].head : sim->free_blocks[1].head;
+	if(block < 0) return -1;
+	unsigned long f = (unsigned long) block << sim->huge_order;
+	for(;;) {
+		unsigned long word = sim->free_bits[f / 64] >> (f % 64);
+		if(word != 0) {
+			f += __builtin_ctzl(word);
+			break;
+		}
+		f += 64 - f % 64;
+	}
+	frame_take(sim, (int) f);
+	return (int) f;
+}
+
+// Mark a frame used in the free bitmap and move its block to the list it belongs in now
+void frame_take(vm_sim* sim, int f) {
+	int block = f >> sim->huge_order;
+	int free = sim->block_free[block];
+	sim->free_bits[f / 64] &= ~(1UL << (f % 64));
+	list_unlink(sim->block_links, &sim->free_blocks[free == (int) sim->huge_pages], block);
+	if(--sim->block_free[block] > 0) list_push_front(sim->block_links, &sim->free_blocks[0], block);
+	sim->free_count--;
+}
+
+// Return a frame to the free bitmap. The frame must not be mapped any more.
+void frame_free(vm_sim* sim, int f) {
+	int block = f >> sim->huge_order;
+	int free = sim->block_free[block];
+	sim->free_bits[f / 64] |= 1UL << (f % 64);
+	if(free > 0) list_unlink(sim->block_links, &sim->free_blocks[0], block);
+	list_push_front(sim->block_links, &sim->free_blocks[++sim->block_free[block] == (int) sim->huge_pages], block);
+	sim->free_count++;
+}
+
+// Take a fully free block for a huge page, returning its first frame or -1
+int block_alloc(vm_sim* sim) {
+	unsigned long i;
+	int block = sim->free_blocks[1].head;
+	if(block < 0) return -1;
+	int f = block << sim->huge_order;
+	list_unlink(sim->block_links, &sim->free_blocks[1], block);
+	sim->block_free[block] = 0;
+	for(i = 0; i < sim->huge_pages; i++) sim->free_bits[(f + i) / 64] &= ~(1UL << ((f + i) % 64));
+	sim->free_count -= sim->huge_pages;
+	return f;
+}
+
+// Choose the frame to replace for a page of a process and take it out of its domain's
+// bookkeeping: for a fault the oldest prefetched page nobody used, otherwise a victim of
+// the policy. from is set to the domain, whose resident count the caller adjusts.
+int pick_victim(vm_sim* sim, process* proc, PTE* incoming, int prefetch, policy_domain** from) {
+	int frame_number;
+	policy_domain* d = &sim->global;
+	if(sim->cfg.local) {
+		// Replace locally at or above the fair share, otherwise take from the largest process
+		int share = (sim->num_frames - sim->cfg.reserved) / (int) sim->live_procs;
+		unsigned int pid;
+		d = &proc->domain;
+		if(d->resident == 0 || d->resident < share) {
+			for(pid = 0; pid < sim->num_procs; pid++) {
+				process* other = &sim->procs[pid];
+				if(other->exists && other->domain.resident > d->resident) d = &other->domain;
+			}
+		}
+	}
+	if(d->prefetched.size > 0 && (!prefetch || d->prefetched.size == d->resident)) {
+		frame_number = d->prefetched.tail;
+		list_unlink(sim->links, &d->prefetched, frame_number);
+	} else frame_number = sim->pol->victim(sim, d, incoming);
+	*from = d;
+	return frame_number;
+}
+
+// Find a frame for a faulting or prefetched page: a free one, otherwise one given up by a
+// victim. A huge victim with untouched pages is split instead when splitting is on.
+int get_frame(vm_sim* sim, process* proc, PTE* incoming, int prefetch) {
+	policy_domain* d;
+	unsigned long i;
+	int frame_number = find_empty_frame(sim);
+	if(frame_number >= 0) return frame_number;
+	frame_number = pick_victim(sim, proc, incoming, prefetch, &d);
+	if(sim->frames[frame_number].huge) {
+		d->resident -= sim->huge_pages;
+		if(sim->cfg.split && huge_untouched(sim, frame_number) > 0) {
+			huge_split(sim, d, frame_number);
+			return find_empty_frame(sim);
+		}
+		evict_frame(sim, frame_number);
+		sim->evictions++;
+		sim->huge_evictions++;
+		for(i = 1; i < sim->huge_pages; i++) frame_free(sim, frame_number + i);
+		return frame_number;
+	}
+	d->resident--;
+	evict_frame(sim, frame_number);
+	sim->evictions++;
+	return frame_number;
+}
+
+// Find a free block for a huge page. When memory is full one victim is reclaimed, which
+// frees a block only when it is a huge page evicted whole or the last used frame of its
+// block. Returns the first frame of the block, or -1 to fall back to a base page.
+int get_huge_frame(vm_sim* sim, process* proc, PTE* incoming) {
+	policy_domain* d;
+	int frame_number = block_alloc(sim);
+	if(frame_number >= 0 || sim->free_count > 0) return frame_number;
+	frame_number = pick_victim(sim, proc, incoming, 0, &d);
+	if(sim->frames[frame_number].huge) {
+		d->resident -= sim->huge_pages;
+		// Splitting keeps the touched pages in the block, so the fault falls back on a freed frame
+		if(sim->cfg.split && huge_untouched(sim, frame_number) > 0) {
+			huge_split(sim, d, frame_number);
+			return -1;
+		}
+		// The block of the huge page is still taken, it passes straight to the new one
+		evict_frame(sim, frame_number);
+		sim->evictions++;
+		sim->huge_evictions++;
+		return frame_number;
+	}
+	d->resident--;
+	evict_frame(sim, frame_number);
+	sim->evictions++;
+	frame_free(sim, frame_number);
+	return block_alloc(sim);
+}
+
+/*
+ *	This function maps the huge page region of a faulting page as one huge page when
+ *	-promote of its pages are resident (1 is THP "always", a whole huge page collapses
+ *	only full regions). Without a free block it falls back to a base page, as there is
+ *	no compaction. The resident pages move into a free block and leave
+ *	their policy (shared ones only lose this mapping), and the rest of the region is read
+ *	in together with the faulting page.
+ *
+ *	Parameters:
+ *		vm_sim* sim -- the simulator
+ *		process* proc -- the faulting process
+ *		unsigned int pid -- its pid
+ *		PTE** pte -- the PTE of the faulting page, set to the huge page's PTE on success
+ *		unsigned long vpn -- the faulting page
+ *	Return:
+ *		1 if the region is now a huge page, 0 to map a base page instead
+ */
+int huge_promote(vm_sim* sim, process* proc, unsigned int pid, PTE** pte, unsigned long vpn) {
+	unsigned long i, resident = 1, moved = 0, touched = 0;
+	unsigned long first = vpn & ~(sim->huge_pages - 1);
+	pt_leaf* leaf = (pt_leaf*) ((char*) (*pte - (vpn - first)) - offsetof(pt_leaf, ptes));
+	// Counting stops at the threshold, faults come often and regions are large
+	for(i = 0; i < sim->huge_pages && resident < sim->cfg.promote; i++) resident += leaf->ptes[i].valid;
+	if(resident < sim->cfg.promote) return 0;
+	int head = get_huge_frame(sim, proc, *pte);
+	if(head < 0) {
+		sim->huge_fallbacks++;
+		return 0;
+	}
+	PTE* huge = &leaf->huge;
+	for(i = 0; i < sim->huge_pages; i++) sim->touched[(head + i) / 64] &= ~(1UL << ((head + i) % 64));
+	// Replacement may have taken some of the region's pages while finding the block
+	for(i = 0; i < sim->huge_pages; i++) {
+		PTE* p = &leaf->ptes[i];
+		if(!p->valid) continue;
+		int f = p->frame_number;
+		frame* fr = &sim->frames[f];
+		tlb_invalidate(sim, pid, first + i);
+		// Pages read ahead but never referenced stay untouched
+		if(!fr->prefetched) {
+			sim->touched[(head + i) / 64] |= 1UL << ((head + i) % 64);
+			touched++;
+		}
+		if(fr->refs > 1) frame_drop_mapping(sim, f, p);
+		else {
+			policy_domain* d = sim->cfg.local ? &sim->procs[fr->owner].domain : &sim->global;
+			if(fr->prefetched) {
+				list_unlink(sim->links, &d->prefetched, f);
+				fr->prefetched = 0;
+			} else sim->pol->remove(sim, d, f);
+			d->resident--;
+			fr->refs = 0;
+			frame_free(sim, f);
+		}
+		huge->dirty |= pte_evict(p);
+		moved++;
+	}
+	swap_page_in(sim, sim->huge_pages - moved);
+	huge->valid = 1;
+	huge->cow = 0;
+	huge->frame_number = head;
+	sim->frames[head].huge = 1;
+	sim->frames[head].owner = pid;
+	frame_add_mapping(sim, head, pid, huge, first);
+	sim->bloat += sim->huge_pages - touched;
+	sim->promotions++;
+	sim->collapsed += moved;
+	*pte = huge;
+	return 1;
+}
+
+/*
+ *	This function splits a huge page that left its policy: its untouched pages are freed
+ *	and the touched ones stay resident as base pages, which the policy takes over.
+ *
+ *	Parameters:
+ *		vm_sim* sim -- the simulator
+ *		policy_domain* d -- the domain that held the huge page
+ *		int f -- the first frame of the huge page
+ *	Return:
+ *		None
+ */
+void huge_split(vm_sim* sim, policy_domain* d, int f) {
+	unsigned long i;
+	frame* fr = &sim->frames[f];
+	PTE* huge = fr->map.pte;
+	pt_leaf* leaf = (pt_leaf*) ((char*) huge - offsetof(pt_leaf, huge));
+	unsigned int pid = fr->map.pid;
+	unsigned long first = fr->map.vpn;
+	unsigned long lru_count = fr->lru_count;
+	int referenced = huge->referenced;
+	int dirty = pte_evict(huge);
+	tlb_invalidate(sim, pid, first);
+	fr->refs = 0;
+	fr->huge = 0;
+	for(i = 0; i < sim->huge_pages; i++) {
+		int g = f + (int) i;
+		if(!(sim->touched[g / 64] & (1UL << (g % 64)))) {
+			frame_free(sim, g);
+			sim->bloat--;
+			continue;
+		}
+		PTE* p = &leaf->ptes[i];
+		p->valid = 1;
+		p->cow = 0;
+		p->dirty = dirty;
+		p->referenced = referenced;
+		p->frame_number = g;
+		sim->frames[g].owner = pid;
+		sim->frames[g].lru_count = lru_count;
+		frame_add_mapping(sim, g, pid, p, first + i);
+		sim->pol->insert(sim, d, g);
+		d->resident++;
+	}
+	sim->splits++;
+}
+
+// Count the pages of a huge page not touched since it was mapped
+unsigned long huge_untouched(vm_sim* sim, int f) {
+	unsigned long i, touched = 0;
+	for(i = 0; i < sim->huge_pages; i += 64) {
+		unsigned long word = sim->touched[(f + i) / 64];
+		if(sim->huge_pages < 64) word = (word >> (f % 64)) & ((1UL << sim->huge_pages) - 1);
+		touched += __builtin_popcountl(word);
+	}
+	return sim->huge_pages - touched;
+}
+
+// Record that a page of a process is mapped onto a frame
+void frame_add_mapping(vm_sim* sim, int f, unsigned int pid, PTE* pte, unsigned long vpn) {
+	frame* fr = &sim->frames[f];
+	mapping* m = &fr->map;
+	if(fr->refs > 0) {
+		m = (mapping*) malloc(sizeof(mapping));
+		if(m == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate shared mapping.\n");
+			exit(1);
+		}
+		m->next = fr->shared;
+		fr->shared = m;
+	}
+	m->pte = pte;
+	m->pid = pid;
+	m->vpn = vpn;
+	fr->refs++;
+}
+
+// Remove one mapping from a shared frame, which stays resident for the others
+void frame_drop_mapping(vm_sim* sim, int f, PTE* pte) {
+	frame* fr = &sim->frames[f];
+	mapping** link = &fr->shared;
+	mapping* m;
+	if(fr->map.pte == pte) {
+		// Move the most recent extra mapping up into the frame
+		m = fr->shared;
+		fr->map = *m;
+		fr->map.next = NULL;
+		fr->shared = m->next;
+		free(m);
+	} else {
+		for(m = fr->shared; m->pte != pte; m = m->next) link = &m->next;
+		*link = m->next;
+		free(m);
+	}
+	fr->refs--;
+	// The frame still has to reach the backing store if the departing page dirtied it
+	if(pte->dirty) fr->map.pte->dirty = 1;
+}
+
+// The PTE through which a process maps a frame
+PTE* frame_find_pte(vm_sim* sim, int f, unsigned int pid, unsigned long vpn) {
+	frame* fr = &sim->frames[f];
+	mapping* m;
+	if(fr->map.pid == pid && fr->map.vpn == vpn) return fr->map.pte;
+	for(m = fr->shared; m != NULL; m = m->next) if(m->pid == pid && m->vpn == vpn) return m->pte;
+	return NULL;
+}
+
+// Reset a PTE whose page left memory, returning whether the page was dirty
+int pte_evict(PTE* pte) {
+	int dirty = pte->dirty;
+	pte->valid = 0;
+	pte->cow = 0;
+	pte->dirty = 0;
+	pte->referenced = 0;
+	return dirty;
+}
+
+// Take a frame away from every page mapped onto it, queueing it for write-back if any
+// of them wrote to it
+void evict_frame(vm_sim* sim, int f) {
+	frame* fr = &sim->frames[f];
+	int dirty = pte_evict(fr->map.pte);
+	tlb_invalidate(sim, fr->map.pid, fr->map.vpn);
+	while(fr->shared != NULL) {
+		mapping* m = fr->shared;
+		dirty |= pte_evict(m->pte);
+		tlb_invalidate(sim, m->pid, m->vpn);
+		fr->shared = m->next;
+		free(m);
+	}
+	fr->refs = 0;
+	if(fr->huge) {
+		// A huge page goes out as one I/O, its untouched pages leave the bloat with it
+		sim->bloat -= huge_untouched(sim, f);
+		fr->huge = 0;
+		if(dirty) swap_write(sim, sim->huge_pages);
+		return;
+	}
+	if(fr->prefetched) {
+		fr->prefetched = 0;
+		sim->prefetch_unused++;
+	}
+	if(dirty) {
+		sim->write_back[sim->write_back_count].pid = fr->map.pid;
+		sim->write_back[sim->write_back_count].vpn = fr->map.vpn;
+		if(++sim->write_back_count == sim->cfg.write_back_batch) swap_flush(sim);
+	}
+}
+
+// Test and clear the referenced bits of every page mapped onto a frame. Their TLB
+// entries go too, so the next reference walks the page table and sets the bit again.
+int frame_referenced(vm_sim* sim, int f) {
+	frame* fr = &sim->frames[f];
+	mapping* m;
+	int referenced = 0;
+	for(m = &fr->map; m != NULL; m = m == &fr->map ? fr->shared : m->next) {
+		if(!m->pte->referenced) continue;
+		referenced = 1;
+		m->pte->referenced = 0;
+		tlb_invalidate(sim, m->pid, m->vpn);
+	}
+	return referenced;
+}
+
+/* BACKING STORE FUNCTIONS */
+
+// Time is simulated on one backing store: a fault waits for the device and the page-in,
+// dirty pages leaving memory are queued and written back asynchronously in batches, and
+// writes only delay the faults queued behind them. A page faulted back in before its
+// write-back went out is still read from disk.
+
+// Read the faulting page (and the rest of its huge page with it): wait for the device to
+// finish what is queued, then for the read
+void swap_page_in(vm_sim* sim, unsigned long pages) {
+	unsigned long cost = sim->cfg.page_in_time + (pages - 1) * sim->cfg.transfer_time;
+	unsigned long start = sim->device_free > sim->now ? sim->device_free : sim->now;
+	unsigned long done = start + cost;
+	sim->stream.vpn = 0;
+	sim->page_ins += pages;
+	sim->device_busy += cost;
+	sim->stall_time += done - sim->now;
+	sim->device_free = done;
+	sim->now = done;
+}
+
+// Write a run of pages back in one asynchronous I/O, right away instead of through the queue
+void swap_write(vm_sim* sim, unsigned long pages) {
+	unsigned long start = sim->device_free > sim->now ? sim->device_free : sim->now;
+	unsigned long cost = sim->cfg.write_back_time + (pages - 1) * sim->cfg.transfer_time;
+	sim->stream.vpn = 0;
+	sim->device_busy += cost;
+	sim->device_free = start + cost;
+	sim->write_back_pages += pages;
+	sim->write_back_ios++;
+}
+
+// Order queued pages by process and page number so neighbours end up next to each other
+int swap_page_compare(const void* a, const void* b) {
+	const swap_page* pa = (const swap_page*) a;
+	const swap_page* pb = (const swap_page*) b;
+	if(pa->pid != pb->pid) return pa->pid < pb->pid ? -1 : 1;
+	if(pa->vpn != pb->vpn) return pa->vpn < pb->vpn ? -1 : 1;
+	return 0;
+}
+
+// Issue the queued write-backs, one I/O per run of consecutive pages of a process.
+// The processes do not wait for them, only later page-ins queue up behind them.
+void swap_flush(vm_sim* sim) {
+	int i, run;
+	if(sim->write_back_count == 0) return;
+	qsort(sim->write_back, sim->write_back_count, sizeof(swap_page), swap_page_compare);
+	sim->stream.vpn = 0;
+	unsigned long start = sim->device_free > sim->now ? sim->device_free : sim->now;
+	for(i = 0; i < sim->write_back_count; i += run) {
+		run = 1;
+		while(i + run < sim->write_back_count && sim->write_back[i + run].pid == sim->write_back[i].pid &&
+			  sim->write_back[i + run].vpn == sim->write_back[i].vpn + run) run++;
+		unsigned long cost = sim->cfg.write_back_time + (run - 1) * sim->cfg.transfer_time;
+		start += cost;
+		sim->device_busy += cost;
+		sim->write_back_ios++;
+	}
+	sim->write_back_pages += sim->write_back_count;
+	sim->write_back_count = 0;
+	sim->device_free = start;
+}
+
+// Add an index at the front (most recent end) of a list
+void list_push_front(list_link* links, index_list* list, int i) {
+	links[i].prev = -1;
+	links[i].next = list->head;
+	if(list->head >= 0) links[list->head].prev = i;
+	else list->tail = i;
+	list->head = i;
+	list->size++;
+}
+
+// Add an index right after another one of a list
+void list_insert_after(list_link* links, index_list* list, int at, int i) {
+	links[i].prev = at;
+	links[i].next = links[at].next;
+	if(links[at].next >= 0) links[links[at].next].prev = i;
+	else list->tail = i;
+	links[at].next = i;
+	list->size++;
+}
+
+// Unlink an index from a list
+void list_unlink(list_link* links, index_list* list, int i) {
+	if(links[i].prev >= 0) links[links[i].prev].next = links[i].next;
+	else list->head = links[i].next;
+	if(links[i].next >= 0) links[links[i].next].prev = links[i].prev;
+	else list->tail = links[i].prev;
+	list->size--;
+}
+
+// Reset a list to empty
+void list_clear(index_list* list) {
+	list->head = -1;
+	list->tail = -1;
+	list->size = 0;
+}
+
+/* REPLACEMENT POLICIES */
+
+// LRU: the page table is the map from page to frame, the list keeps recency order so
+// every hit, load and eviction is O(1)
+void lru_init(vm_sim* sim, policy_domain* d) {
+	(void) sim;
+	list_clear(&d->lists[0]);
+	list_clear(&d->lists[1]);
+}
+
+void lru_release(vm_sim* sim, policy_domain* d) {
+	(void) sim;
+	(void) d;
+}
+
+void lru_insert(vm_sim* sim, policy_domain* d, int f) {
+	list_push_front(sim->links, &d->lists[0], f);
+}
+
+void lru_access(vm_sim* sim, policy_domain* d, int f) {
+	if(d->lists[0].head == f) return;
+	list_unlink(sim->links, &d->lists[0], f);
+	list_push_front(sim->links, &d->lists[0], f);
+}
+
+int lru_victim(vm_sim* sim, policy_domain* d, PTE* incoming) {
+	(void) incoming;
+	int f = d->lists[0].tail;
+	list_unlink(sim->links, &d->lists[0], f);
+	return f;
+}
+
+void lru_remove(vm_sim* sim, policy_domain* d, int f) {
+	list_unlink(sim->links, &d->lists[0], f);
+}
+
+// FIFO: same list, but hits leave the order alone
+void fifo_access(vm_sim* sim, policy_domain* d, int f) {
+	(void) sim;
+	(void) d;
+	(void) f;
+}
+
+// CLOCK (second chance): the domain's frames form a ring that the hand sweeps from
+// next to prev (wrapping at the head), clearing reference bits. A loaded frame goes in
+// right behind the hand, where the replaced one was, so the hand reaches it last.
+int clock_step(vm_sim* sim, policy_domain* d, int f) {
+	return sim->links[f].prev >= 0 ? sim->links[f].prev : d->lists[0].tail;
+}
+
+void clock_init(vm_sim* sim, policy_domain* d) {
+	lru_init(sim, d);
+	d->clock_hand = -1;
+}
+
+void clock_insert(vm_sim* sim, policy_domain* d, int f) {
+	if(d->clock_hand < 0) {
+		list_push_front(sim->links, &d->lists[0], f);
+		d->clock_hand = f;
+	} else list_insert_after(sim->links, &d->lists[0], d->clock_hand, f);
+}
+
+// The reference bits are the referenced bits of the page table entries
+int clock_victim(vm_sim* sim, policy_domain* d, PTE* incoming) {
+	(void) incoming;
+	int f = d->clock_hand;
+	while(frame_referenced(sim, f)) f = clock_step(sim, d, f);
+	d->clock_hand = clock_step(sim, d, f);
+	list_unlink(sim->links, &d->lists[0], f);
+	if(d->clock_hand == f) d->clock_hand = -1;
+	return f;
+}
+
+// A frame under the hand hands it on to the next one
+void clock_remove(vm_sim* sim, policy_domain* d, int f) {
+	if(d->clock_hand == f) d->clock_hand = clock_step(sim, d, f);
+	list_unlink(sim->links, &d->lists[0], f);
+	if(d->clock_hand == f) d->clock_hand = -1;
+}
+
+// Binary heap of frames shared by LFU (least count, then least recent first)
+// and OPT (furthest next use first). Frames remember their heap position.
+int heap_before(vm_sim* sim, int a, int b) {
+	frame* fa = &sim->frames[a];
+	frame* fb = &sim->frames[b];
+	if(sim->next_use != NULL) return fa->count > fb->count;
+	if(fa->count != fb->count) return fa->count < fb->count;
+	return fa->lru_count < fb->lru_count;
+}
+
+void heap_set(vm_sim* sim, policy_domain* d, int pos, int f) {
+	d->heap[pos] = f;
+	sim->frames[f].heap_index = pos;
+}
+
+// Move a frame up or down until the heap property holds again
+void heap_fix(vm_sim* sim, policy_domain* d, int pos) {
+	int f = d->heap[pos];
+	while(pos > 0 && heap_before(sim, f, d->heap[(pos - 1) / 2])) {
+		heap_set(sim, d, pos, d->heap[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+	for(;;) {
+		int child = 2 * pos + 1;
+		if(child >= d->heap_size) break;
+		if(child + 1 < d->heap_size && heap_before(sim, d->heap[child + 1], d->heap[child])) child++;
+		if(!heap_before(sim, d->heap[child], f)) break;
+		heap_set(sim, d, pos, d->heap[child]);
+		pos = child;
+	}
+	heap_set(sim, d, pos, f);
+}
+
+// Heaps start small and grow, a process under local replacement rarely holds all frames
+void heap_init(vm_sim* sim, policy_domain* d) {
+	(void) sim;
+	d->heap = NULL;
+	d->heap_size = 0;
+	d->heap_capacity = 0;
+}
+
+void heap_release(vm_sim* sim, policy_domain* d) {
+	(void) sim;
+	free(d->heap);
+}
+
+void heap_insert(vm_sim* sim, policy_domain* d, int f) {
+	if(d->heap_size == d->heap_capacity) {
+		d->heap_capacity = d->heap_capacity == 0 ? 64 : 2 * d->heap_capacity;
+		if(d->heap_capacity > sim->num_frames) d->heap_capacity = sim->num_frames;
+		d->heap = (int*) realloc(d->heap, d->heap_capacity * sizeof(int));
+		if(d->heap == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate policy heap.\n");
+			exit(1);
+		}
+	}
+	d->heap[d->heap_size] = f;
+	heap_fix(sim, d, d->heap_size++);
+}
+
+int heap_victim(vm_sim* sim, policy_domain* d, PTE* incoming) {
+	(void) incoming;
+	int f = d->heap[0];
+	d->heap_size--;
+	if(d->heap_size > 0) {
+		d->heap[0] = d->heap[d->heap_size];
+		heap_fix(sim, d, 0);
+	}
+	return f;
+}
+
+void heap_remove(vm_sim* sim, policy_domain* d, int f) {
+	int pos = sim->frames[f].heap_index;
+	d->heap_size--;
+	if(pos < d->heap_size) {
+		heap_set(sim, d, pos, d->heap[d->heap_size]);
+		heap_fix(sim, d, pos);
+	}
+}
+
+// LFU: reference count, reset whenever the page is loaded again
+void lfu_insert(vm_sim* sim, policy_domain* d, int f) {
+	sim->frames[f].count = 1;
+	heap_insert(sim, d, f);
+}
+
+void lfu_access(vm_sim* sim, policy_domain* d, int f) {
+	sim->frames[f].count++;
+	heap_fix(sim, d, sim->frames[f].heap_index);
+}
+
+// OPT (Belady): evict the page whose next use lies furthest in the future.
+// next_use[i] is the position of the next reference to the page referenced by record i.
+void opt_init(vm_sim* sim, policy_domain* d) {
+	heap_init(sim, d);
+	// Placeholder until opt_build_index() reads the trace
+	if(sim->next_use == NULL) sim->next_use = (unsigned long*) malloc(sizeof(unsigned long));
+	if(sim->next_use == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate next-use index.\n");
+		exit(1);
+	}
+}
+
+void opt_insert(vm_sim* sim, policy_domain* d, int f) {
+	sim->frames[f].count = sim->next_use[sim->pos - 1];
+	heap_insert(sim, d, f);
+}
+
+void opt_access(vm_sim* sim, policy_domain* d, int f) {
+	sim->frames[f].count = sim->next_use[sim->pos - 1];
+	heap_fix(sim, d, sim->frames[f].heap_index);
+}
+
+// Read the whole trace once to link every reference to the next one of the same page
+// of the same process
+void opt_build_index(vm_sim* sim, trace_reader* infile) {
+	unsigned long n = 0, capacity = 1 << 16;
+	const unsigned long* block;
+	size_t count, j;
+	ul_map last_seen;
+	int vpn_bits = sim->cfg.va_bits - sim->page_shift;
+	if(sim->cfg.tagged && vpn_bits + PID_BITS > 64) {
+		fprintf(stderr, "[ERROR] OPT on a tagged trace needs page numbers of at most %d bits.\n", 64 - PID_BITS);
+		exit(1);
+	}
+	free(sim->next_use);
+	sim->next_use = (unsigned long*) malloc(capacity * sizeof(unsigned long));
+	map_init(&last_seen, 1 << 16);
+	while((count = trace_next_block(infile, &block)) > 0) {
+		const trace_record* records = (const trace_record*) block;
+		if(sim->cfg.tagged) count = count * sizeof(unsigned long) / sizeof(trace_record);
+		for(j = 0; j < count; j++) {
+			unsigned long LA = sim->cfg.tagged ? records[j].addr : block[j];
+			int skip = sim->cfg.tagged && (records[j].flags & TRACE_FORK);
+			if(n == capacity) {
+				capacity *= 2;
+				sim->next_use = (unsigned long*) realloc(sim->next_use, capacity * sizeof(unsigned long));
+			}
+			if(sim->next_use == NULL) {
+				fprintf(stderr, "[ERROR] Unable to allocate next-use index.\n");
+				exit(1);
+			}
+			sim->next_use[n] = NEVER;
+			if(!skip && (sim->va_limit == 0 || LA < sim->va_limit)) {
+				// Keys are stored off by one so page 0 of pid 0 does not collide with the empty key
+				unsigned long key = (LA >> sim->page_shift) + 1;
+				if(sim->cfg.tagged) key += (unsigned long) records[j].pid << vpn_bits;
+				unsigned long* prev = map_get(&last_seen, key);
+				if(prev != NULL) {
+					sim->next_use[*prev] = n;
+					*prev = n;
+				} else map_put(&last_seen, key, n);
+			}
+			n++;
+		}
+	}
+	map_free(&last_seen);
+	if(trace_rewind(infile) != 0) {
+		fprintf(stderr, "[ERROR] OPT needs to read the trace twice and cannot take it from a pipe.\n");
+		exit(1);
+	}
+}
+
+// ARC (adaptive replacement cache): T1/T2 hold resident pages seen once/more than once,
+// the ghost lists B1/B2 remember pages recently evicted from them and steer the target
+// size p of T1. Ghosts are found through a hash map keyed by the page's PTE.
+void arc_init(vm_sim* sim, policy_domain* d) {
+	int i;
+	int c = sim->num_frames - sim->cfg.reserved;
+	lru_init(sim, d);
+	d->arc_p = 0.0;
+	list_clear(&d->ghosts[0]);
+	list_clear(&d->ghosts[1]);
+	d->ghost_links = (list_link*) malloc((c + 1) * sizeof(list_link));
+	d->ghost_pte = (PTE**) malloc((c + 1) * sizeof(PTE*));
+	d->ghost_list = (int*) malloc((c + 1) * sizeof(int));
+	if(d->ghost_links == NULL || d->ghost_pte == NULL || d->ghost_list == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate ARC ghost lists.\n");
+		exit(1);
+	}
+	// Unused ghost nodes are chained through their next list_link
+	for(i = 0; i <= c; i++) d->ghost_links[i].next = i + 1 <= c ? i + 1 : -1;
+	d->ghost_free = 0;
+	map_init(&d->ghost_map, 2 * (c + 1));
+}
+
+void arc_release(vm_sim* sim, policy_domain* d) {
+	(void) sim;
+	free(d->ghost_links);
+	free(d->ghost_pte);
+	free(d->ghost_list);
+	map_free(&d->ghost_map);
+}
+
+// Which ghost list (0 for B1, 1 for B2) holds a page, or -1
+int arc_ghost_of(policy_domain* d, PTE* pte, int* node) {
+	unsigned long* value = map_get(&d->ghost_map, (unsigned long) pte);
+	if(value == NULL) return -1;
+	*node = (int) *value;
+	return d->ghost_list[*node];
+}
+
+void arc_ghost_drop(policy_domain* d, int node) {
+	list_unlink(d->ghost_links, &d->ghosts[d->ghost_list[node]], node);
+	map_remove(&d->ghost_map, (unsigned long) d->ghost_pte[node]);
+	d->ghost_links[node].next = d->ghost_free;
+	d->ghost_free = node;
+}
+
+void arc_ghost_add(policy_domain* d, int which, PTE* pte) {
+	int node = d->ghost_free;
+	d->ghost_free = d->ghost_links[node].next;
+	d->ghost_pte[node] = pte;
+	d->ghost_list[node] = which;
+	list_push_front(d->ghost_links, &d->ghosts[which], node);
+	map_put(&d->ghost_map, (unsigned long) pte, (unsigned long) node);
+}
+
+void arc_insert(vm_sim* sim, policy_domain* d, int f) {
+	int node;
+	int which = arc_ghost_of(d, sim->frames[f].map.pte, &node);
+	// A ghost hit goes straight to T2, a new page to T1
+	if(which >= 0) arc_ghost_drop(d, node);
+	sim->frames[f].arc_list = which >= 0 ? 1 : 0;
+	list_push_front(sim->links, &d->lists[sim->frames[f].arc_list], f);
+}
+
+// A page leaving without replacement is not remembered in the ghost lists
+void arc_remove(vm_sim* sim, policy_domain* d, int f) {
+	list_unlink(sim->links, &d->lists[sim->frames[f].arc_list], f);
+}
+
+void arc_access(vm_sim* sim, policy_domain* d, int f) {
+	list_unlink(sim->links, &d->lists[sim->frames[f].arc_list], f);
+	sim->frames[f].arc_list = 1;
+	list_push_front(sim->links, &d->lists[1], f);
+}
+
+int arc_victim(vm_sim* sim, policy_domain* d, PTE* incoming) {
+	int c = sim->num_frames - sim->cfg.reserved;
+	int node;
+	int which = arc_ghost_of(d, incoming, &node);
+	index_list* T1 = &d->lists[0];
+	index_list* B1 = &d->ghosts[0];
+	index_list* B2 = &d->ghosts[1];
+	// Adapt the target size of T1 on ghost hits
+	if(which == 0) {
+		double delta = B1->size >= B2->size ? 1.0 : (double) B2->size / B1->size;
+		d->arc_p = d->arc_p + delta < c ? d->arc_p + delta : c;
+	} else if(which == 1) {
+		double delta = B2->size >= B1->size ? 1.0 : (double) B1->size / B2->size;
+		d->arc_p = d->arc_p - delta > 0.0 ? d->arc_p - delta : 0.0;
+	} else {
+		// A brand new page: keep the directory within 2c pages
+		if(T1->size + B1->size >= c) {
+			if(T1->size < c) arc_ghost_drop(d, B1->tail);
+			else {
+				// T1 alone fills the cache, drop its LRU page without remembering it
+				int f = T1->tail;
+				list_unlink(sim->links, T1, f);
+				return f;
+			}
+		} else if(d->lists[0].size + d->lists[1].size + B1->size + B2->size >= 2 * c && B2->size > 0) {
+			arc_ghost_drop(d, B2->tail);
+		}
+	}
+	// REPLACE: evict from T1 when it is above target, otherwise from T2
+	int from = 1;
+	if(T1->size > 0 && (T1->size > d->arc_p || (which == 1 && T1->size == (int) d->arc_p))) from = 0;
+	if(d->lists[from].size == 0) from = 1 - from;
+	int f = d->lists[from].tail;
+	list_unlink(sim->links, &d->lists[from], f);
+	// Make room in the ghost lists if they are full (can only happen when c is tiny)
+	if(d->ghost_free < 0) arc_ghost_drop(d, d->ghosts[from].size > 0 ? d->ghosts[from].tail : d->ghosts[1 - from].tail);
+	arc_ghost_add(d, from, sim->frames[f].map.pte);
+	return f;
+}
+
+// Table of the available policies, terminated by an empty entry
+const policy policies[] = {
+	{ "LRU", lru_init, lru_release, lru_insert, lru_access, lru_victim, lru_remove },
+	{ "FIFO", lru_init, lru_release, lru_insert, fifo_access, lru_victim, lru_remove },
+	{ "CLOCK", clock_init, lru_release, clock_insert, fifo_access, clock_victim, clock_remove },
+	{ "LFU", heap_init, heap_release, lfu_insert, lfu_access, heap_victim, heap_remove },
+	{ "ARC", arc_init, arc_release, arc_insert, arc_access, arc_victim, arc_remove },
+	{ "OPT", opt_init, heap_release, opt_insert, opt_access, heap_victim, NULL },
+	{ NULL, NULL, NULL, NULL, NULL, NULL, NULL }
+};
+
+// Look up a policy by name
+const policy* find_policy(const char* name) {
+	const policy* p;
+	for(p = policies; p->name != NULL; p++) if(strcmp(p->name, name) == 0) return p;
+	return NULL;
+}
+
+/* PREFETCH FUNCTIONS */
+
+// Prefetched pages wait below the policy in a FIFO of their own until they are
+// referenced, when the policy takes them over like a freshly loaded page. A fault evicts
+// the oldest unreferenced prefetched page before asking the policy, while a prefetch only
+// evicts through the policy, so read-ahead never pushes out earlier read-ahead.
+
+// Ask the prefetcher what to read ahead after a fault or a first reference to a
+// prefetched page, and start reading the pages that are not resident yet. They
+// go out behind whatever the device is busy with; a page right after the last one
+// read ahead, with no other I/O in between, continues that I/O.
+void prefetch_run(vm_sim* sim, process* proc, unsigned int pid, unsigned long vpn) {
+	unsigned long pages[64];
+	int i;
+	int count = sim->pf->predict(sim, &sim->prefetch, pid, vpn, pages, sim->cfg.prefetch_depth);
+	unsigned long start = sim->device_free > sim->now ? sim->device_free : sim->now;
+	// va_limit is 0 for 64-bit addresses, which makes this the largest page number
+	unsigned long max_vpn = (sim->va_limit - 1) >> sim->page_shift;
+	policy_domain* d = sim->cfg.local ? &proc->domain : &sim->global;
+	for(i = 0; i < count; i++) {
+		if(pages[i] > max_vpn) continue;
+		PTE* pte = pt_walk(sim, proc, pages[i]);
+		if(pte->valid) continue;
+		int frame_number = get_frame(sim, proc, pte, 1);
+		// Evicting may have queued write-backs in front of the read
+		if(sim->device_free > start) start = sim->device_free;
+		unsigned long cost = sim->stream.pid == pid && sim->stream.vpn == pages[i] + 1 ?
+			sim->cfg.transfer_time : sim->cfg.page_in_time;
+		start += cost;
+		sim->device_busy += cost;
+		sim->device_free = start;
+		sim->stream.pid = pid;
+		sim->stream.vpn = pages[i] + 2;
+		frame* fr = &sim->frames[frame_number];
+		fr->ready = start;
+		fr->prefetched = 1;
+		fr->owner = pid;
+		fr->lru_count = sim->clock;
+		pte->frame_number = frame_number;
+		pte->valid = 1;
+		pte->cow = 0;
+		pte->dirty = 0;
+		pte->referenced = 0;
+		frame_add_mapping(sim, frame_number, pid, pte, pages[i]);
+		d->resident++;
+		list_push_front(sim->links, &d->prefetched, frame_number);
+		sim->prefetches++;
+	}
+}
+
+void prefetch_none_init(vm_sim* sim, prefetch_state* p) {
+	(void) sim;
+	(void) p;
+}
+
+void prefetch_none_release(vm_sim* sim, prefetch_state* p) {
+	(void) sim;
+	(void) p;
+}
+
+// Sequential read-ahead: the pages right after the one referenced
+int next_predict(vm_sim* sim, prefetch_state* p, unsigned int pid, unsigned long vpn, unsigned long* pages, int depth) {
+	(void) sim;
+	(void) p;
+	(void) pid;
+	int k;
+	for(k = 0; k < depth; k++) pages[k] = vpn + k + 1;
+	return depth;
+}
+
+void stride_init(vm_sim* sim, prefetch_state* p) {
+	(void) sim;
+	memset(p->streams, 0, sizeof(p->streams));
+}
+
+// Stride detection: the reference joins the nearest stream of the process within 64
+// pages of its last page (or replaces the least recently used stream), and once the
+// same stride came up twice in a row the next depth pages along it are predicted
+int stride_predict(vm_sim* sim, prefetch_state* p, unsigned int pid, unsigned long vpn, unsigned long* pages, int depth) {
+	int i, k;
+	stride_stream* s = NULL;
+	stride_stream* oldest = &p->streams[0];
+	unsigned long nearest = 65;
+	for(i = 0; i < STRIDE_STREAMS; i++) {
+		stride_stream* t = &p->streams[i];
+		if(t->lru_count < oldest->lru_count) oldest = t;
+		if(t->lru_count == 0 || t->pid != pid) continue;
+		unsigned long distance = vpn > t->last ? vpn - t->last : t->last - vpn;
+		if(distance < nearest) {
+			nearest = distance;
+			s = t;
+		}
+	}
+	if(s == NULL) {
+		s = oldest;
+		s->pid = pid;
+		s->stride = 0;
+		s->confidence = 0;
+	} else {
+		long stride = (long) (vpn - s->last);
+		if(stride == s->stride) s->confidence++;
+		else {
+			s->stride = stride;
+			s->confidence = 0;
+		}
+	}
+	s->last = vpn;
+	s->lru_count = sim->clock + 1;
+	if(s->confidence < 1 || s->stride == 0) return 0;
+	for(k = 0; k < depth; k++) pages[k] = vpn + (k + 1) * s->stride;
+	return depth;
+}
+
+void markov_init(vm_sim* sim, prefetch_state* p) {
+	(void) sim;
+	map_init(&p->successor_index, 1024);
+	map_init(&p->last_fault, 64);
+	p->successor_count = 0;
+	p->successor_capacity = 1024;
+	p->successors = (unsigned long*) malloc(p->successor_capacity * MARKOV_WAYS * sizeof(unsigned long));
+	if(p->successors == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate markov prefetcher table.\n");
+		exit(1);
+	}
+}
+
+void markov_release(vm_sim* sim, prefetch_state* p) {
+	(void) sim;
+	map_free(&p->successor_index);
+	map_free(&p->last_fault);
+	free(p->successors);
+}
+
+// Successor slots of a page, created empty on first use. Pages are stored plus one so
+// that zero marks an empty slot.
+unsigned long* markov_successors(vm_sim* sim, prefetch_state* p, unsigned int pid, unsigned long vpn, int create) {
+	int vpn_bits = sim->cfg.va_bits - sim->page_shift;
+	unsigned long key = (((unsigned long) pid << vpn_bits) | vpn) + 1;
+	unsigned long* index = map_get(&p->successor_index, key);
+	if(index != NULL) return &p->successors[*index * MARKOV_WAYS];
+	if(!create) return NULL;
+	if(p->successor_count == p->successor_capacity) {
+		p->successor_capacity *= 2;
+		p->successors = (unsigned long*) realloc(p->successors, p->successor_capacity * MARKOV_WAYS * sizeof(unsigned long));
+		if(p->successors == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate markov prefetcher table.\n");
+			exit(1);
+		}
+	}
+	unsigned long* slots = &p->successors[p->successor_count * MARKOV_WAYS];
+	memset(slots, 0, MARKOV_WAYS * sizeof(unsigned long));
+	map_put(&p->successor_index, key, p->successor_count++);
+	return slots;
+}
+
+// Markov read-ahead: remember this page as the latest successor of the previous miss
+// of the process, then predict the pages that followed this one before
+int markov_predict(vm_sim* sim, prefetch_state* p, unsigned int pid, unsigned long vpn, unsigned long* pages, int depth) {
+	int k, count = 0;
+	unsigned long* last = map_get(&p->last_fault, (unsigned long) pid + 1);
+	if(last != NULL && *last != vpn + 1) {
+		unsigned long* slots = markov_successors(sim, p, pid, *last - 1, 1);
+		for(k = 0; k < MARKOV_WAYS - 1 && slots[k] != vpn + 1; k++);
+		for(; k > 0; k--) slots[k] = slots[k - 1];
+		slots[0] = vpn + 1;
+	}
+	map_put(&p->last_fault, (unsigned long) pid + 1, vpn + 1);
+	unsigned long* slots = markov_successors(sim, p, pid, vpn, 0);
+	if(slots == NULL) return 0;
+	for(k = 0; k < MARKOV_WAYS && count < depth && slots[k] != 0; k++) pages[count++] = slots[k] - 1;
+	return count;
+}
+
+// Table of the available prefetchers, starting with the baseline that never prefetches
+// and terminated by an empty entry
+const prefetcher prefetchers[] = {
+	{ "none", prefetch_none_init, prefetch_none_release, NULL },
+	{ "next", prefetch_none_init, prefetch_none_release, next_predict },
+	{ "stride", stride_init, prefetch_none_release, stride_predict },
+	{ "markov", markov_init, markov_release, markov_predict },
+	{ NULL, NULL, NULL, NULL }
+};
+
+// Look up a prefetcher by name
+const prefetcher* find_prefetcher(const char* name) {
+	const prefetcher* p;
+	for(p = prefetchers; p->name != NULL; p++) if(strcmp(p->name, name) == 0) return p;
+	return NULL;
+}
+
+/* STACK DISTANCE FUNCTIONS */
+
+// Mattson's stack algorithm: a page referenced again is a hit in an LRU memory of C
+// frames exactly when fewer than C other pages were referenced since its last use. A
+// Fenwick tree over reference times, with a 1 at the last reference of every page,
+// counts those pages in O(log n). -sample picks pages by hashing (SHARDS) and scales the
+// distances up by 1/rate. Processes share one stack and fork records are skipped.
+
+// Add delta at a reference time
+void mrc_tree_add(mrc_state* m, unsigned long t, int delta) {
+	for(; t <= m->capacity; t += t & (0 - t)) m->tree[t] += delta;
+}
+
+// Number of pages whose last reference is at or before time t
+unsigned long mrc_tree_sum(mrc_state* m, unsigned long t) {
+	unsigned long sum = 0;
+	for(; t > 0; t -= t & (0 - t)) sum += m->tree[t];
+	return sum;
+}
+
+// Allocate an empty tree over times 1 to capacity
+void mrc_tree_alloc(mrc_state* m, unsigned long capacity) {
+	free(m->tree);
+	free(m->marks);
+	m->capacity = capacity;
+	m->tree = (unsigned int*) calloc(capacity + 1, sizeof(unsigned int));
+	m->marks = (unsigned char*) calloc(capacity + 1, 1);
+	if(m->tree == NULL || m->marks == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate stack distance tree.\n");
+		exit(1);
+	}
+}
+
+// Renumber the last reference times of the live pages to 1..pages, keeping their order,
+// so the tree can keep going without growing with the trace
+void mrc_compact(mrc_state* m) {
+	unsigned long t, i, live = 0;
+	unsigned int* rank = (unsigned int*) malloc((m->capacity + 1) * sizeof(unsigned int));
+	if(rank == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate stack distance tree.\n");
+		exit(1);
+	}
+	for(t = 1; t <= m->capacity; t++) {
+		if(m->marks[t]) live++;
+		rank[t] = (unsigned int) live;
+	}
+	for(i = 0; i < m->last.capacity; i++) {
+		if(m->last.keys[i] != 0) m->last.values[i] = rank[m->last.values[i]];
+	}
+	free(rank);
+	// Keep at least half of the new tree free for the references to come
+	unsigned long capacity = m->capacity;
+	while(capacity < 2 * live) capacity *= 2;
+	mrc_tree_alloc(m, capacity);
+	for(t = 1; t <= live; t++) {
+		m->marks[t] = 1;
+		mrc_tree_add(m, t, 1);
+	}
+	m->now = live;
+}
+
+// Count one stack distance (already scaled for sampling)
+void mrc_hist_add(mrc_state* m, unsigned long distance) {
+	if(distance >= m->hist_size) {
+		unsigned long size = m->hist_size;
+		while(size <= distance) size *= 2;
+		m->hist = (unsigned long*) realloc(m->hist, size * sizeof(unsigned long));
+		if(m->hist == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate stack distance histogram.\n");
+			exit(1);
+		}
+		memset(&m->hist[m->hist_size], 0, (size - m->hist_size) * sizeof(unsigned long));
+		m->hist_size = size;
+	}
+	m->hist[distance]++;
+}
+
+// Process one reference to a page key (nonzero)
+void mrc_reference(mrc_state* m, unsigned long key, double rate) {
+	m->references++;
+	if(m->threshold != 0 && (map_hash(key) & 0xffffff) >= m->threshold) return;
+	m->sampled++;
+	if(m->now == m->capacity) mrc_compact(m);
+	unsigned long t = ++m->now;
+	unsigned long* prev = map_get(&m->last, key);
+	if(prev == NULL) {
+		m->cold++;
+		map_put(&m->last, key, t);
+	} else {
+		// Pages referenced after the previous use, plus the page itself
+		unsigned long distance = mrc_tree_sum(m, t - 1) - mrc_tree_sum(m, *prev) + 1;
+		if(rate < 1.0) distance = (unsigned long) (distance / rate + 0.5);
+		mrc_hist_add(m, distance);
+		m->marks[*prev] = 0;
+		mrc_tree_add(m, *prev, -1);
+		*prev = t;
+	}
+	m->marks[t] = 1;
+	mrc_tree_add(m, t, 1);
+}
+
+// Compute the LRU miss ratio curve of the whole trace in a single pass. The output file
+// gets one line per memory size in frames (up to the number of distinct pages, where
+// only cold misses remain) and stdout a summary at powers of two and the configured size.
+void mrc_run(vm_config* cfg, trace_reader* infile, const char* outfile_name) {
+	mrc_state m;
+	const unsigned long* block;
+	size_t n, j;
+	unsigned long c;
+	int page_shift = 0;
+	memset(&m, 0, sizeof(mrc_state));
+	if(cfg->page_size == 0 || (cfg->page_size & (cfg->page_size - 1)) != 0) {
+		fprintf(stderr, "[ERROR] Page size must be a power of two.\n");
+		exit(1);
+	}
+	while((1UL << page_shift) < cfg->page_size) page_shift++;
+	int vpn_bits = cfg->va_bits - page_shift;
+	if(cfg->tagged && vpn_bits + PID_BITS > 64) {
+		fprintf(stderr, "[ERROR] A tagged trace needs page numbers of at most %d bits.\n", 64 - PID_BITS);
+		exit(1);
+	}
+	unsigned long va_limit = cfg->va_bits >= 64 ? 0 : 1UL << cfg->va_bits;
+	FILE* outfile = fopen(outfile_name, "w");
+	if(outfile == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open outfile.\n");
+		exit(1);
+	}
+	if(cfg->sample_rate < 1.0) m.threshold = (unsigned long) (cfg->sample_rate * 0x1000000);
+	if(cfg->sample_rate < 1.0 && m.threshold == 0) m.threshold = 1;
+	mrc_tree_alloc(&m, 1 << 20);
+	map_init(&m.last, 1 << 16);
+	m.hist_size = 1024;
+	m.hist = (unsigned long*) calloc(m.hist_size, sizeof(unsigned long));
+	if(m.hist == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate stack distance histogram.\n");
+		exit(1);
+	}
+	double start = trace_now();
+	while((n = trace_next_block(infile, &block)) > 0) {
+		const trace_record* records = (const trace_record*) block;
+		if(cfg->tagged) n = n * sizeof(unsigned long) / sizeof(trace_record);
+		for(j = 0; j < n; j++) {
+			unsigned long LA = cfg->tagged ? records[j].addr : block[j];
+			if(cfg->tagged && (records[j].flags & TRACE_FORK)) continue;
+			if(va_limit != 0 && LA >= va_limit) continue;
+			unsigned long key = (LA >> page_shift) + 1;
+			if(cfg->tagged) key += (unsigned long) records[j].pid << vpn_bits;
+			mrc_reference(&m, key, cfg->sample_rate);
+		}
+	}
+	double elapsed = trace_now() - start;
+	// With sampling, scale the sampled counts up to the whole trace. The sample rarely
+	// holds exactly rate * references references; the difference is taken as hits at
+	// the smallest distance (SHARDS-adj), which only changes the denominator.
+	double expected = m.sampled;
+	if(m.threshold != 0) expected = m.references * (double) m.threshold / 0x1000000;
+	double scale = expected > 0 ? m.references / expected : 0.0;
+	unsigned long max_distance = 0;
+	for(c = 1; c < m.hist_size; c++) if(m.hist[c] != 0) max_distance = c;
+	unsigned long pages = (unsigned long) (m.cold * (cfg->sample_rate < 1.0 ? 1.0 / cfg->sample_rate : 1.0) + 0.5);
+	unsigned long frames = cfg->phys_mem / cfg->page_size;
+	unsigned long usable = frames > (unsigned long) cfg->reserved ? frames - cfg->reserved : 0;
+	unsigned long limit = max_distance > pages ? max_distance : pages;
+	if(limit < usable) limit = usable;
+	// Misses for C frames are the cold misses plus the reuses at a distance above C
+	unsigned long misses = m.sampled;
+	fprintf(outfile, "frames faults miss_ratio\n");
+	printf("References: %lu, distinct pages: %lu%s, cold misses: %lu\n", m.references, pages,
+		   cfg->sample_rate < 1.0 ? " (estimated)" : "", (unsigned long) (m.cold * scale + 0.5));
+	if(cfg->sample_rate < 1.0) printf("Sampled %lu references (rate %g)\n", m.sampled, cfg->sample_rate);
+	printf("  Frames        Page faults   Miss ratio\n");
+	for(c = 1; c <= limit; c++) {
+		// misses holds the misses for c - 1 frames, a memory of c frames also hits distance c
+		if(c < m.hist_size) misses -= m.hist[c];
+		double faults = misses * scale;
+		double ratio = expected > 0 ? misses / expected : 0.0;
+		fprintf(outfile, "%lu %.0f %.6f\n", c, faults, ratio);
+		if((c & (c - 1)) == 0 || c == usable || c == limit) {
+			printf("%8lu %18.0f %11.4f%%%s\n", c, faults, 100.0 * ratio, c == usable ? "  <- configured memory" : "");
+		}
+	}
+	if(fclose(outfile) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write to outfile.\n");
+		exit(1);
+	}
+	printf("Stack distances of %lu references in %.3f s (%.0f references/s)\n", m.references, elapsed,
+		   elapsed > 0 ? m.references / elapsed : 0.0);
+	free(m.tree);
+	free(m.marks);
+	free(m.hist);
+	map_free(&m.last);
+}
+
+/* HASH MAP FUNCTIONS */
+
+// Hash an unsigned long key (splitmix64 finalizer)
+unsigned long map_hash(unsigned long key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9UL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebUL;
+	key ^= key >> 31;
+	return key;
+}
+
+void map_init(ul_map* map, unsigned long capacity) {
+	map->capacity = 16;
+	while(map->capacity < capacity) map->capacity *= 2;
+	map->size = 0;
+	map->keys = (unsigned long*) calloc(map->capacity, sizeof(unsigned long));
+	map->values = (unsigned long*) malloc(map->capacity * sizeof(unsigned long));
+	if(map->keys == NULL || map->values == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate hash map.\n");
+		exit(1);
+	}
+}
+
+void map_free(ul_map* map) {
+	free(map->keys);
+	free(map->values);
+}
+
+// Return a pointer to the value of a key, or NULL
+unsigned long* map_get(ul_map* map, unsigned long key) {
+	unsigned long mask = map->capacity - 1;
+	unsigned long i = map_hash(key) & mask;
+	while(map->keys[i] != 0) {
+		if(map->keys[i] == key) return &map->values[i];
+		i = (i + 1) & mask;
+	}
+	return NULL;
+}
+
+// Insert or overwrite a key, doubling the table when it gets half full
+void map_put(ul_map* map, unsigned long key, unsigned long value) {
+	unsigned long i, mask;
+	if(2 * (map->size + 1) > map->capacity) {
+		ul_map bigger;
+		map_init(&bigger, map->capacity * 2);
+		for(i = 0; i < map->capacity; i++) if(map->keys[i] != 0) map_put(&bigger, map->keys[i], map->values[i]);
+		map_free(map);
+		*map = bigger;
+	}
+	mask = map->capacity - 1;
+	i = map_hash(key) & mask;
+	while(map->keys[i] != 0 && map->keys[i] != key) i = (i + 1) & mask;
+	if(map->keys[i] == 0) map->size++;
+	map->keys[i] = key;
+	map->values[i] = value;
+}
+
+// Remove a key, shifting later entries of the probe sequence back into the hole
+void map_remove(ul_map* map, unsigned long key) {
+	unsigned long mask = map->capacity - 1;
+	unsigned long i = map_hash(key) & mask;
+	while(map->keys[i] != key) {
+		if(map->keys[i] == 0) return;
+		i = (i + 1) & mask;
+	}
+	unsigned long j = i;
+	for(;;) {
+		j = (j + 1) & mask;
+		if(map->keys[j] == 0) break;
+		unsigned long home = map_hash(map->keys[j]) & mask;
+		// Move entry j into the hole at i unless its home lies cyclically in (i, j]
+		if((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			map->keys[i] = map->keys[j];
+			map->values[i] = map->values[j];
+			i = j;
+		}
+	}
+	map->keys[i] = 0;
+	map->size--;
+}
@@ -0,0 +1,326 @@
+/*
+ * Bryce Souers
+ * bench_wordcount.c - Check wordcount against a reference counter and measure
+ *					   its throughput for each counting mode and thread count.
+ * Usage: ./bench_wordcount [-threads list] [-runs n] [-check] [-wordcount path]
+ *							corpus_file1 corpus_file2 ...
+ *
+ *	-threads list	comma-separated thread counts to run with (default 1 and
+ *					the number of CPUs)
+ *	-runs n			runs of each measurement, the fastest one counts (default 3)
+ *	-check			only check the counts, with odd chunk sizes as well so chunk
+ *					joins are exercised, and skip the timing
+ *	-wordcount path	the wordcount to run (default ./wordcount)
+ *
+ * The reference counter goes through each file a byte (or with -locale a
+ * character) at a time following the rules wordcount documents, sharing no code
+ * with it, so a kernel that drifts from those rules shows up as a mismatch. The
+ * -locale mode is run and checked in the C.UTF-8 locale. Throughput is the file
+ * size over the wall time of the whole wordcount run, in GB/s (10^9 bytes).
+ * Kernels this CPU lacks are skipped; a run that fails in any other way is a
+ * mismatch. The exit code is 1 when any count did not match.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MAX_THREAD_COUNTS	16
+#define READ_SIZE			(1 << 20)
+
+// Counts in the order wordcount prints them for -lwmcL
+typedef struct counts {
+	unsigned long lines;
+	unsigned long words;
+	unsigned long chars;
+	unsigned long bytes;
+	unsigned long max_line;
+} counts;
+
+// A way of running wordcount: its options, whether it prints -L, whether it counts by the
+// locale, and whether this CPU can run it
+typedef struct bench_mode {
+	const char *name;
+	const char *options;
+	int max_line;
+	int locale;
+	int available;
+} bench_mode;
+
+bench_mode modes[] = {
+	{ "scalar", "-lwmc -kernel scalar", 0, 0, 1 },
+	{ "sse2", "-lwmc -kernel sse2", 0, 0, 1 },
+	{ "avx2", "-lwmc -kernel avx2", 0, 0, 1 },
+	{ "columns", "-lwmcL", 1, 0, 1 },
+	{ "locale", "-lwmc -locale", 0, 1, 1 }
+};
+
+void check_kernels(void);
+int reference_count(const char *name, int locale, counts *c);
+int run_wordcount(const char *wordcount, bench_mode *mode, int threads, const char *chunk, const char *name,
+				  counts *c, double *seconds);
+int same_counts(counts *a, counts *b, int max_line);
+const char *base_name(const char *name);
+
+int main(int argc, char *argv[]) {
+	int thread_counts[MAX_THREAD_COUNTS];
+	int num_thread_counts = 0;
+	int runs = 3;
+	int check_only = 0;
+	const char *wordcount = "./wordcount";
+	int i = 1;
+	while(i < argc && argv[i][0] == '-') {
+		if(strcmp(argv[i], "-check") == 0) {
+			check_only = 1;
+			i++;
+			continue;
+		}
+		if(i + 1 >= argc) {
+			fprintf(stderr, "[ERROR] Missing value for %s.\n", argv[i]);
+			exit(1);
+		}
+		if(strcmp(argv[i], "-threads") == 0) {
+			for(char *t = strtok(argv[i + 1], ","); t != NULL && num_thread_counts < MAX_THREAD_COUNTS; t = strtok(NULL, ",")) {
+				thread_counts[num_thread_counts] = atoi(t);
+				if(thread_counts[num_thread_counts] < 1) {
+					fprintf(stderr, "[ERROR] -threads expects counts above 0.\n");
+					exit(1);
+				}
+				num_thread_counts++;
+			}
+		} else if(strcmp(argv[i], "-runs") == 0) {
+			runs = atoi(argv[i + 1]);
+			if(runs < 1) {
+				fprintf(stderr, "[ERROR] -runs expects a count above 0.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-wordcount") == 0) wordcount = argv[i + 1];
+		else {
+			fprintf(stderr, "[ERROR] Unknown option %s.\n", argv[i]);
+			exit(1);
+		}
+		i += 2;
+	}
+	if(i == argc) {
+		fprintf(stderr, "[ERROR] No corpus files given.\n");
+		exit(1);
+	}
+	if(num_thread_counts == 0) {
+		int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		thread_counts[num_thread_counts++] = 1;
+		if(cpus > 1) thread_counts[num_thread_counts++] = cpus;
+	}
+	if(setlocale(LC_CTYPE, "C.UTF-8") == NULL) {
+		fprintf(stderr, "[ERROR] The C.UTF-8 locale is not available.\n");
+		exit(1);
+	}
+	check_kernels();
+	// Chunk sizes: the default, and for checks sizes that cut words, lines and characters
+	const char *chunks[] = { "16M", "4097", "65521" };
+	int num_chunks = check_only ? 3 : 1;
+	int mismatches = 0;
+	printf("%-16s %-8s %7s %7s %10s %8s  %s\n", "corpus", "mode", "threads", "chunk", "seconds", "GB/s", "check");
+	for(; i < argc; i++) {
+		counts ascii, locale;
+		if(reference_count(argv[i], 0, &ascii) != 0 || reference_count(argv[i], 1, &locale) != 0) {
+			fprintf(stderr, "[ERROR] Unable to read corpus file %s.\n", argv[i]);
+			exit(1);
+		}
+		for(int m = 0; m < (int) (sizeof(modes) / sizeof(modes[0])); m++) {
+			counts *expected = modes[m].locale ? &locale : &ascii;
+			if(!modes[m].available) {
+				printf("%-16s %-8s %7s %7s %10s %8s  skipped, not supported by this CPU\n", base_name(argv[i]),
+					   modes[m].name, "-", "-", "-", "-");
+				continue;
+			}
+			for(int t = 0; t < num_thread_counts; t++) {
+				for(int k = 0; k < num_chunks; k++) {
+					counts got;
+					double best = 0;
+					int status = 0;
+					for(int r = 0; r < (check_only ? 1 : runs); r++) {
+						double seconds;
+						status = run_wordcount(wordcount, &modes[m], thread_counts[t], chunks[k], argv[i], &got, &seconds);
+						if(status != 0) break;
+						if(r == 0 || seconds < best) best = seconds;
+					}
+					int ok = status == 0 && same_counts(&got, expected, modes[m].max_line);
+					if(!ok) mismatches++;
+					printf("%-16s %-8s %7d %7s ", base_name(argv[i]), modes[m].name, thread_counts[t], chunks[k]);
+					if(check_only) printf("%10s %8s  ", "-", "-");
+					else printf("%10.4f %8.2f  ", best, expected->bytes / best / 1e9);
+					if(ok) printf("ok\n");
+					else if(status != 0) printf("MISMATCH: wordcount failed or printed no counts\n");
+					else {
+						printf("MISMATCH: got %lu %lu %lu %lu %lu, expected %lu %lu %lu %lu %lu\n", got.lines, got.words,
+							   got.chars, got.bytes, got.max_line, expected->lines, expected->words, expected->chars,
+							   expected->bytes, expected->max_line);
+					}
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	if(mismatches > 0) {
+		printf("%d runs did not match the reference counts!\n", mismatches);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ *	This function counts a file the slow and simple way. In ASCII mode whitespace (space,
+ *	\t, \n, \v, \f, \r) ends a word, the printable characters ! to ~ start or continue one
+ *	and every other byte does neither; characters are all bytes but UTF-8 continuation
+ *	bytes; the maximum line length counts columns, tabs going to the next multiple of 8 and
+ *	\n, \r and \f starting over. In locale mode characters are decoded with mbrtowc(),
+ *	invalid bytes are skipped, the ASCII whitespace and printable whitespace and no-break
+ *	spaces end words, other printable characters start them and the rest do neither.
+ *
+ *	Parameters:
+ *		const char* name -- the file
+ *		int locale -- whether to count by the locale
+ *		counts* c -- set to the counts
+ *	Return:
+ *		If successful: 0
+ *		If failed: -1
+ */
+int reference_count(const char *name, int locale, counts *c) {
+	FILE *file = fopen(name, "rb");
+	if(file == NULL) return -1;
+	memset(c, 0, sizeof(counts));
+	// The whole file is read in first so multibyte characters never cross a buffer
+	size_t capacity = READ_SIZE;
+	size_t size = 0;
+	unsigned char *data = (unsigned char*) malloc(capacity);
+	size_t n;
+	while(data != NULL && (n = fread(data + size, 1, capacity - size, file)) > 0) {
+		size += n;
+		if(size == capacity) {
+			capacity *= 2;
+			unsigned char *bigger = (unsigned char*) realloc(data, capacity);
+			if(bigger == NULL) free(data);
+			data = bigger;
+		}
+	}
+	fclose(file);
+	if(data == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate corpus buffer.\n");
+		exit(1);
+	}
+	c->bytes = size;
+	int in_word = 0;
+	unsigned long column = 0;
+	if(!locale) {
+		for(size_t j = 0; j < size; j++) {
+			unsigned char b = data[j];
+			if(b == '\n') c->lines++;
+			if((b & 0xC0) != 0x80) c->chars++;
+			if(b > ' ' && b <= '~') {
+				if(!in_word) c->words++;
+				in_word = 1;
+			} else if(b == ' ' || b == '\t' || b == '\n' || b == '\v' || b == '\f' || b == '\r') in_word = 0;
+			if(b == '\n' || b == '\r' || b == '\f') {
+				if(column > c->max_line) c->max_line = column;
+				column = 0;
+			} else if(b == '\t') column = (column / 8 + 1) * 8;
+			else if(b >= ' ' && b <= '~') column++;
+		}
+		if(column > c->max_line) c->max_line = column;
+	} else {
+		mbstate_t state;
+		memset(&state, 0, sizeof(state));
+		size_t j = 0;
+		while(j < size) {
+			wchar_t w;
+			size_t r = mbrtowc(&w, (const char*) data + j, size - j, &state);
+			if(r == (size_t) -2) break;
+			if(r == (size_t) -1) {
+				memset(&state, 0, sizeof(state));
+				j++;
+				continue;
+			}
+			j += r > 0 ? r : 1;
+			c->chars++;
+			if(w == '\n') c->lines++;
+			// Whitespace that is not printable, like U+2028, does not end words, as in GNU wc
+			if(w == ' ' || w == '\t' || w == '\n' || w == '\v' || w == '\f' || w == '\r') in_word = 0;
+			else if(!iswprint(w)) continue;
+			else if(iswspace(w) || w == 0xA0 || w == 0x2007 || w == 0x202F || w == 0x2060) in_word = 0;
+			else {
+				if(!in_word) c->words++;
+				in_word = 1;
+			}
+		}
+	}
+	free(data);
+	return 0;
+}
+
+/*
+ *	This function runs wordcount on a file in one mode and reads the counts it prints.
+ *
+ *	Parameters:
+ *		const char* wordcount -- the program
+ *		bench_mode* mode -- the mode
+ *		int threads -- threads to count with
+ *		const char* chunk -- chunk size option
+ *		const char* name -- the file
+ *		counts* c -- set to the counts printed
+ *		double* seconds -- set to the wall time of the run
+ *	Return:
+ *		If successful: 0
+ *		If wordcount failed, crashed or its output could not be read: 1
+ */
+int run_wordcount(const char *wordcount, bench_mode *mode, int threads, const char *chunk, const char *name,
+				  counts *c, double *seconds) {
+	char command[4096];
+	snprintf(command, sizeof(command), "%s%s %s -threads %d -chunk %s '%s' 2>/dev/null",
+			 mode->locale ? "LC_ALL=C.UTF-8 " : "", wordcount, mode->options, threads, chunk, name);
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	FILE *output = popen(command, "r");
+	if(output == NULL) {
+		fprintf(stderr, "[ERROR] Unable to run %s.\n", wordcount);
+		exit(1);
+	}
+	memset(c, 0, sizeof(counts));
+	int fields = fscanf(output, "%lu %lu %lu %lu %lu", &c->lines, &c->words, &c->chars, &c->bytes, &c->max_line);
+	// Read the rest so the time covers the whole run
+	while(fgetc(output) != EOF);
+	int status = pclose(output);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	*seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	return fields >= (mode->max_line ? 5 : 4) && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : 1;
+}
+
+// Marks the kernels this CPU lacks, by the same test wordcount's find_kernel makes, so any
+// run that fails is a mismatch
+void check_kernels(void) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	modes[2].available = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") &&
+						 __builtin_cpu_supports("bmi");
+#else
+	modes[1].available = 0;
+	modes[2].available = 0;
+#endif
+}
+
+// Tells whether two counts match, the maximum line length only if it was printed
+int same_counts(counts *a, counts *b, int max_line) {
+	return a->lines == b->lines && a->words == b->words && a->chars == b->chars && a->bytes == b->bytes &&
+		   (!max_line || a->max_line == b->max_line);
+}
+
+// The file name without its directories
+const char *base_name(const char *name) {
+	const char *slash = strrchr(name, '/');
+	return slash != NULL ? slash + 1 : name;
+}
@@ -0,0 +1,226 @@
+/*
+ * Bryce Souers
+ * gen_corpus.c - Generate text to benchmark and check wordcount with.
+ * Usage: ./gen_corpus [-seed n] kind size output_file
+ *
+ *	kind			prose: words of English-like lengths with punctuation, lines of
+ *					up to 80 characters and blank lines between paragraphs
+ *					longlines: the same words with a newline only every 1M or so
+ *					binary: bytes of every value, control characters and bytes from
+ *					0x80 up included, with a little text in between
+ *					whitespace: nothing but spaces, tabs, newlines, \r, \v and \f
+ *					utf8: words of accented Latin, Greek, Cyrillic, CJK and emoji,
+ *					with combining marks, no-break spaces and ideographic spaces
+ *	size			bytes to write, with a K, M or G suffix
+ *
+ * The same seed (1 by default) always gives the same file, so results of
+ * different builds can be compared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE	(1 << 16)
+
+// Output buffered a block at a time, and the random number state
+typedef struct generator {
+	FILE *out;
+	unsigned char block[BLOCK_SIZE];
+	size_t used;
+	unsigned long written;
+	unsigned long size;
+	unsigned long random;
+	unsigned long column;
+} generator;
+
+void generate_prose(generator *g, unsigned long line_length);
+void generate_binary(generator *g);
+void generate_whitespace(generator *g);
+void generate_utf8(generator *g);
+void put_bytes(generator *g, const char *p, size_t n);
+void put_word(generator *g);
+unsigned long next_random(generator *g);
+unsigned long parse_size(const char *s);
+
+int main(int argc, char *argv[]) {
+	generator *g = (generator*) calloc(1, sizeof(generator));
+	if(g == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate generator.\n");
+		exit(1);
+	}
+	g->random = 1;
+	int i = 1;
+	if(i + 1 < argc && strcmp(argv[i], "-seed") == 0) {
+		g->random = strtoul(argv[i + 1], NULL, 10);
+		i += 2;
+	}
+	if(argc - i != 3) {
+		fprintf(stderr, "[ERROR] Usage: ./gen_corpus [-seed n] kind size output_file\n");
+		exit(1);
+	}
+	// A state of 0 would stay 0
+	if(g->random == 0) g->random = 1;
+	g->size = parse_size(argv[i + 1]);
+	if(g->size == 0) {
+		fprintf(stderr, "[ERROR] Size %s is not a size above 0.\n", argv[i + 1]);
+		exit(1);
+	}
+	g->out = fopen(argv[i + 2], "wb");
+	if(g->out == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open output file %s.\n", argv[i + 2]);
+		exit(1);
+	}
+	if(strcmp(argv[i], "prose") == 0) generate_prose(g, 80);
+	else if(strcmp(argv[i], "longlines") == 0) generate_prose(g, 1 << 20);
+	else if(strcmp(argv[i], "binary") == 0) generate_binary(g);
+	else if(strcmp(argv[i], "whitespace") == 0) generate_whitespace(g);
+	else if(strcmp(argv[i], "utf8") == 0) generate_utf8(g);
+	else {
+		fprintf(stderr, "[ERROR] Unknown kind %s.\n", argv[i]);
+		exit(1);
+	}
+	// Generators stop once the size is reached, so the last block is cut to the size
+	if(g->used > 0) fwrite(g->block, 1, g->used, g->out);
+	if(fclose(g->out) != 0) {
+		fprintf(stderr, "[ERROR] Unable to write output file %s.\n", argv[i + 2]);
+		exit(1);
+	}
+	free(g);
+	return 0;
+}
+
+/*
+ *	This function writes words separated by spaces, with punctuation now and then, a newline
+ *	when a line gets longer than line_length and a blank line every few dozen lines.
+ *
+ *	Parameters:
+ *		generator* g -- the generator
+ *		unsigned long line_length -- longest line before a newline, roughly
+ *	Return:
+ *		None
+ */
+void generate_prose(generator *g, unsigned long line_length) {
+	static const char *punctuation[] = { ",", ".", ";", "!", "?", " -", "'s", ":" };
+	while(g->written < g->size) {
+		put_word(g);
+		unsigned long r = next_random(g);
+		if(r % 8 == 0) put_bytes(g, punctuation[(r >> 8) % 8], strlen(punctuation[(r >> 8) % 8]));
+		if(g->column >= line_length) {
+			put_bytes(g, "\n\n", (r >> 16) % 32 == 0 ? 2 : 1);
+			g->column = 0;
+		} else put_bytes(g, " ", 1);
+	}
+}
+
+/*
+ *	This function writes random bytes of every value: runs of raw bytes, which wc counts
+ *	neither as word nor as space when they are control characters or from 0x80 up, mixed
+ *	with words and spaces so they fall inside and between words.
+ *
+ *	Parameters:
+ *		generator* g -- the generator
+ *	Return:
+ *		None
+ */
+void generate_binary(generator *g) {
+	while(g->written < g->size) {
+		unsigned long r = next_random(g);
+		if(r % 4 == 0) put_word(g);
+		else if(r % 4 == 1) put_bytes(g, r & 0x100 ? " " : "\n", 1);
+		else {
+			unsigned char raw[64];
+			size_t n = 1 + (r >> 8) % sizeof(raw);
+			for(size_t j = 0; j < n; j++) raw[j] = (unsigned char) (next_random(g) >> 24);
+			put_bytes(g, (const char*) raw, n);
+		}
+	}
+}
+
+/*
+ *	This function writes whitespace only, so there are lines but no words.
+ *
+ *	Parameters:
+ *		generator* g -- the generator
+ *	Return:
+ *		None
+ */
+void generate_whitespace(generator *g) {
+	static const char spaces[] = " \t\n\r\v\f     ";
+	while(g->written < g->size) put_bytes(g, &spaces[next_random(g) % (sizeof(spaces) - 1)], 1);
+}
+
+/*
+ *	This function writes words of multibyte UTF-8 characters: two-byte Latin, Greek and
+ *	Cyrillic, three-byte CJK that is two columns wide, four-byte emoji and combining
+ *	accents that take no column. Words are separated by spaces, no-break spaces (which
+ *	separate words too) and ideographic spaces.
+ *
+ *	Parameters:
+ *		generator* g -- the generator
+ *	Return:
+ *		None
+ */
+void generate_utf8(generator *g) {
+	static const char *letters[] = {
+		"a", "e", "n", "s", "t", "\xc3\xa9", "\xc3\xb6", "\xc3\xb1", "\xc3\x9f", "\xce\xb1", "\xce\xbb", "\xcf\x89",
+		"\xd0\xb4", "\xd0\xb6", "\xd1\x8f", "\xe6\x97\xa5", "\xe6\x9c\xac", "\xe8\xaa\x9e", "\xf0\x9f\x98\x80",
+		"\xf0\x9f\x8c\x8d", "\xcc\x81", "\xcc\x88"
+	};
+	static const char *separators[] = { " ", " ", " ", " ", "\n", "\t", "\xc2\xa0", "\xe3\x80\x80" };
+	int num_letters = sizeof(letters) / sizeof(letters[0]);
+	while(g->written < g->size) {
+		int length = 1 + next_random(g) % 9;
+		for(int j = 0; j < length; j++) {
+			const char *letter = letters[next_random(g) % num_letters];
+			put_bytes(g, letter, strlen(letter));
+		}
+		const char *separator = separators[next_random(g) % 8];
+		put_bytes(g, separator, strlen(separator));
+	}
+}
+
+// Writes a word of 1 to 12 lowercase letters, short words more likely, sometimes capitalized
+void put_word(generator *g) {
+	char word[12];
+	unsigned long r = next_random(g);
+	int length = 1 + (r % 5) + ((r >> 8) % 4) * ((r >> 16) % 3);
+	if(length > 12) length = 12;
+	for(int j = 0; j < length; j++) word[j] = "etaoinshrdlcumwfgypbvkjxqz"[next_random(g) % 26 % (j == 0 ? 26 : 13)];
+	if((r >> 24) % 10 == 0) word[0] -= 'a' - 'A';
+	put_bytes(g, word, length);
+}
+
+// Adds bytes to the output, leaving out what goes past the size
+void put_bytes(generator *g, const char *p, size_t n) {
+	if(n > g->size - g->written) n = g->size - g->written;
+	for(size_t j = 0; j < n; j++) {
+		g->block[g->used++] = (unsigned char) p[j];
+		if(g->used == BLOCK_SIZE) {
+			fwrite(g->block, 1, BLOCK_SIZE, g->out);
+			g->used = 0;
+		}
+	}
+	g->written += n;
+	g->column += n;
+}
+
+// xorshift64* random numbers
+unsigned long next_random(generator *g) {
+	g->random ^= g->random >> 12;
+	g->random ^= g->random << 25;
+	g->random ^= g->random >> 27;
+	return g->random * 0x2545F4914F6CDD1DUL;
+}
+
+// Parses a size with an optional K, M or G suffix, 0 when it is not one
+unsigned long parse_size(const char *s) {
+	char *end;
+	unsigned long size = strtoul(s, &end, 10);
+	if(end == s) return 0;
+	if(*end == 'K' || *end == 'k') size <<= 10;
+	else if(*end == 'M' || *end == 'm') size <<= 20;
+	else if(*end == 'G' || *end == 'g') size <<= 30;
+	else if(*end != '\0') return 0;
+	return size;
+}
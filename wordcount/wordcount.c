@@ -1,133 +1,2204 @@
 /*
  * Bryce Souers
- * wordcount.c - Use multiple processes to count words in files.
- * Usage: ./wordcount input_file1 input_file2 ...
+ * wordcount.c - Use multiple processes or threads to count words in files.
+ * Usage: ./wordcount [-threads n] [-chunk size] [-kernel name] [-lwmcL] [-locale]
+ *					   [-interval secs] [-follow] [-top k [-sketch width]]
+ *					   [-r] [-files-from list] [-order name] [-cache file]
+ *					   input_file1 input_file2 ...
+ *
+ *	-threads n		count with a pool of n threads instead of one child process per
+ *					file (0 for one thread per CPU)
+ *	-chunk size		bytes of a file one thread counts at a time, with a K, M or G
+ *					suffix (default 16M)
+ *	-kernel name	counting kernel: scalar, sse2, avx2 or auto (default), the
+ *					fastest one this CPU supports
+ *	-l -w -m -c -L	print newline, word, character, byte counts or the maximum line
+ *					length like wc does (flags combine, as in -lw); -wc prints the
+ *					default -l -w -c. Any of them counts with one thread per CPU
+ *					unless -threads says otherwise.
+ *	-locale			classify characters by the current locale (LC_ALL, LC_CTYPE or
+ *					LANG) instead of as ASCII, so Unicode whitespace separates words
+ *	-interval secs	print the counts of pipes and followed files so far every secs
+ *					seconds while they are read
+ *	-follow			keep reading files at their end for what is appended to them,
+ *					like tail -f, until interrupted; then print the counts
+ *	-top k			print the k most frequent tokens (runs of non-whitespace bytes)
+ *					with their counts instead (--top works too)
+ *	-sketch width	with -top, estimate the counts with a Count-Min Sketch of width
+ *					counters per row (K, M or G suffix) so memory stays bounded
+ *	-r				count every regular file under the directories given (the current
+ *					one when none are), not following symbolic links inside them
+ *	-files-from list	also count the files named in list, one per line ("-" reads
+ *					the names from standard input)
+ *	-order name		order of the files in batch mode: inode (default), size or none
+ *	-cache file		keep the counts of regular files in file and reuse them when the
+ *					files are counted again (implies threaded mode)
+ *
+ * "-" stands for standard input, which is also what is counted when fields are
+ * selected and no files are given. -r and -files-from are batch mode, for many
+ * thousands of files, counted by the pool of threads and reported in files/s.
+ *
+ * Counts follow GNU wc: whitespace (space, \t, \n, \v, \f, \r) ends a word,
+ * printable characters start or continue one, and other bytes do neither.
+ * Characters are UTF-8 code points. With -locale characters are decoded with
+ * mbrtowc(), iswspace() and no-break spaces separate words and wcwidth() gives
+ * the columns of -L.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <locale.h>
+#include <wchar.h>
+#include <wctype.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define READ_SIZE		(1 << 20)
+#define DEFAULT_CHUNK	(16UL << 20)
+#define FOLLOW_POLL_US	100000
+#define SKETCH_DEPTH	4
+#define SMALL_FILE		(64 << 10)
+#define BATCH_FILES		64
+#define CHILDREN_PER_CPU	4
+#define CACHE_MAGIC		0x3145484341435757UL
+#define CACHE_TAIL		4096
+
+// Orders of the files of batch mode, ORDER_DEFAULT until -order picks one
+#define ORDER_DEFAULT	-1
+#define ORDER_NONE		0
+#define ORDER_INODE		1
+#define ORDER_SIZE		2
+
+// Output fields, in the order wc prints them
+#define FIELD_LINES		0x01
+#define FIELD_WORDS		0x02
+#define FIELD_CHARS		0x04
+#define FIELD_BYTES		0x08
+#define FIELD_MAX_LINE	0x10
+
+// Counts of a file or a part of it
+typedef struct counts {
+	unsigned long lines;
+	unsigned long words;
+	unsigned long chars;
+	unsigned long bytes;
+	unsigned long max_line;
+} counts;
+
+// What a kernel carries from one block to the next. in_word tells whether the last
+// space or word byte was a word byte; leading is -1 until the first of them is seen
+// and then whether it was a word byte, which is what joining a chunk to the one before
+// it needs to know. line_pos and mb are only used by the -L and -locale kernels.
+typedef struct count_state {
+	int in_word;
+	int leading;
+	unsigned long line_pos;
+	mbstate_t mb;
+} count_state;
+
+// A file given on the command line and its totals; -top keeps the whole file in data.
+// With -cache, counting starts at start from the cached start_state (start is the size
+// for a file that has not changed), and end_state is what the cache keeps for next time.
+typedef struct file_job {
+	char *name;
+	off_t size;
+	dev_t device;
+	ino_t inode;
+	struct timespec mtime;
+	int regular;
+	int error;
+	off_t start;
+	count_state start_state;
+	count_state end_state;
+	counts total;
+	const unsigned char *data;
+	size_t data_size;
+	int mapped;
+} file_job;
+
+// A byte range of a file for one worker to count, and its counts as if it were the
+// start of the file. A batch of small files is one chunk too: batch files from file on
+// are read whole, and their counts go straight to the files.
+typedef struct chunk {
+	int file;
+	int batch;
+	off_t offset;
+	off_t length;
+	int error;
+	counts total;
+	count_state state;
+} chunk;
+
+// Counts a block of bytes, carrying the state across blocks
+typedef void (*count_kernel)(const unsigned char *p, size_t n, counts *c, count_state *s);
+
+// The work queue shared by the threads: workers take the next chunk until none are left
+typedef struct work_queue {
+	file_job *files;
+	chunk *chunks;
+	int num_chunks;
+	int next;
+	pthread_mutex_t lock;
+} work_queue;
+
+// One of the two buffers of a stream: full once the reader filled it, until the counter
+// hands it back. A length of 0 marks the end of the stream, -1 a read error.
+typedef struct stream_buffer {
+	unsigned char *data;
+	ssize_t length;
+	int full;
+} stream_buffer;
+
+// A file read by a reader thread while another thread counts
+typedef struct stream {
+	int fd;
+	int error;
+	stream_buffer buffers[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} stream;
+
+// A distinct token of -top and its count. The key points into the file data. heap_index
+// is the entry's position in the candidate heap of -sketch.
+typedef struct token_entry {
+	const unsigned char *key;
+	unsigned int length;
+	int heap_index;
+	unsigned long hash;
+	unsigned long count;
+} token_entry;
 
-char *read_line();
-int get_word_count(char *file_name);
+// Open-addressing hash table of tokens
+typedef struct token_table {
+	unsigned int *slots;
+	unsigned long capacity;
+	token_entry *entries;
+	unsigned long size;
+	unsigned long entry_capacity;
+} token_table;
+
+// Count-Min Sketch of -sketch: SKETCH_DEPTH rows of width counters
+typedef struct token_sketch {
+	unsigned long *counters;
+	unsigned long width;
+} token_sketch;
+
+// What each -top thread counts into: a table of every token, or with -sketch a sketch and
+// a table of the k candidates ordered by heap
+typedef struct top_worker {
+	work_queue *queue;
+	int k;
+	unsigned long tokens;
+	token_table table;
+	token_sketch sketch;
+	int *heap;
+} top_worker;
+
+// A file in the result cache, found by device and inode. The counts and the state at
+// its end are valid as long as it has the same size and modification time; when it
+// grew and the CACHE_TAIL bytes before the cached size still hash to tail_hash, it was
+// appended to and only the new bytes are counted. mode tells which kernel counted it,
+// 0 for an empty slot, and counted is when, to catch files changed within the second.
+typedef struct cache_entry {
+	unsigned long device;
+	unsigned long inode;
+	unsigned long size;
+	long mtime_sec;
+	long mtime_nsec;
+	long counted;
+	unsigned long tail_hash;
+	counts total;
+	unsigned long line_pos;
+	mbstate_t mb;
+	int in_word;
+	int mode;
+} cache_entry;
+
+// The cache file: this header, then a hash table of capacity entries
+typedef struct cache_header {
+	unsigned long magic;
+	unsigned long entry_size;
+	unsigned long capacity;
+	unsigned long size;
+} cache_header;
+
+// The mapped cache and what it did this run
+typedef struct result_cache {
+	int fd;
+	cache_header *header;
+	cache_entry *entries;
+	size_t map_size;
+	int hits;
+	int appends;
+} result_cache;
+
+// File names collected from directories and file lists
+typedef struct file_list {
+	char **names;
+	int size;
+	int capacity;
+} file_list;
+
+// Byte classes of the ASCII kernels
+#define CLASS_OTHER		0
+#define CLASS_SPACE		1
+#define CLASS_WORD		2
+
+long get_word_count(char *file_name);
+int count_with_processes(int num_files, char *file_names[]);
+int count_with_threads(int num_files, char *file_names[], int num_threads, unsigned long chunk_size, int fields);
+void build_queue(work_queue *queue, int num_files, char *file_names[], unsigned long chunk_size, int whole_files);
+void *count_worker(void *arg);
+int compare_files(const void *a, const void *b);
+void count_batch(work_queue *queue, chunk *c, unsigned char *buffer);
+void walk_directory(const char *path, file_list *list);
+void read_file_list(const char *name, file_list *list);
+void list_add(file_list *list, const char *name);
+double elapsed_seconds(struct timespec *start);
+void cache_open(const char *path);
+void cache_map(unsigned long capacity);
+cache_entry *cache_find(unsigned long device, unsigned long inode);
+void cache_check(file_job *file);
+void cache_store(file_job *file);
+unsigned long tail_hash(const char *name, off_t end);
+int cache_mode(void);
+int count_top(int num_files, char *file_names[], int num_threads, unsigned long chunk_size, int k, unsigned long sketch_width);
+void *top_worker_run(void *arg);
+unsigned long token_hash(const unsigned char *p, size_t n);
+void table_init(token_table *t, unsigned long capacity);
+void table_free(token_table *t);
+token_entry *table_find(token_table *t, const unsigned char *key, unsigned int length, unsigned long hash, int create);
+void table_grow(token_table *t);
+void table_unlink(token_table *t, unsigned long entry);
+void sketch_init(token_sketch *s, unsigned long width);
+unsigned long sketch_estimate(token_sketch *s, unsigned long hash);
+void sketch_add(top_worker *w, const unsigned char *key, unsigned int length, unsigned long hash);
+int token_less(token_entry *a, token_entry *b);
+void heap_up(token_entry *entries, int *heap, int i);
+void heap_down(token_entry *entries, int *heap, int size, int i);
+int map_input(file_job *file);
+void unmap_input(file_job *file);
+int count_range(int fd, off_t offset, off_t length, unsigned char *buffer, counts *c, count_state *s);
+int count_stream(int fd, const char *name, counts *c, count_state *s);
+void *stream_reader(void *arg);
+void report_stream(const char *name, counts *c, count_state *s);
+int open_input(const char *name);
+int stat_input(const char *name, struct stat *st);
+void request_stop(int sig);
+void count_join(counts *total, count_state *state, counts *c, count_state *s);
+void print_counts(counts *c, int fields, int width, const char *name);
+void count_words_scalar(const unsigned char *p, size_t n, counts *c, count_state *s);
+#if defined(__x86_64__)
+void count_words_sse2(const unsigned char *p, size_t n, counts *c, count_state *s);
+void count_words_avx2(const unsigned char *p, size_t n, counts *c, count_state *s);
+#endif
+void count_columns(const unsigned char *p, size_t n, counts *c, count_state *s);
+void count_locale(const unsigned char *p, size_t n, counts *c, count_state *s);
+count_kernel find_kernel(const char *name);
+unsigned long parse_size(const char *s);
+
+// The kernel every process and thread counts with, and the byte classes it uses
+count_kernel kernel;
+unsigned char byte_class[256];
+
+// Streaming: the report interval and fields, whether to follow files, and whether an
+// interrupt asked the readers to stop following
+double report_interval;
+int report_fields;
+int follow_files;
+volatile sig_atomic_t stop_requested;
+
+// Batch mode: the order files are counted in, and whether to report the throughput
+int file_order = ORDER_DEFAULT;
+int report_throughput;
+
+// The result cache of -cache, when one is open
+result_cache *cache;
 
 int main(int argc, char *argv[]) {
-	// Loop that creates a new child process for each given argument in argv.
-	for(int i = 1; i < argc; i++) {
-		if(fork() == 0) {
-			/*
-			 *	Get word count of the file in the child process and deal with errors.
-			 *	Each child process exits with a code of success (0) or failure (1).
-			 */
-			int wc = get_word_count(argv[i]);
-			if(wc != -1) {
-				printf("Child process %d for %s: number of words is %d\n", getpid(), argv[i], wc);
-				exit(0);
+	int num_threads = -1;
+	unsigned long chunk_size = DEFAULT_CHUNK;
+	int fields = 0;
+	int use_locale = 0;
+	int top = 0;
+	unsigned long sketch_width = 0;
+	int recursive = 0;
+	char *list_name = NULL;
+	char *cache_path = NULL;
+	int i = 1;
+	for(int b = 0; b < 256; b++) {
+		if(b == ' ' || (b >= '\t' && b <= '\r')) byte_class[b] = CLASS_SPACE;
+		else if(b > ' ' && b < 0x7F) byte_class[b] = CLASS_WORD;
+		else byte_class[b] = CLASS_OTHER;
+	}
+	kernel = find_kernel("auto");
+	// Options come before the file names
+	while(i < argc && argv[i][0] == '-') {
+		// Output fields, which may be combined like wc's
+		if(strcmp(argv[i], "-wc") == 0) {
+			fields |= FIELD_LINES | FIELD_WORDS | FIELD_BYTES;
+			i++;
+			continue;
+		}
+		if(strspn(argv[i] + 1, "lwmcL") == strlen(argv[i] + 1) && argv[i][1] != '\0') {
+			for(char *f = argv[i] + 1; *f != '\0'; f++) {
+				if(*f == 'l') fields |= FIELD_LINES;
+				else if(*f == 'w') fields |= FIELD_WORDS;
+				else if(*f == 'm') fields |= FIELD_CHARS;
+				else if(*f == 'c') fields |= FIELD_BYTES;
+				else fields |= FIELD_MAX_LINE;
+			}
+			i++;
+			continue;
+		}
+		if(strcmp(argv[i], "-locale") == 0) {
+			use_locale = 1;
+			i++;
+			continue;
+		}
+		if(strcmp(argv[i], "-follow") == 0) {
+			follow_files = 1;
+			i++;
+			continue;
+		}
+		if(strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "-recursive") == 0) {
+			recursive = 1;
+			i++;
+			continue;
+		}
+		// A lone "-" is standard input, the first file name
+		if(argv[i][1] == '\0') break;
+		if(i + 1 >= argc) {
+			fprintf(stderr, "[ERROR] Missing value for %s.\n", argv[i]);
+			exit(1);
+		}
+		if(strcmp(argv[i], "-threads") == 0) {
+			num_threads = atoi(argv[i + 1]);
+			if(num_threads < 0) {
+				fprintf(stderr, "[ERROR] -threads expects a count of 0 or more.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-chunk") == 0) {
+			chunk_size = parse_size(argv[i + 1]);
+			if(chunk_size == 0) {
+				fprintf(stderr, "[ERROR] -chunk expects a size above 0.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-top") == 0 || strcmp(argv[i], "--top") == 0) {
+			top = atoi(argv[i + 1]);
+			if(top <= 0) {
+				fprintf(stderr, "[ERROR] -top expects a count above 0.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-cache") == 0) {
+			cache_path = argv[i + 1];
+		} else if(strcmp(argv[i], "-files-from") == 0) {
+			list_name = argv[i + 1];
+		} else if(strcmp(argv[i], "-order") == 0) {
+			if(strcmp(argv[i + 1], "inode") == 0) file_order = ORDER_INODE;
+			else if(strcmp(argv[i + 1], "size") == 0) file_order = ORDER_SIZE;
+			else if(strcmp(argv[i + 1], "none") == 0) file_order = ORDER_NONE;
+			else {
+				fprintf(stderr, "[ERROR] -order expects inode, size or none.\n");
+				exit(1);
 			}
-			printf("Child process %d for %s: does not exist\n", getpid(), argv[i]);
+		} else if(strcmp(argv[i], "-sketch") == 0) {
+			sketch_width = parse_size(argv[i + 1]);
+			if(sketch_width == 0) {
+				fprintf(stderr, "[ERROR] -sketch expects a width above 0.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-interval") == 0) {
+			report_interval = atof(argv[i + 1]);
+			if(report_interval <= 0) {
+				fprintf(stderr, "[ERROR] -interval expects a number of seconds above 0.\n");
+				exit(1);
+			}
+		} else if(strcmp(argv[i], "-kernel") == 0) {
+			kernel = find_kernel(argv[i + 1]);
+			if(kernel == NULL) {
+				fprintf(stderr, "[ERROR] Kernel %s is unknown or not supported by this CPU.\n", argv[i + 1]);
+				exit(1);
+			}
+		} else {
+			fprintf(stderr, "[ERROR] Unknown option %s.\n", argv[i]);
+			exit(1);
+		}
+		i += 2;
+	}
+	// Line lengths and multibyte characters are followed a byte at a time
+	if(use_locale) {
+		setlocale(LC_ALL, "");
+		kernel = count_locale;
+	} else if(fields & FIELD_MAX_LINE) kernel = count_columns;
+	report_fields = fields;
+	if(follow_files) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = request_stop;
+		sigaction(SIGINT, &action, NULL);
+		sigaction(SIGTERM, &action, NULL);
+	}
+	int streaming = follow_files || report_interval > 0;
+	// Batch mode: count the files under directories and the files of a list, in inode order
+	// unless told otherwise, with the pool of threads
+	int num_files = argc - i;
+	char **file_names = argv + i;
+	file_list list = { NULL, 0, 0 };
+	if(recursive || list_name != NULL) {
+		if(streaming) {
+			fprintf(stderr, "[ERROR] -r and -files-from cannot be combined with -follow or -interval.\n");
 			exit(1);
 		}
+		for(; i < argc; i++) {
+			struct stat st;
+			if(recursive && stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) walk_directory(argv[i], &list);
+			else list_add(&list, argv[i]);
+		}
+		if(list_name != NULL) read_file_list(list_name, &list);
+		else if(num_files == 0) walk_directory(".", &list);
+		num_files = list.size;
+		file_names = list.names;
+		if(file_order == ORDER_DEFAULT) file_order = ORDER_INODE;
+		report_throughput = 1;
+		if(num_threads < 0) num_threads = 0;
 	}
+	if(file_order == ORDER_DEFAULT) file_order = ORDER_NONE;
+	if(top > 0 && (streaming || fields != 0 || use_locale)) {
+		fprintf(stderr, "[ERROR] -top cannot be combined with -follow, -interval, -locale or count fields.\n");
+		exit(1);
+	}
+	if(cache_path != NULL && top > 0) {
+		fprintf(stderr, "[ERROR] -cache cannot be combined with -top.\n");
+		exit(1);
+	}
+	if(sketch_width > 0 && top == 0) {
+		fprintf(stderr, "[ERROR] -sketch needs -top.\n");
+		exit(1);
+	}
+	if(cache_path != NULL) {
+		cache_open(cache_path);
+		if(num_threads < 0) num_threads = 0;
+	}
+	if(num_threads < 0 && fields == 0 && !streaming && top == 0) return count_with_processes(num_files, file_names);
+	if(num_threads <= 0) num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_threads < 1) num_threads = 1;
+	// Without files count standard input, printed without a name like wc does
+	if(num_files == 0 && file_names == argv + i) {
+		char *standard_input[] = { NULL };
+		if(top > 0) return count_top(1, standard_input, num_threads, chunk_size, top, sketch_width);
+		return count_with_threads(1, standard_input, num_threads, chunk_size, fields);
+	}
+	int status;
+	if(top > 0) status = count_top(num_files, file_names, num_threads, chunk_size, top, sketch_width);
+	else status = count_with_threads(num_files, file_names, num_threads, chunk_size, fields);
+	for(i = 0; i < list.size; i++) free(list.names[i]);
+	free(list.names);
+	return status;
+}
+
+/*
+ *	This function creates a new child process to count the words of each file and waits for them.
+ *
+ *	Parameters:
+ *		int num_files -- number of file names
+ *		char* file_names[] -- file names to count
+ *	Return:
+ *		0
+ */
+int count_with_processes(int num_files, char *file_names[]) {
 	// Local variables for parent process to keep track of children's success
 	int status = 0;
 	pid_t child_pid;
 	int num_proccesses = 0;
 	int num_successful = 0;
 	int num_failed = 0;
+	// At most a few children per CPU run at once; the next one starts when one exits
+	long max_children = sysconf(_SC_NPROCESSORS_ONLN) * CHILDREN_PER_CPU;
+	if(max_children < 1) max_children = CHILDREN_PER_CPU;
+	int running = 0;
+	// Loop that creates a new child process for each given file name.
+	for(int i = 0; i < num_files; i++) {
+		if(running == max_children && wait(&status) > 0) {
+			running--;
+			num_proccesses++;
+			if(status == 0) num_successful++;
+			else num_failed++;
+		}
+		fflush(stdout);
+		pid_t pid = fork();
+		if(pid > 0) running++;
+		else if(pid < 0) {
+			fprintf(stderr, "[ERROR] Unable to create a child process for %s.\n", file_names[i]);
+			exit(1);
+		} else {
+			/*
+			 *	Get word count of the file in the child process and deal with errors.
+			 *	Each child process exits with a code of success (0) or failure (1).
+			 */
+			long wc = get_word_count(file_names[i]);
+			if(wc != -1) {
+				printf("Child process %d for %s: number of words is %ld\n", getpid(), file_names[i], wc);
+				exit(0);
+			}
+			printf("Child process %d for %s: does not exist\n", getpid(), file_names[i]);
+			exit(1);
+		}
+	}
 	// Parent waits for each child process
 	while((child_pid = wait(&status)) > 0) {
-		// Increment local variables accordingly by checking the exit status 
+		// Increment local variables accordingly by checking the exit status
 		num_proccesses++;
 		if(status == 0) num_successful++;
 		else num_failed++;
 	}
 	// Print out the results from the parent process
-	printf("Parent proccess created %d child processes to count words in %d files\n", num_proccesses, (argc - 1));
+	printf("Parent proccess created %d child processes to count words in %d files\n", num_proccesses, num_files);
 	printf("\t%d files have been counted successfully!\n", num_successful);
 	printf("\t%d files did not exist!\n", num_failed);
 	return 0;
 }
 
 /*
- *	This function takes in a file name then tries to open it and count the words in the file.
+ *	This function splits the files into chunks, counts them with a pool of threads and
+ *	prints the counts of each file and the total: the selected fields like wc, or just
+ *	the words when no fields were selected. All chunks share one work queue, so a single
+ *	huge file keeps every thread busy and many small files share them; the counts are
+ *	exact however the files are cut, since each chunk carries its state into the join.
  *
  *	Parameters:
- *		char* file_name -- file name to try to open
+ *		int num_files -- number of file names
+ *		char* file_names[] -- file names to count
+ *		int num_threads -- number of worker threads
+ *		unsigned long chunk_size -- largest byte range one worker counts at a time
+ *		int fields -- FIELD_ flags to print, or 0
  *	Return:
- *		If successful: int with number of words in file
- *		If failed: -1
+ *		0 if every file was counted, otherwise 1
+ */
+int count_with_threads(int num_files, char *file_names[], int num_threads, unsigned long chunk_size, int fields) {
+	work_queue queue;
+	int i, f;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	// Kernels that follow lines or multibyte characters need whole files
+	build_queue(&queue, num_files, file_names, chunk_size, kernel == count_columns || kernel == count_locale);
+	// No point in more threads than chunks, and every followed file needs a thread of its own
+	if(num_threads > queue.num_chunks || follow_files) num_threads = queue.num_chunks > 0 ? queue.num_chunks : 1;
+	pthread_t *threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+	if(threads == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate threads.\n");
+		exit(1);
+	}
+	for(i = 0; i < num_threads; i++) {
+		if(pthread_create(&threads[i], NULL, count_worker, &queue) != 0) {
+			fprintf(stderr, "[ERROR] Unable to create thread.\n");
+			exit(1);
+		}
+	}
+	for(i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&queue.lock);
+	// Join the chunks of every file in order, then add up the files
+	count_state state;
+	for(i = 0; i < queue.num_chunks; i++) {
+		chunk *c = &queue.chunks[i];
+		file_job *file = &queue.files[c->file];
+		if(c->batch > 0) continue;
+		if(c->offset == file->start) state = file->start_state;
+		if(c->error) file->error = c->error;
+		count_join(&file->total, &state, &c->total, &c->state);
+		file->end_state = state;
+		file->end_state.line_pos = c->state.line_pos;
+		file->end_state.mb = c->state.mb;
+	}
+	if(cache != NULL) {
+		for(f = 0; f < num_files; f++) {
+			if(!queue.files[f].error && queue.files[f].regular) cache_store(&queue.files[f]);
+		}
+	}
+	counts total;
+	memset(&total, 0, sizeof(total));
+	int num_successful = 0;
+	// Numbers line up like wc's: as wide as the total size of the regular files, at least 7
+	// wide when one of the files is not regular and unpadded for one field of one file
+	int width = 1;
+	if(num_files > 1 || (fields & (fields - 1)) != 0) {
+		unsigned long regular_total = 0;
+		int minimum_width = 1;
+		for(f = 0; f < num_files; f++) {
+			if(queue.files[f].error) continue;
+			if(queue.files[f].regular) regular_total += queue.files[f].size;
+			else minimum_width = 7;
+		}
+		for(; regular_total >= 10; regular_total /= 10) width++;
+		if(width < minimum_width) width = minimum_width;
+	}
+	for(f = 0; f < num_files; f++) {
+		file_job *file = &queue.files[f];
+		if(file->error) {
+			const char *name = file->name != NULL ? file->name : "-";
+			if(fields) fprintf(stderr, "wordcount: %s: %s\n", name, strerror(file->error));
+			else printf("%s: does not exist\n", name);
+			continue;
+		}
+		if(fields) print_counts(&file->total, fields, width, file->name);
+		else printf("%s: number of words is %lu\n", file->name != NULL ? file->name : "-", file->total.words);
+		total.lines += file->total.lines;
+		total.words += file->total.words;
+		total.chars += file->total.chars;
+		total.bytes += file->total.bytes;
+		if(file->total.max_line > total.max_line) total.max_line = file->total.max_line;
+		num_successful++;
+	}
+	double seconds = elapsed_seconds(&start);
+	if(fields) {
+		if(num_files > 1) print_counts(&total, fields, width, "total");
+	} else {
+		printf("%d threads counted %lu words in %lu bytes (%d chunks of up to %lu bytes)\n", num_threads, total.words,
+			   total.bytes, queue.num_chunks, chunk_size);
+		printf("\t%d files have been counted successfully!\n", num_successful);
+		printf("\t%d files did not exist!\n", num_files - num_successful);
+		if(cache != NULL) {
+			printf("\t%d files were unchanged since they were cached, %d were counted from where they were appended to!\n",
+				   cache->hits, cache->appends);
+		}
+	}
+	// Throughput goes to standard error when standard output looks like wc's
+	if(report_throughput) {
+		fprintf(fields ? stderr : stdout, "%d files, %.1f MB in %.3f seconds: %.0f files/s, %.1f MB/s\n", num_successful,
+				total.bytes / 1048576.0, seconds, num_successful / seconds, total.bytes / 1048576.0 / seconds);
+	}
+	free(threads);
+	free(queue.chunks);
+	free(queue.files);
+	return fields && num_successful < num_files ? 1 : 0;
+}
+
+/*
+ *	This function fills the work queue: it looks up every file and cuts the regular ones
+ *	into chunks. Files that cannot be counted keep their error and get no chunk.
+ *
+ *	Parameters:
+ *		work_queue* queue -- the queue to fill
+ *		int num_files -- number of file names
+ *		char* file_names[] -- file names to count
+ *		unsigned long chunk_size -- largest byte range of a chunk
+ *		int whole_files -- whether every file is a single chunk
+ *	Return:
+ *		None
+ */
+void build_queue(work_queue *queue, int num_files, char *file_names[], unsigned long chunk_size, int whole_files) {
+	int f;
+	queue->files = (file_job*) calloc(num_files > 0 ? num_files : 1, sizeof(file_job));
+	if(queue->files == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate file list.\n");
+		exit(1);
+	}
+	// Every file gets at least one chunk, so empty files are reported too
+	long total_chunks = 0;
+	for(f = 0; f < num_files; f++) {
+		struct stat st;
+		queue->files[f].name = file_names[f];
+		if(stat_input(file_names[f], &st) != 0) {
+			queue->files[f].error = errno;
+			continue;
+		}
+		if(S_ISDIR(st.st_mode)) {
+			queue->files[f].error = EISDIR;
+			continue;
+		}
+		// Followed files are streamed like pipes
+		queue->files[f].regular = S_ISREG(st.st_mode) && !follow_files;
+		queue->files[f].size = queue->files[f].regular ? st.st_size : 0;
+		queue->files[f].device = st.st_dev;
+		queue->files[f].inode = st.st_ino;
+		queue->files[f].mtime = st.st_mtim;
+		if(cache != NULL && queue->files[f].regular) cache_check(&queue->files[f]);
+		off_t remaining = queue->files[f].size - queue->files[f].start;
+		if(!queue->files[f].regular || whole_files || remaining == 0) total_chunks++;
+		else total_chunks += (remaining + chunk_size - 1) / chunk_size;
+	}
+	// Files laid out in inode order are mostly read in disk order, and going by size puts
+	// the small files together
+	if(file_order != ORDER_NONE) qsort(queue->files, num_files, sizeof(file_job), compare_files);
+	queue->chunks = (chunk*) malloc((total_chunks > 0 ? total_chunks : 1) * sizeof(chunk));
+	if(queue->chunks == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate work queue.\n");
+		exit(1);
+	}
+	queue->num_chunks = 0;
+	for(f = 0; f < num_files; f++) {
+		file_job *file = &queue->files[f];
+		if(file->error) continue;
+		// Files that did not change since they were cached are not read at all
+		if(file->regular && file->start == file->size && file->size > 0) continue;
+		// Runs of small files are read whole in batches of up to BATCH_FILES files and
+		// READ_SIZE bytes
+		if(file->regular && file->size <= SMALL_FILE) {
+			chunk *c = &queue->chunks[queue->num_chunks++];
+			memset(c, 0, sizeof(chunk));
+			c->file = f;
+			c->batch = 1;
+			c->length = file->size;
+			while(f + 1 < num_files && c->batch < BATCH_FILES) {
+				file_job *next = &queue->files[f + 1];
+				if(next->error || !next->regular || next->size > SMALL_FILE || c->length + next->size > READ_SIZE) break;
+				if(next->start == next->size && next->size > 0) break;
+				c->length += next->size;
+				c->batch++;
+				f++;
+			}
+			continue;
+		}
+		// Anything but a regular file is read as a stream by a single chunk of length -1
+		off_t limit = file->regular && !whole_files ? (off_t) chunk_size : file->size;
+		off_t offset = file->start;
+		do {
+			chunk *c = &queue->chunks[queue->num_chunks++];
+			memset(c, 0, sizeof(chunk));
+			c->file = f;
+			c->offset = offset;
+			c->length = !file->regular ? -1 : file->size - offset < limit ? file->size - offset : limit;
+			offset += c->length;
+		} while(file->regular && offset < file->size);
+	}
+	queue->next = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+}
+
+/*
+ *	This function is run by each thread: it takes chunks off the queue and counts them until
+ *	the queue is empty. The last file opened stays open, so the chunks of a large file that
+ *	one thread picks up in a row share a descriptor.
+ *
+ *	Parameters:
+ *		void* arg -- the work_queue
+ *	Return:
+ *		NULL
+ */
+void *count_worker(void *arg) {
+	work_queue *queue = (work_queue*) arg;
+	unsigned char *buffer = (unsigned char*) malloc(READ_SIZE);
+	int open_file = -1;
+	int fd = -1;
+	if(buffer == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate read buffer.\n");
+		exit(1);
+	}
+	for(;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next < queue->num_chunks ? queue->next++ : -1;
+		pthread_mutex_unlock(&queue->lock);
+		if(i < 0) break;
+		chunk *c = &queue->chunks[i];
+		if(c->batch > 0) {
+			count_batch(queue, c, buffer);
+			continue;
+		}
+		if(c->file != open_file) {
+			if(fd >= 0) close(fd);
+			fd = open_input(queue->files[c->file].name);
+			open_file = c->file;
+			// Ask for aggressive read-ahead on the whole file
+			if(fd >= 0 && queue->files[c->file].regular) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+		c->state.leading = -1;
+		// A file counted from where the cache left off goes on with the line and character
+		// it was in the middle of
+		if(c->offset == queue->files[c->file].start && c->offset > 0) {
+			c->state.line_pos = queue->files[c->file].start_state.line_pos;
+			c->state.mb = queue->files[c->file].start_state.mb;
+		}
+		if(fd < 0) c->error = errno;
+		else if(c->length < 0) {
+			if(count_stream(fd, queue->files[c->file].name, &c->total, &c->state) != 0) c->error = errno;
+		} else if(count_range(fd, c->offset, c->length, buffer, &c->total, &c->state) != 0) c->error = errno ? errno : EIO;
+	}
+	if(fd >= 0) close(fd);
+	free(buffer);
+	return NULL;
+}
+
+/*
+ *	This function counts a batch of small files. All of them are opened first and the
+ *	kernel is told they will be needed, so their reads are queued together, and then each
+ *	is read whole with one read() into the buffer and counted.
+ *
+ *	Parameters:
+ *		work_queue* queue -- the work queue
+ *		chunk* c -- the batch
+ *		unsigned char* buffer -- READ_SIZE bytes to read into
+ *	Return:
+ *		None
+ */
+void count_batch(work_queue *queue, chunk *c, unsigned char *buffer) {
+	int fds[BATCH_FILES];
+	int b;
+	for(b = 0; b < c->batch; b++) {
+		file_job *file = &queue->files[c->file + b];
+		fds[b] = open_input(file->name);
+		if(fds[b] < 0) file->error = errno;
+		else if(file->size > 0) posix_fadvise(fds[b], 0, 0, POSIX_FADV_WILLNEED);
+	}
+	for(b = 0; b < c->batch; b++) {
+		file_job *file = &queue->files[c->file + b];
+		if(fds[b] < 0) continue;
+		counts total;
+		count_state state, s;
+		memset(&total, 0, sizeof(total));
+		memset(&state, 0, sizeof(state));
+		memset(&s, 0, sizeof(s));
+		s.leading = -1;
+		// Read to the end, which is past the size it had if it grew since
+		ssize_t n;
+		while((n = read(fds[b], buffer, READ_SIZE)) > 0) {
+			kernel(buffer, n, &total, &s);
+			total.bytes += n;
+		}
+		if(n < 0) file->error = errno;
+		count_join(&file->total, &state, &total, &s);
+		file->end_state = state;
+		file->end_state.line_pos = s.line_pos;
+		file->end_state.mb = s.mb;
+		close(fds[b]);
+	}
+}
+
+/*
+ *	This function opens the result cache, creating it when it does not exist, and maps it.
+ *	The cache stays locked until the program exits, so runs sharing it take turns. A file
+ *	that is not a cache of this build is started over.
+ *
+ *	Parameters:
+ *		const char* path -- the cache file
+ *	Return:
+ *		None
+ */
+void cache_open(const char *path) {
+	cache = (result_cache*) calloc(1, sizeof(result_cache));
+	if(cache == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate cache.\n");
+		exit(1);
+	}
+	cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(cache->fd < 0 || flock(cache->fd, LOCK_EX) != 0) {
+		fprintf(stderr, "[ERROR] Unable to open cache %s.\n", path);
+		exit(1);
+	}
+	struct stat st;
+	cache_header header;
+	memset(&header, 0, sizeof(header));
+	if(fstat(cache->fd, &st) == 0 && st.st_size >= (off_t) sizeof(header)) {
+		if(pread(cache->fd, &header, sizeof(header), 0) != sizeof(header)) memset(&header, 0, sizeof(header));
+	}
+	int valid = header.magic == CACHE_MAGIC && header.entry_size == sizeof(cache_entry) && header.capacity > 0 &&
+				(header.capacity & (header.capacity - 1)) == 0 &&
+				st.st_size == (off_t) (sizeof(cache_header) + header.capacity * sizeof(cache_entry));
+	if(!valid && ftruncate(cache->fd, 0) != 0) {
+		fprintf(stderr, "[ERROR] Unable to reset cache %s.\n", path);
+		exit(1);
+	}
+	cache_map(valid ? header.capacity : 1024);
+}
+
+/*
+ *	This function maps the cache file with room for capacity entries, growing the file as
+ *	needed. New entries are zero, that is empty.
+ *
+ *	Parameters:
+ *		unsigned long capacity -- number of entries, a power of 2
+ *	Return:
+ *		None
+ */
+void cache_map(unsigned long capacity) {
+	size_t map_size = sizeof(cache_header) + capacity * sizeof(cache_entry);
+	if(ftruncate(cache->fd, map_size) != 0) {
+		fprintf(stderr, "[ERROR] Unable to grow cache.\n");
+		exit(1);
+	}
+	void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+	if(map == MAP_FAILED) {
+		fprintf(stderr, "[ERROR] Unable to map cache.\n");
+		exit(1);
+	}
+	cache->header = (cache_header*) map;
+	cache->entries = (cache_entry*) (cache->header + 1);
+	cache->map_size = map_size;
+	if(cache->header->magic != CACHE_MAGIC) {
+		cache->header->magic = CACHE_MAGIC;
+		cache->header->entry_size = sizeof(cache_entry);
+		cache->header->size = 0;
+	}
+	cache->header->capacity = capacity;
+}
+
+/*
+ *	This function finds the cache entry of a file, or the empty slot it would go in. The
+ *	table is doubled when it gets over half full.
+ *
+ *	Parameters:
+ *		unsigned long device -- device of the file
+ *		unsigned long inode -- inode of the file
+ *	Return:
+ *		The entry, with mode 0 when the file is not cached
+ */
+cache_entry *cache_find(unsigned long device, unsigned long inode) {
+	if(2 * (cache->header->size + 1) > cache->header->capacity) {
+		// Move the entries out, map a bigger file and put them back
+		unsigned long capacity = cache->header->capacity;
+		cache_entry *old = (cache_entry*) malloc(capacity * sizeof(cache_entry));
+		if(old == NULL) {
+			fprintf(stderr, "[ERROR] Unable to grow cache.\n");
+			exit(1);
+		}
+		memcpy(old, cache->entries, capacity * sizeof(cache_entry));
+		memset(cache->entries, 0, capacity * sizeof(cache_entry));
+		munmap(cache->header, cache->map_size);
+		cache_map(2 * capacity);
+		for(unsigned long j = 0; j < capacity; j++) {
+			if(old[j].mode == 0) continue;
+			*cache_find(old[j].device, old[j].inode) = old[j];
+		}
+		free(old);
+	}
+	unsigned long mask = cache->header->capacity - 1;
+	unsigned long key[2] = { device, inode };
+	unsigned long i = token_hash((const unsigned char*) key, sizeof(key)) & mask;
+	while(cache->entries[i].mode != 0 && (cache->entries[i].device != device || cache->entries[i].inode != inode)) {
+		i = (i + 1) & mask;
+	}
+	return &cache->entries[i];
+}
+
+/*
+ *	This function looks a regular file up in the cache before it is queued. A file with the
+ *	size and modification time it was cached with is not read again, unless it was cached
+ *	in the second it was last changed and its last bytes changed since. A file that grew
+ *	and still has the bytes it was cached with is counted from where the cache left off.
+ *	Only the CACHE_TAIL bytes before the cached size are checked, so a file changed before
+ *	them and grown as well is taken for appended to. Small files are read whole anyway.
+ *
+ *	Parameters:
+ *		file_job* file -- the file, whose start, start_state and total are set
+ *	Return:
+ *		None
+ */
+void cache_check(file_job *file) {
+	cache_entry *e = cache_find(file->device, file->inode);
+	if(e->mode != cache_mode()) return;
+	if(e->size > (unsigned long) file->size) return;
+	int same = e->size == (unsigned long) file->size && e->mtime_sec == file->mtime.tv_sec &&
+			   e->mtime_nsec == file->mtime.tv_nsec;
+	if(same && e->mtime_sec < e->counted) cache->hits++;
+	else if(e->size == 0 || tail_hash(file->name, e->size) != e->tail_hash) return;
+	else if(same) cache->hits++;
+	else if(file->size <= SMALL_FILE) return;
+	else cache->appends++;
+	file->start = e->size;
+	file->total = e->total;
+	file->start_state.in_word = e->in_word;
+	file->start_state.line_pos = e->line_pos;
+	file->start_state.mb = e->mb;
+	file->end_state = file->start_state;
+}
+
+/*
+ *	This function saves the counts of a file in the cache, with the state at its end.
+ *
+ *	Parameters:
+ *		file_job* file -- a counted regular file
+ *	Return:
+ *		None
+ */
+void cache_store(file_job *file) {
+	cache_entry *e = cache_find(file->device, file->inode);
+	// Leave entries that were used as they are
+	if(e->mode == cache_mode() && e->size == (unsigned long) file->size && e->mtime_sec == file->mtime.tv_sec &&
+	   e->mtime_nsec == file->mtime.tv_nsec && e->mtime_sec < e->counted && file->start == file->size) return;
+	if(e->mode == 0) cache->header->size++;
+	// The file may have grown while it was counted, so its size is what was counted
+	e->device = file->device;
+	e->inode = file->inode;
+	e->size = file->total.bytes;
+	e->mtime_sec = file->mtime.tv_sec;
+	e->mtime_nsec = file->mtime.tv_nsec;
+	e->counted = time(NULL);
+	e->tail_hash = e->size > 0 ? tail_hash(file->name, e->size) : 0;
+	e->total = file->total;
+	e->line_pos = file->end_state.line_pos;
+	e->mb = file->end_state.mb;
+	e->in_word = file->end_state.in_word;
+	e->mode = cache_mode();
+}
+
+/*
+ *	This function hashes the CACHE_TAIL bytes of a file before an offset.
+ *
+ *	Parameters:
+ *		const char* name -- the file
+ *		off_t end -- the offset
+ *	Return:
+ *		The hash, or 0 when the file cannot be read
+ */
+unsigned long tail_hash(const char *name, off_t end) {
+	unsigned char tail[CACHE_TAIL];
+	off_t start = end > CACHE_TAIL ? end - CACHE_TAIL : 0;
+	int fd = open_input(name);
+	if(fd < 0) return 0;
+	ssize_t n = pread(fd, tail, end - start, start);
+	close(fd);
+	if(n != end - start) return 0;
+	return token_hash(tail, n);
+}
+
+/*
+ *	This function tells which kind of counts the kernel gives, as the cache keeps them
+ *	apart: the ASCII kernels, -L or -locale.
+ *
+ *	Return:
+ *		1, 2 or 3
+ */
+int cache_mode(void) {
+	if(kernel == count_locale) return 3;
+	if(kernel == count_columns) return 2;
+	return 1;
+}
+
+/*
+ *	This function orders files for batch mode, by device and inode (roughly their order
+ *	on disk) or by size.
+ *
+ *	Parameters:
+ *		const void* a -- a file_job
+ *		const void* b -- another file_job
+ *	Return:
+ *		Below 0, 0 or above 0 as a comes before, with or after b
+ */
+int compare_files(const void *a, const void *b) {
+	const file_job *x = (const file_job*) a;
+	const file_job *y = (const file_job*) b;
+	if(file_order == ORDER_SIZE && x->size != y->size) return x->size < y->size ? -1 : 1;
+	if(x->device != y->device) return x->device < y->device ? -1 : 1;
+	if(x->inode != y->inode) return x->inode < y->inode ? -1 : 1;
+	return 0;
+}
+
+/*
+ *	This function adds every file under a directory to a list, going into subdirectories.
+ *	Symbolic links found in the directories are not followed, and anything that is not a
+ *	regular file is left out. Directories that cannot be read are reported and skipped.
+ *
+ *	Parameters:
+ *		const char* path -- the directory
+ *		file_list* list -- the list to add to
+ *	Return:
+ *		None
+ */
+void walk_directory(const char *path, file_list *list) {
+	DIR *dir = opendir(path);
+	if(dir == NULL) {
+		fprintf(stderr, "wordcount: %s: %s\n", path, strerror(errno));
+		return;
+	}
+	size_t length = strlen(path);
+	struct dirent *entry;
+	while((entry = readdir(dir)) != NULL) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		char *name = (char*) malloc(length + strlen(entry->d_name) + 2);
+		if(name == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate file name.\n");
+			exit(1);
+		}
+		sprintf(name, length > 0 && path[length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+		unsigned char type = entry->d_type;
+		if(type == DT_UNKNOWN) {
+			struct stat st;
+			if(lstat(name, &st) == 0) type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+		}
+		if(type == DT_DIR) walk_directory(name, list);
+		else if(type == DT_REG) list_add(list, name);
+		free(name);
+	}
+	closedir(dir);
+}
+
+/*
+ *	This function adds the file names of a file list, one per line, to a list; "-" reads
+ *	the list from standard input.
+ *
+ *	Parameters:
+ *		const char* name -- the file list
+ *		file_list* list -- the list to add to
+ *	Return:
+ *		None
+ */
+void read_file_list(const char *name, file_list *list) {
+	FILE *file = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	if(file == NULL) {
+		fprintf(stderr, "[ERROR] Unable to open file list %s.\n", name);
+		exit(1);
+	}
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t n;
+	while((n = getline(&line, &size, file)) > 0) {
+		if(line[n - 1] == '\n') line[--n] = '\0';
+		if(n > 0) list_add(list, line);
+	}
+	free(line);
+	if(file != stdin) fclose(file);
+}
+
+/*
+ *	This function adds a copy of a file name to a list.
+ *
+ *	Parameters:
+ *		file_list* list -- the list
+ *		const char* name -- the file name
+ *	Return:
+ *		None
+ */
+void list_add(file_list *list, const char *name) {
+	if(list->size == list->capacity) {
+		list->capacity = list->capacity > 0 ? 2 * list->capacity : 64;
+		list->names = (char**) realloc(list->names, list->capacity * sizeof(char*));
+	}
+	if(list->names == NULL || (list->names[list->size] = strdup(name)) == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate file list.\n");
+		exit(1);
+	}
+	list->size++;
+}
+
+/*
+ *	This function gives the time since a start time.
+ *
+ *	Parameters:
+ *		struct timespec* start -- the start, from CLOCK_MONOTONIC
+ *	Return:
+ *		Seconds since start
+ */
+double elapsed_seconds(struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ *	This function finds the most frequent tokens of the files (-top): runs of bytes that
+ *	are not whitespace. Every file is mapped whole (anything that cannot be mapped is read
+ *	into memory) and its chunks are tokenized by a pool of threads; a token belongs to the
+ *	chunk it starts in. Each thread counts into a table of its own, and the tables are
+ *	merged at the end. With -sketch every thread keeps a Count-Min Sketch and the k tokens
+ *	with the highest estimates instead, so memory stays bounded however many distinct tokens
+ *	there are, and the merged counts are estimates that can only be too high.
+ *
+ *	Parameters:
+ *		int num_files -- number of file names
+ *		char* file_names[] -- file names to count
+ *		int num_threads -- number of worker threads
+ *		unsigned long chunk_size -- largest byte range one worker tokenizes at a time
+ *		int k -- number of tokens to print
+ *		unsigned long sketch_width -- counters per sketch row, or 0 to count exactly
+ *	Return:
+ *		0 if every file was read, otherwise 1
  */
-int get_word_count(char *file_name) {
-	int wc = 0;
-	FILE *f = fopen(file_name, "r");
-	if(f != NULL) {
-		char *line;
-		int status = 0;
-		while(status == 0) {
-			line = read_line(f, &status);
-			char *c;
-			int hit_word = 0;
-			for(c = line; *c != '\0'; c++) {
-				if((*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r')) {
-					if(hit_word == 1) {
-						wc++;
-						hit_word = 0;
-					}
-				} else hit_word = 1;
-			}
-			if(hit_word) wc++;
-			free(line);
+int count_top(int num_files, char *file_names[], int num_threads, unsigned long chunk_size, int k, unsigned long sketch_width) {
+	work_queue queue;
+	int i, f;
+	int status = 0;
+	build_queue(&queue, num_files, file_names, chunk_size, 0);
+	// Tokens are views into the data of the files, which stays around until they are printed
+	for(f = 0; f < num_files; f++) {
+		file_job *file = &queue.files[f];
+		if(file->error) continue;
+		if(map_input(file) != 0) {
+			file->error = errno;
+			continue;
+		}
+	}
+	if(num_threads > queue.num_chunks) num_threads = queue.num_chunks > 0 ? queue.num_chunks : 1;
+	top_worker *workers = (top_worker*) calloc(num_threads, sizeof(top_worker));
+	pthread_t *threads = (pthread_t*) malloc(num_threads * sizeof(pthread_t));
+	if(workers == NULL || threads == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate threads.\n");
+		exit(1);
+	}
+	for(i = 0; i < num_threads; i++) {
+		workers[i].queue = &queue;
+		workers[i].k = k;
+		table_init(&workers[i].table, sketch_width > 0 ? 4 * (unsigned long) k : 1UL << 16);
+		if(sketch_width > 0) sketch_init(&workers[i].sketch, sketch_width);
+		if(pthread_create(&threads[i], NULL, top_worker_run, &workers[i]) != 0) {
+			fprintf(stderr, "[ERROR] Unable to create thread.\n");
+			exit(1);
+		}
+	}
+	for(i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&queue.lock);
+	// Merge into the first thread's table, or with sketches add the counters up and look the
+	// candidates of every thread up in the sum
+	token_table *merged = &workers[0].table;
+	unsigned long tokens = workers[0].tokens;
+	if(sketch_width > 0) {
+		token_table candidates;
+		table_init(&candidates, 4 * (unsigned long) k * num_threads);
+		for(i = 1; i < num_threads; i++) {
+			for(unsigned long j = 0; j < SKETCH_DEPTH * sketch_width; j++) workers[0].sketch.counters[j] += workers[i].sketch.counters[j];
 		}
+		for(i = 0; i < num_threads; i++) {
+			if(i > 0) tokens += workers[i].tokens;
+			for(unsigned long j = 0; j < workers[i].table.size; j++) {
+				token_entry *e = &workers[i].table.entries[j];
+				token_entry *c = table_find(&candidates, e->key, e->length, e->hash, 1);
+				c->count = sketch_estimate(&workers[0].sketch, e->hash);
+			}
+		}
+		table_free(merged);
+		workers[0].table = candidates;
 	} else {
+		for(i = 1; i < num_threads; i++) {
+			tokens += workers[i].tokens;
+			for(unsigned long j = 0; j < workers[i].table.size; j++) {
+				token_entry *e = &workers[i].table.entries[j];
+				table_find(merged, e->key, e->length, e->hash, 1)->count += e->count;
+			}
+		}
+	}
+	// Pick the top k with a min-heap of entry indices, then print them from the top
+	int *heap = (int*) malloc((k > 0 ? k : 1) * sizeof(int));
+	if(heap == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate heap.\n");
+		exit(1);
+	}
+	int heap_size = 0;
+	for(unsigned long j = 0; j < merged->size; j++) {
+		if(heap_size < k) {
+			heap[heap_size++] = (int) j;
+			heap_up(merged->entries, heap, heap_size - 1);
+		} else if(k > 0 && token_less(&merged->entries[heap[0]], &merged->entries[j])) {
+			heap[0] = (int) j;
+			heap_down(merged->entries, heap, heap_size, 0);
+		}
+	}
+	int printed = heap_size;
+	while(heap_size > 1) {
+		int top = heap[0];
+		heap[0] = heap[--heap_size];
+		heap[heap_size] = top;
+		heap_down(merged->entries, heap, heap_size, 0);
+	}
+	for(i = 0; i < printed; i++) {
+		token_entry *e = &merged->entries[heap[i]];
+		printf("%7lu %.*s\n", e->count, (int) e->length, (const char*) e->key);
+	}
+	for(f = 0; f < num_files; f++) {
+		file_job *file = &queue.files[f];
+		if(file->error) {
+			fprintf(stderr, "wordcount: %s: %s\n", file->name != NULL ? file->name : "-", strerror(file->error));
+			status = 1;
+		}
+	}
+	if(sketch_width > 0) {
+		printf("%lu tokens, top %d by Count-Min estimate (%d x %lu counters per thread)\n", tokens, printed,
+			   SKETCH_DEPTH, sketch_width);
+	} else printf("%lu tokens, %lu distinct, top %d\n", tokens, merged->size, printed);
+	for(i = 0; i < num_threads; i++) {
+		table_free(&workers[i].table);
+		free(workers[i].sketch.counters);
+		free(workers[i].heap);
+	}
+	for(f = 0; f < num_files; f++) unmap_input(&queue.files[f]);
+	free(heap);
+	free(workers);
+	free(threads);
+	free(queue.chunks);
+	free(queue.files);
+	return status;
+}
+
+/*
+ *	This function is run by each thread of -top: it takes chunks off the queue and counts
+ *	the tokens starting in them. A token that starts in a chunk is followed past its end.
+ *
+ *	Parameters:
+ *		void* arg -- the top_worker
+ *	Return:
+ *		NULL
+ */
+void *top_worker_run(void *arg) {
+	top_worker *w = (top_worker*) arg;
+	work_queue *queue = w->queue;
+	for(;;) {
+		pthread_mutex_lock(&queue->lock);
+		int i = queue->next < queue->num_chunks ? queue->next++ : -1;
+		pthread_mutex_unlock(&queue->lock);
+		if(i < 0) break;
+		chunk *c = &queue->chunks[i];
+		// A batch is every one of its files whole
+		int last = c->batch > 0 ? c->file + c->batch : c->file + 1;
+		for(int f = c->file; f < last; f++) {
+			file_job *file = &queue->files[f];
+			if(file->error || file->data == NULL) continue;
+			const unsigned char *data = file->data;
+			size_t size = file->data_size;
+			size_t j = c->batch > 0 ? 0 : c->offset;
+			size_t end = c->batch > 0 || c->length < 0 || (size_t) (c->offset + c->length) > size ? size : (size_t) (c->offset + c->length);
+			// Skip the end of a token that started in the chunk before
+			if(j > 0 && byte_class[data[j - 1]] != CLASS_SPACE) {
+				while(j < end && byte_class[data[j]] != CLASS_SPACE) j++;
+			}
+			for(;;) {
+				while(j < end && byte_class[data[j]] == CLASS_SPACE) j++;
+				if(j >= end) break;
+				size_t start = j;
+				while(j < size && byte_class[data[j]] != CLASS_SPACE) j++;
+				unsigned long hash = token_hash(data + start, j - start);
+				w->tokens++;
+				if(w->sketch.counters != NULL) sketch_add(w, data + start, j - start, hash);
+				else table_find(&w->table, data + start, j - start, hash, 1)->count++;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+ *	This function hashes a token 8 bytes at a time.
+ *
+ *	Parameters:
+ *		const unsigned char* p -- the token
+ *		size_t n -- its length
+ *	Return:
+ *		64-bit hash
+ */
+unsigned long token_hash(const unsigned char *p, size_t n) {
+	unsigned long h = 0x9E3779B97F4A7C15UL ^ n;
+	unsigned long word;
+	while(n >= 8) {
+		memcpy(&word, p, 8);
+		h = (h ^ word) * 0xBF58476D1CE4E5B9UL;
+		h ^= h >> 31;
+		p += 8;
+		n -= 8;
+	}
+	if(n > 0) {
+		word = 0;
+		memcpy(&word, p, n);
+		h = (h ^ word) * 0xBF58476D1CE4E5B9UL;
+	}
+	h ^= h >> 29;
+	h *= 0x94D049BB133111EBUL;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ *	Token tables. Distinct tokens live in an entries array that only grows, so indices into
+ *	it stay valid, and an open-addressing array of slots (entry index + 1, 0 for empty)
+ *	finds them by hash with linear probing. Keys are views into the file data.
+ */
+void table_init(token_table *t, unsigned long capacity) {
+	t->capacity = 16;
+	while(t->capacity < 2 * capacity) t->capacity *= 2;
+	t->slots = (unsigned int*) calloc(t->capacity, sizeof(unsigned int));
+	t->entry_capacity = t->capacity / 2;
+	t->entries = (token_entry*) malloc(t->entry_capacity * sizeof(token_entry));
+	t->size = 0;
+	if(t->slots == NULL || t->entries == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate token table.\n");
+		exit(1);
+	}
+}
+
+void table_free(token_table *t) {
+	free(t->slots);
+	free(t->entries);
+}
+
+// Find a token, adding it with a count of 0 when create is set; NULL when it is missing
+token_entry *table_find(token_table *t, const unsigned char *key, unsigned int length, unsigned long hash, int create) {
+	unsigned long mask = t->capacity - 1;
+	unsigned long i = hash & mask;
+	while(t->slots[i] != 0) {
+		token_entry *e = &t->entries[t->slots[i] - 1];
+		if(e->hash == hash && e->length == length && memcmp(e->key, key, length) == 0) return e;
+		i = (i + 1) & mask;
+	}
+	if(!create) return NULL;
+	// Keep the slots at most half full, growing the entries along with them
+	if(2 * (t->size + 1) > t->capacity) {
+		table_grow(t);
+		return table_find(t, key, length, hash, create);
+	}
+	if(t->size == t->entry_capacity) {
+		t->entry_capacity *= 2;
+		t->entries = (token_entry*) realloc(t->entries, t->entry_capacity * sizeof(token_entry));
+		if(t->entries == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate token table.\n");
+			exit(1);
+		}
+	}
+	token_entry *e = &t->entries[t->size];
+	e->key = key;
+	e->length = length;
+	e->hash = hash;
+	e->count = 0;
+	e->heap_index = -1;
+	t->slots[i] = (unsigned int) ++t->size;
+	return e;
+}
+
+// Double the slots and put every entry back
+void table_grow(token_table *t) {
+	unsigned long mask = 2 * t->capacity - 1;
+	unsigned int *slots = (unsigned int*) calloc(2 * t->capacity, sizeof(unsigned int));
+	if(slots == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate token table.\n");
+		exit(1);
+	}
+	for(unsigned long j = 0; j < t->size; j++) {
+		unsigned long i = t->entries[j].hash & mask;
+		while(slots[i] != 0) i = (i + 1) & mask;
+		slots[i] = (unsigned int) (j + 1);
+	}
+	free(t->slots);
+	t->slots = slots;
+	t->capacity *= 2;
+}
+
+// Remove the slot of an entry, shifting later slots of its probe sequence back into the hole
+void table_unlink(token_table *t, unsigned long entry) {
+	unsigned long mask = t->capacity - 1;
+	unsigned long i = t->entries[entry].hash & mask;
+	while(t->slots[i] != entry + 1) i = (i + 1) & mask;
+	unsigned long j = i;
+	for(;;) {
+		j = (j + 1) & mask;
+		if(t->slots[j] == 0) break;
+		unsigned long home = t->entries[t->slots[j] - 1].hash & mask;
+		// Move slot j into the hole at i unless its home lies cyclically in (i, j]
+		if((j > i && (home <= i || home > j)) || (j < i && (home <= i && home > j))) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+	t->slots[i] = 0;
+}
+
+/*
+ *	Count-Min Sketch of -sketch: SKETCH_DEPTH rows of counters, a token adding one to a
+ *	counter in every row. Its estimate is the smallest of its counters, which only errs by
+ *	counting other tokens hashed to the same counters. The row positions are derived from
+ *	the token hash by double hashing.
+ */
+void sketch_init(token_sketch *s, unsigned long width) {
+	s->width = width;
+	s->counters = (unsigned long*) calloc(SKETCH_DEPTH * width, sizeof(unsigned long));
+	if(s->counters == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate sketch.\n");
+		exit(1);
+	}
+}
+
+unsigned long sketch_estimate(token_sketch *s, unsigned long hash) {
+	unsigned long step = (hash >> 32) | 1;
+	unsigned long estimate = (unsigned long) -1;
+	for(int row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned long count = s->counters[row * s->width + (hash + row * step) % s->width];
+		if(count < estimate) estimate = count;
+	}
+	return estimate;
+}
+
+// Count a token in the sketch and keep the k tokens with the highest estimates in the
+// thread's table, which holds just the candidates, ordered in a min-heap by estimate
+void sketch_add(top_worker *w, const unsigned char *key, unsigned int length, unsigned long hash) {
+	token_sketch *s = &w->sketch;
+	unsigned long step = (hash >> 32) | 1;
+	unsigned long estimate = (unsigned long) -1;
+	for(int row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned long *count = &s->counters[row * s->width + (hash + row * step) % s->width];
+		if(++*count < estimate) estimate = *count;
+	}
+	token_table *t = &w->table;
+	token_entry *e = table_find(t, key, length, hash, 0);
+	if(e != NULL) {
+		e->count = estimate;
+		heap_down(t->entries, w->heap, t->size, e->heap_index);
+		return;
+	}
+	if((int) t->size < w->k) {
+		if(w->heap == NULL) w->heap = (int*) malloc(w->k * sizeof(int));
+		if(w->heap == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate heap.\n");
+			exit(1);
+		}
+		e = table_find(t, key, length, hash, 1);
+		e->count = estimate;
+		w->heap[t->size - 1] = (int) (t->size - 1);
+		e->heap_index = (int) (t->size - 1);
+		heap_up(t->entries, w->heap, (int) t->size - 1);
+		return;
+	}
+	// Replace the weakest candidate, reusing its entry
+	int weakest = w->heap[0];
+	if(estimate <= t->entries[weakest].count) return;
+	table_unlink(t, weakest);
+	e = &t->entries[weakest];
+	e->key = key;
+	e->length = length;
+	e->hash = hash;
+	e->count = estimate;
+	unsigned long mask = t->capacity - 1;
+	unsigned long i = hash & mask;
+	while(t->slots[i] != 0) i = (i + 1) & mask;
+	t->slots[i] = (unsigned int) weakest + 1;
+	heap_down(t->entries, w->heap, t->size, 0);
+}
+
+/*
+ *	Min-heap of entry indices, lowest count first; ties put the greater token first so that
+ *	equal counts come out in byte order. Entries remember their position in the heap.
+ */
+int token_less(token_entry *a, token_entry *b) {
+	if(a->count != b->count) return a->count < b->count;
+	size_t n = a->length < b->length ? a->length : b->length;
+	int order = memcmp(a->key, b->key, n);
+	if(order != 0) return order > 0;
+	return a->length > b->length;
+}
+
+void heap_up(token_entry *entries, int *heap, int i) {
+	while(i > 0) {
+		int parent = (i - 1) / 2;
+		if(!token_less(&entries[heap[i]], &entries[heap[parent]])) break;
+		int swap = heap[i];
+		heap[i] = heap[parent];
+		heap[parent] = swap;
+		entries[heap[i]].heap_index = i;
+		entries[heap[parent]].heap_index = parent;
+		i = parent;
+	}
+	entries[heap[i]].heap_index = i;
+}
+
+void heap_down(token_entry *entries, int *heap, int size, int i) {
+	for(;;) {
+		int smallest = i;
+		int left = 2 * i + 1;
+		int right = left + 1;
+		if(left < size && token_less(&entries[heap[left]], &entries[heap[smallest]])) smallest = left;
+		if(right < size && token_less(&entries[heap[right]], &entries[heap[smallest]])) smallest = right;
+		if(smallest == i) break;
+		int swap = heap[i];
+		heap[i] = heap[smallest];
+		heap[smallest] = swap;
+		entries[heap[i]].heap_index = i;
+		entries[heap[smallest]].heap_index = smallest;
+		i = smallest;
+	}
+	entries[heap[i]].heap_index = i;
+}
+
+/*
+ *	This function makes the whole of a file available in memory for -top: mapped when it
+ *	is a regular file, otherwise read until its end.
+ *
+ *	Parameters:
+ *		file_job* file -- the file, whose data and data_size are set
+ *	Return:
+ *		If successful: 0
+ *		If failed: -1 with errno set
+ */
+int map_input(file_job *file) {
+	int fd = open_input(file->name);
+	if(fd < 0) return -1;
+	file->data = NULL;
+	file->data_size = 0;
+	if(file->regular) {
+		if(file->size > 0) {
+			void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(map != MAP_FAILED) {
+				madvise(map, file->size, MADV_SEQUENTIAL);
+				file->data = (unsigned char*) map;
+				file->data_size = file->size;
+				file->mapped = 1;
+				close(fd);
+				return 0;
+			}
+		}
+	}
+	size_t capacity = READ_SIZE;
+	unsigned char *data = (unsigned char*) malloc(capacity);
+	ssize_t n;
+	while(data != NULL && (n = read(fd, data + file->data_size, capacity - file->data_size)) > 0) {
+		file->data_size += n;
+		if(file->data_size == capacity) {
+			capacity *= 2;
+			unsigned char *bigger = (unsigned char*) realloc(data, capacity);
+			if(bigger == NULL) free(data);
+			data = bigger;
+		}
+	}
+	if(data == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate input buffer.\n");
+		exit(1);
+	}
+	int error = n < 0 ? errno : 0;
+	close(fd);
+	file->data = data;
+	if(error) {
+		errno = error;
 		return -1;
 	}
-	fclose(f);
-	return wc;
+	return 0;
+}
+
+void unmap_input(file_job *file) {
+	if(file->data == NULL) return;
+	if(file->mapped) munmap((void*) file->data, file->data_size);
+	else free((void*) file->data);
 }
 
 /*
- *	This function takes in a file pointer and returns one valid, null-terminated line.
- *	The status integer is set to tell the caller that the file stream has reached its end.
+ *	This function counts a byte range of a file as if it started the file. The range is
+ *	mmapped, or read in READ_SIZE blocks when the file cannot be mapped.
  *
  *	Parameters:
- *		FILE* f -- file pointer to read from
- *		int* status -- int pointer that tells caller the status of read
+ *		int fd -- file to read from
+ *		off_t offset -- start of the range
+ *		off_t length -- length of the range
+ *		unsigned char* buffer -- READ_SIZE bytes to read into when mapping fails
+ *		counts* c -- counts to add to
+ *		count_state* s -- state to start from, updated to the end of the range
  *	Return:
- *		If successful: null-terminated char*
+ *		If successful: 0
+ *		If failed: -1
+ */
+int count_range(int fd, off_t offset, off_t length, unsigned char *buffer, counts *c, count_state *s) {
+	if(length == 0) return 0;
+	off_t map_offset = offset & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+	size_t map_size = offset + length - map_offset;
+	unsigned char *map = (unsigned char*) mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, map_offset);
+	if(map != MAP_FAILED) {
+		madvise(map, map_size, MADV_SEQUENTIAL);
+		kernel(map + (offset - map_offset), length, c, s);
+		c->bytes += length;
+		munmap(map, map_size);
+		return 0;
+	}
+	while(length > 0) {
+		ssize_t n = pread(fd, buffer, length < READ_SIZE ? length : READ_SIZE, offset);
+		if(n <= 0) return -1;
+		kernel(buffer, n, c, s);
+		c->bytes += n;
+		offset += n;
+		length -= n;
+	}
+	return 0;
+}
+
+/*
+ *	This function counts a file that is not split into chunks: a pipe, a device, or any
+ *	file followed with -follow. A reader thread fills one READ_SIZE buffer while this one
+ *	counts the other, so counting overlaps the reads. With -interval the counts so far are
+ *	printed every report_interval seconds, also while no data comes in.
+ *
+ *	Parameters:
+ *		int fd -- file to read from
+ *		const char* name -- name to print in reports, or NULL
+ *		counts* c -- counts to add to
+ *		count_state* s -- state to start from, updated to the end of the file
+ *	Return:
+ *		If successful: 0
+ *		If failed: -1 with errno set
+ */
+int count_stream(int fd, const char *name, counts *c, count_state *s) {
+	stream st;
+	pthread_t reader;
+	pthread_condattr_t attr;
+	struct timespec now, next_report;
+	int b = 0;
+	memset(&st, 0, sizeof(st));
+	st.fd = fd;
+	for(b = 0; b < 2; b++) {
+		st.buffers[b].data = (unsigned char*) malloc(READ_SIZE);
+		if(st.buffers[b].data == NULL) {
+			fprintf(stderr, "[ERROR] Unable to allocate read buffer.\n");
+			exit(1);
+		}
+	}
+	// Bigger pipe buffers mean fewer, larger reads; failing is harmless
+#ifdef F_SETPIPE_SZ
+	fcntl(fd, F_SETPIPE_SZ, READ_SIZE);
+#endif
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&st.cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if(pthread_create(&reader, NULL, stream_reader, &st) != 0) {
+		fprintf(stderr, "[ERROR] Unable to create thread.\n");
+		exit(1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &next_report);
+	next_report.tv_sec += (time_t) report_interval;
+	next_report.tv_nsec += (long) ((report_interval - (time_t) report_interval) * 1e9);
+	if(next_report.tv_nsec >= 1000000000L) {
+		next_report.tv_sec++;
+		next_report.tv_nsec -= 1000000000L;
+	}
+	b = 0;
+	for(;;) {
+		stream_buffer *buffer = &st.buffers[b];
+		pthread_mutex_lock(&st.lock);
+		while(!buffer->full) {
+			if(report_interval <= 0) pthread_cond_wait(&st.cond, &st.lock);
+			else if(pthread_cond_timedwait(&st.cond, &st.lock, &next_report) != 0) break;
+		}
+		int full = buffer->full;
+		pthread_mutex_unlock(&st.lock);
+		if(full) {
+			if(buffer->length <= 0) break;
+			kernel(buffer->data, buffer->length, c, s);
+			c->bytes += buffer->length;
+			pthread_mutex_lock(&st.lock);
+			buffer->full = 0;
+			pthread_cond_broadcast(&st.cond);
+			pthread_mutex_unlock(&st.lock);
+			b ^= 1;
+		}
+		if(report_interval > 0) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if(now.tv_sec > next_report.tv_sec || (now.tv_sec == next_report.tv_sec && now.tv_nsec >= next_report.tv_nsec)) {
+				report_stream(name, c, s);
+				next_report = now;
+				next_report.tv_sec += (time_t) report_interval;
+				next_report.tv_nsec += (long) ((report_interval - (time_t) report_interval) * 1e9);
+				if(next_report.tv_nsec >= 1000000000L) {
+					next_report.tv_sec++;
+					next_report.tv_nsec -= 1000000000L;
+				}
+			}
+		}
+	}
+	pthread_join(reader, NULL);
+	pthread_cond_destroy(&st.cond);
+	pthread_mutex_destroy(&st.lock);
+	free(st.buffers[0].data);
+	free(st.buffers[1].data);
+	errno = st.error;
+	return st.error ? -1 : 0;
+}
+
+/*
+ *	This function is run by the reader thread of a stream: it fills the two buffers in turn,
+ *	each as soon as the counter hands it back. At the end of the file it hands over an empty
+ *	buffer, unless -follow is on, then it waits for the file to grow until interrupted.
+ *
+ *	Parameters:
+ *		void* arg -- the stream
+ *	Return:
+ *		NULL
+ */
+void *stream_reader(void *arg) {
+	stream *st = (stream*) arg;
+	int b = 0;
+	for(;;) {
+		stream_buffer *buffer = &st->buffers[b];
+		pthread_mutex_lock(&st->lock);
+		while(buffer->full) pthread_cond_wait(&st->cond, &st->lock);
+		pthread_mutex_unlock(&st->lock);
+		ssize_t n;
+		for(;;) {
+			n = read(st->fd, buffer->data, READ_SIZE);
+			if(n < 0 && errno == EINTR && !stop_requested) continue;
+			if(n != 0 || !follow_files || stop_requested) break;
+			usleep(FOLLOW_POLL_US);
+		}
+		pthread_mutex_lock(&st->lock);
+		if(n < 0) st->error = errno == EINTR ? 0 : errno;
+		buffer->length = n;
+		buffer->full = 1;
+		pthread_cond_broadcast(&st->cond);
+		pthread_mutex_unlock(&st->lock);
+		if(n <= 0) break;
+		b ^= 1;
+	}
+	return NULL;
+}
+
+/*
+ *	This function prints the counts of a stream so far, including the line still being read.
+ *
+ *	Parameters:
+ *		const char* name -- name of the stream, or NULL
+ *		counts* c -- counts so far
+ *		count_state* s -- state so far
+ */
+void report_stream(const char *name, counts *c, count_state *s) {
+	counts so_far = *c;
+	if(s->line_pos > so_far.max_line) so_far.max_line = s->line_pos;
+	if(report_fields) print_counts(&so_far, report_fields, 7, name);
+	else printf("%s: %lu words so far\n", name != NULL ? name : "-", so_far.words);
+	fflush(stdout);
+}
+
+/*
+ *	This function opens a file to count, "-" or NULL being standard input.
+ *
+ *	Parameters:
+ *		const char* name -- file name
+ *	Return:
+ *		If successful: a file descriptor of its own
+ *		If failed: -1
+ */
+int open_input(const char *name) {
+	if(name == NULL || strcmp(name, "-") == 0) return dup(0);
+	return open(name, O_RDONLY);
+}
+
+/*
+ *	This function stats a file to count, "-" or NULL being standard input.
+ *
+ *	Parameters:
+ *		const char* name -- file name
+ *		struct stat* st -- set to the status of the file
+ *	Return:
+ *		If successful: 0
+ *		If failed: -1
+ */
+int stat_input(const char *name, struct stat *st) {
+	if(name == NULL || strcmp(name, "-") == 0) return fstat(0, st);
+	return stat(name, st);
+}
+
+/*
+ *	This function adds the counts of a chunk to the counts of the chunks before it. A chunk
+ *	is counted as if it started the file, so its first word was already started if the
+ *	chunks before it ended inside a word. The line being measured at the end of the file
+ *	also counts towards the maximum line length.
+ *
+ *	Parameters:
+ *		counts* total -- counts of the chunks so far
+ *		count_state* state -- state at the end of the chunks so far
+ *		counts* c -- counts of the chunk
+ *		count_state* s -- state at the end of the chunk
+ */
+void count_join(counts *total, count_state *state, counts *c, count_state *s) {
+	total->lines += c->lines;
+	total->words += c->words;
+	if(state->in_word && s->leading == 1) total->words--;
+	total->chars += c->chars;
+	total->bytes += c->bytes;
+	if(c->max_line > total->max_line) total->max_line = c->max_line;
+	if(s->line_pos > total->max_line) total->max_line = s->line_pos;
+	// A chunk of nothing but bytes that neither start nor end words passes the state through
+	if(s->leading >= 0) state->in_word = s->in_word;
+}
+
+/*
+ *	This function prints the selected counts of a file in wc's order and layout.
+ *
+ *	Parameters:
+ *		counts* c -- the counts
+ *		int fields -- FIELD_ flags to print
+ *		int width -- width of every number
+ *		const char* name -- file name to print after the counts
+ */
+void print_counts(counts *c, int fields, int width, const char *name) {
+	const char *separator = "";
+	if(fields & FIELD_LINES) {
+		printf("%s%*lu", separator, width, c->lines);
+		separator = " ";
+	}
+	if(fields & FIELD_WORDS) {
+		printf("%s%*lu", separator, width, c->words);
+		separator = " ";
+	}
+	if(fields & FIELD_CHARS) {
+		printf("%s%*lu", separator, width, c->chars);
+		separator = " ";
+	}
+	if(fields & FIELD_BYTES) {
+		printf("%s%*lu", separator, width, c->bytes);
+		separator = " ";
+	}
+	if(fields & FIELD_MAX_LINE) printf("%s%*lu", separator, width, c->max_line);
+	if(name != NULL) printf(" %s", name);
+	printf("\n");
+}
+
+/*
+ *	Counting kernels. Each one counts the newlines, word starts and characters of a block
+ *	of bytes and carries the state on to the next block. A word start is a word byte whose
+ *	closest space or word byte before it is a space (or that comes first). They all give
+ *	the same counts; the vector ones turn 64 bytes into bit masks of space, word, newline
+ *	and character lead bytes and add up the bits with popcount.
+ *
+ *	Parameters:
+ *		const unsigned char* p -- the bytes
+ *		size_t n -- number of bytes
+ *		counts* c -- counts to add to
+ *		count_state* s -- state after the bytes before p, updated for the next block
+ */
+void count_words_scalar(const unsigned char *p, size_t n, counts *c, count_state *s) {
+	unsigned long lines = 0, words = 0, chars = 0;
+	int word = s->in_word;
+	for(size_t i = 0; i < n; i++) {
+		int class = byte_class[p[i]];
+		if(class == CLASS_WORD) {
+			words += !word;
+			word = 1;
+		} else if(class == CLASS_SPACE) word = 0;
+		if(class != CLASS_OTHER && s->leading < 0) s->leading = class == CLASS_WORD;
+		lines += p[i] == '\n';
+		chars += (p[i] & 0xC0) != 0x80;
+	}
+	s->in_word = word;
+	c->lines += lines;
+	c->words += words;
+	c->chars += chars;
+}
+
+#if defined(__x86_64__)
+// Count 64 classified bytes. Bytes that are neither space nor word take on the state
+// before them: a run of them right after a word byte (or at the start of the block
+// while inside a word) is filled in by adding the run's first bit to the run, which
+// carries through and clears exactly the bits of the run.
+static inline void count_masks(unsigned long space, unsigned long word, unsigned long newline, unsigned long lead,
+							   counts *c, count_state *s) {
+	unsigned long other = ~(space | word);
+	unsigned long seed = ((word << 1) | (unsigned long) s->in_word) & other;
+	unsigned long inside = word | (other & ~(other + seed));
+	c->words += __builtin_popcountl(word & ~((inside << 1) | (unsigned long) s->in_word));
+	c->lines += __builtin_popcountl(newline);
+	c->chars += __builtin_popcountl(lead);
+	s->in_word = (int) (inside >> 63);
+	if(s->leading < 0 && (space | word) != 0) s->leading = (int) ((word >> __builtin_ctzl(space | word)) & 1);
+}
+
+// 16 bytes at a time: space is ' ' or \t to \r (b - 9 <= 4 unsigned), word is ' ' < b < 0x7F
+// (signed, so bytes from 0x80 up are neither) and a lead byte is anything but 0x80 to 0xBF
+void count_words_sse2(const unsigned char *p, size_t n, counts *c, count_state *s) {
+	const __m128i blank = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i four = _mm_set1_epi8(4);
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i del = _mm_set1_epi8(0x7F);
+	const __m128i continuation = _mm_set1_epi8(-65);
+	size_t i = 0;
+	for(; i + 64 <= n; i += 64) {
+		unsigned long space = 0, word = 0, lines = 0, lead = 0;
+		for(int k = 0; k < 4; k++) {
+			__m128i b = _mm_loadu_si128((const __m128i*) (p + i + 16 * k));
+			__m128i control = _mm_sub_epi8(b, tab);
+			__m128i is_space = _mm_or_si128(_mm_cmpeq_epi8(b, blank), _mm_cmpeq_epi8(_mm_min_epu8(control, four), control));
+			__m128i is_word = _mm_and_si128(_mm_cmpgt_epi8(b, blank), _mm_cmpgt_epi8(del, b));
+			space |= (unsigned long) (_mm_movemask_epi8(is_space) & 0xFFFF) << (16 * k);
+			word |= (unsigned long) (_mm_movemask_epi8(is_word) & 0xFFFF) << (16 * k);
+			lines |= (unsigned long) (_mm_movemask_epi8(_mm_cmpeq_epi8(b, newline)) & 0xFFFF) << (16 * k);
+			lead |= (unsigned long) (_mm_movemask_epi8(_mm_cmpgt_epi8(b, continuation)) & 0xFFFF) << (16 * k);
+		}
+		count_masks(space, word, lines, lead, c, s);
+	}
+	count_words_scalar(p + i, n - i, c, s);
+}
+
+// The same 32 bytes at a time
+__attribute__((target("avx2,popcnt,bmi")))
+void count_words_avx2(const unsigned char *p, size_t n, counts *c, count_state *s) {
+	const __m256i blank = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i four = _mm256_set1_epi8(4);
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i del = _mm256_set1_epi8(0x7F);
+	const __m256i continuation = _mm256_set1_epi8(-65);
+	size_t i = 0;
+	for(; i + 64 <= n; i += 64) {
+		unsigned long space = 0, word = 0, lines = 0, lead = 0;
+		for(int k = 0; k < 2; k++) {
+			__m256i b = _mm256_loadu_si256((const __m256i*) (p + i + 32 * k));
+			__m256i control = _mm256_sub_epi8(b, tab);
+			__m256i is_space = _mm256_or_si256(_mm256_cmpeq_epi8(b, blank),
+											   _mm256_cmpeq_epi8(_mm256_min_epu8(control, four), control));
+			__m256i is_word = _mm256_and_si256(_mm256_cmpgt_epi8(b, blank), _mm256_cmpgt_epi8(del, b));
+			space |= (unsigned long) (unsigned int) _mm256_movemask_epi8(is_space) << (32 * k);
+			word |= (unsigned long) (unsigned int) _mm256_movemask_epi8(is_word) << (32 * k);
+			lines |= (unsigned long) (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, newline)) << (32 * k);
+			lead |= (unsigned long) (unsigned int) _mm256_movemask_epi8(_mm256_cmpgt_epi8(b, continuation)) << (32 * k);
+		}
+		count_masks(space, word, lines, lead, c, s);
+	}
+	count_words_scalar(p + i, n - i, c, s);
+}
+#endif
+
+// ASCII with line lengths (-L): printable bytes take a column, tabs advance to the next
+// multiple of 8 and \n, \r and \f end the line being measured
+void count_columns(const unsigned char *p, size_t n, counts *c, count_state *s) {
+	unsigned long pos = s->line_pos;
+	count_words_scalar(p, n, c, s);
+	for(size_t i = 0; i < n; i++) {
+		unsigned char b = p[i];
+		if(b == '\n' || b == '\r' || b == '\f') {
+			if(pos > c->max_line) c->max_line = pos;
+			pos = 0;
+		} else if(b == '\t') pos += 8 - pos % 8;
+		else if(b >= ' ' && b < 0x7F) pos++;
+	}
+	s->line_pos = pos;
+}
+
+// Characters of the current locale (-locale), decoded with mbrtowc(). A character split
+// across blocks is finished in the next block; invalid bytes are skipped. ASCII bytes
+// between characters are classified like the ASCII kernels do, without decoding.
+void count_locale(const unsigned char *p, size_t n, counts *c, count_state *s) {
+	size_t i = 0;
+	while(i < n) {
+		wchar_t w;
+		if(p[i] < 0x80 && p[i] != '\t' && p[i] != '\n' && p[i] != '\r' && p[i] != '\f' && mbsinit(&s->mb)) {
+			int class = byte_class[p[i]];
+			if(class == CLASS_WORD) {
+				c->words += !s->in_word;
+				s->in_word = 1;
+				s->line_pos++;
+			} else if(class == CLASS_SPACE) {
+				s->in_word = 0;
+				s->line_pos += p[i] == ' ';
+			}
+			if(class != CLASS_OTHER && s->leading < 0) s->leading = class == CLASS_WORD;
+			c->chars++;
+			i++;
+			continue;
+		}
+		size_t r = mbrtowc(&w, (const char*) p + i, n - i, &s->mb);
+		if(r == (size_t) -2) break;
+		if(r == (size_t) -1) {
+			memset(&s->mb, 0, sizeof(s->mb));
+			i++;
+			continue;
+		}
+		i += r > 0 ? r : 1;
+		c->chars++;
+		int class = CLASS_OTHER;
+		if(w == '\n' || w == '\r' || w == '\f') {
+			c->lines += w == '\n';
+			if(s->line_pos > c->max_line) c->max_line = s->line_pos;
+			s->line_pos = 0;
+			class = CLASS_SPACE;
+		} else if(w == '\t') {
+			s->line_pos += 8 - s->line_pos % 8;
+			class = CLASS_SPACE;
+		} else if(w == '\v') class = CLASS_SPACE;
+		else if(iswprint(w)) {
+			int width = wcwidth(w);
+			if(width > 0) s->line_pos += width;
+			// No-break spaces separate words too
+			class = iswspace(w) || w == 0xA0 || w == 0x2007 || w == 0x202F || w == 0x2060 ? CLASS_SPACE : CLASS_WORD;
+		}
+		if(class == CLASS_WORD) {
+			c->words += !s->in_word;
+			s->in_word = 1;
+		} else if(class == CLASS_SPACE) s->in_word = 0;
+		if(class != CLASS_OTHER && s->leading < 0) s->leading = class == CLASS_WORD;
+	}
+}
+
+/*
+ *	This function picks a counting kernel by name, "auto" being the fastest one the CPU runs.
+ *
+ *	Parameters:
+ *		const char* name -- scalar, sse2, avx2 or auto
+ *	Return:
+ *		If successful: the kernel
  *		If failed: NULL
  */
-char *read_line(FILE* f, int* status) {
-	// Set base minimum memory size to allocate
-	int mem_size = 10;
-	int str_size = 0;
-	char* in = (char*) malloc(mem_size);
-	char c;
-	// Loop through each character in the file until you reach end of line
-	while((c = getc(f)) != '\n') {
-		// Notify the caller that file pointer has been finished
-		if(c == EOF) {
-			*status = -1;
-			break;
-		}
-		// Allocate more memory if needed
-		str_size++;
-		if(str_size + 1 > mem_size) {
-			mem_size *= 2;
-			in = (char*) realloc(in, mem_size);
-		}
-		if(in == NULL) {
-			free(in);
-			return NULL;
-		}
-		// Add character to return char*
-		in[str_size - 1] = c;
-	}
-	// Make the return char* null-terminated
-	in[str_size] = '\0';
-	in = (char*) realloc(in, str_size + 1);
-	if(in == NULL) {
-		free(in);
-		return NULL;
-	}
-	return in;
+count_kernel find_kernel(const char *name) {
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	int avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi");
+	if(strcmp(name, "auto") == 0) return avx2 ? count_words_avx2 : count_words_sse2;
+	if(strcmp(name, "avx2") == 0) return avx2 ? count_words_avx2 : NULL;
+	if(strcmp(name, "sse2") == 0) return count_words_sse2;
+#else
+	if(strcmp(name, "auto") == 0) return count_words_scalar;
+#endif
+	if(strcmp(name, "scalar") == 0) return count_words_scalar;
+	return NULL;
+}
+
+/*
+ *	This function is the SIGINT and SIGTERM handler under -follow: the readers stop waiting
+ *	for files to grow, so the counts so far get printed.
+ *
+ *	Parameters:
+ *		int sig -- the signal
+ */
+void request_stop(int sig) {
+	(void) sig;
+	stop_requested = 1;
+}
+
+/*
+ *	This function parses a size with an optional K, M or G suffix.
+ *
+ *	Parameters:
+ *		const char* s -- the size
+ *	Return:
+ *		If successful: the size in bytes
+ *		If failed: 0
+ */
+unsigned long parse_size(const char *s) {
+	char *end;
+	unsigned long size = strtoul(s, &end, 10);
+	if(*end == 'K' || *end == 'k') size <<= 10;
+	else if(*end == 'M' || *end == 'm') size <<= 20;
+	else if(*end == 'G' || *end == 'g') size <<= 30;
+	else if(*end != '\0') return 0;
+	return size;
+}
+
+/*
+ *	This function takes in a file name then tries to open it and count the words in the file.
+ *
+ *	Parameters:
+ *		char* file_name -- file name to try to open
+ *	Return:
+ *		If successful: number of words in file
+ *		If failed: -1
+ */
+long get_word_count(char *file_name) {
+	counts c;
+	count_state s;
+	struct stat st;
+	int fd = open(file_name, O_RDONLY);
+	if(fd < 0) return -1;
+	unsigned char *buffer = (unsigned char*) malloc(READ_SIZE);
+	if(buffer == NULL) {
+		fprintf(stderr, "[ERROR] Unable to allocate read buffer.\n");
+		exit(1);
+	}
+	memset(&c, 0, sizeof(c));
+	memset(&s, 0, sizeof(s));
+	int status;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) status = count_range(fd, 0, st.st_size, buffer, &c, &s);
+	else status = count_stream(fd, file_name, &c, &s);
+	free(buffer);
+	close(fd);
+	return status == 0 ? (long) c.words : -1;
 }